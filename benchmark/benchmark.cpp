@@ -0,0 +1,445 @@
+/* Copyright (c) 2017, MariaDB Corporation. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301  USA
+ */
+
+/**
+ * Throughput benchmark for the CDC connector
+ *
+ * The benchmark starts an in-process mock CDC server and measures each stage
+ * of reading a stream for a set of workloads. The results are printed as one
+ * JSON object per line so that they can be collected and compared over time.
+ *
+ * The socket, split and parse stages are measured in isolation. The row build
+ * and value access stages can't be isolated from the connector so they are
+ * derived from the full pipeline: row build is the time Connection::read()
+ * takes in excess of the isolated stages and value access is the time spent
+ * reading all values of the returned rows.
+ */
+
+#include "../cdc_connector.h"
+#include "../mock/mock_server.h"
+
+#include <arpa/inet.h>
+#include <atomic>
+#include <errno.h>
+#include <getopt.h>
+#include <iostream>
+#include <new>
+#include <openssl/sha.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READBUF_SIZE 32 * 1024
+
+/**
+ * Allocation counting, only allocations made by the benchmark thread are counted
+ */
+
+static std::atomic<uint64_t> n_allocs(0);
+static __thread bool counting = false;
+
+static void* count_malloc(size_t size)
+{
+    if (counting)
+    {
+        n_allocs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return malloc(size);
+}
+
+void* operator new(size_t size)
+{
+    void* ptr = count_malloc(size);
+
+    if (!ptr)
+    {
+        throw std::bad_alloc();
+    }
+
+    return ptr;
+}
+
+void operator delete(void* ptr) throw()
+{
+    free(ptr);
+}
+
+// Keeps the value access from being optimized away
+static volatile size_t value_sink = 0;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The measurements of one stage
+struct Result
+{
+    Result():
+        rows(0),
+        bytes(0),
+        ns(0),
+        allocs(0)
+    {
+    }
+
+    uint64_t rows;
+    uint64_t bytes;
+    int64_t  ns;        // Negative for a derived stage that is within the noise
+    int64_t  allocs;
+};
+
+// Measures the time and allocations of a stage
+class Measure
+{
+public:
+    Measure(Result& result):
+        m_result(result),
+        m_allocs(n_allocs.load()),
+        m_start(now_ns())
+    {
+        counting = true;
+    }
+
+    ~Measure()
+    {
+        counting = false;
+        m_result.ns += now_ns() - m_start;
+        m_result.allocs += n_allocs.load() - m_allocs;
+    }
+
+private:
+    Result&  m_result;
+    uint64_t m_allocs;
+    uint64_t m_start;
+};
+
+struct Workload
+{
+    const char* name;
+    int         int_columns;
+    int         string_columns;
+    size_t      string_size;
+};
+
+static const Workload workloads[] =
+{
+    {"narrow_numeric", 4,  0,  0},
+    {"narrow_string",  0,  4,  32},
+    {"wide_numeric",   64, 0,  0},
+    {"wide_string",    8,  56, 32},
+};
+
+static void print(const std::string& workload, const std::string& stage, bool derived, const Result& r)
+{
+    double secs = r.ns / 1e9;
+    double rows = r.rows ? r.rows : 1;
+
+    std::cout << "{\"workload\": \"" << workload << "\", \"stage\": \"" << stage << "\""
+              << ", \"derived\": " << (derived ? "true" : "false")
+              << ", \"rows\": " << r.rows
+              << ", \"bytes\": " << r.bytes
+              << ", \"seconds\": " << secs
+              << ", \"rows_per_sec\": " << (secs > 0 ? r.rows / secs : 0)
+              << ", \"mb_per_sec\": " << (secs > 0 ? r.bytes / secs / 1e6 : 0)
+              << ", \"ns_per_row\": " << r.ns / rows
+              << ", \"allocs_per_row\": " << r.allocs / rows
+              << "}" << std::endl;
+}
+
+static std::string bin2hex(const uint8_t *data, size_t len)
+{
+    std::string result;
+    static const char hexconvtab[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < len; i++)
+    {
+        result += hexconvtab[data[i] >> 4];
+        result += hexconvtab[data[i] & 0x0f];
+    }
+
+    return result;
+}
+
+static bool expect_ok(int fd)
+{
+    char buf[64];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    return n >= 3 && memcmp(buf, "OK\n", 3) == 0;
+}
+
+/**
+ * Socket read: the raw stream is read in the same sized chunks as the
+ * connector does, with a poll before each read
+ */
+static bool bench_socket(const CDC::MockConfig& config, uint16_t port, uint64_t total, Result& result)
+{
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1((const uint8_t*)config.password.c_str(), config.password.length(), digest);
+    std::string auth = config.user + ":";
+    auth = bin2hex((const uint8_t*)auth.c_str(), auth.length()) + bin2hex(digest, sizeof(digest));
+    std::string reg = "REGISTER UUID=CDC_BENCHMARK, TYPE=JSON";
+    std::string req = "REQUEST-DATA test.t1";
+
+    if (fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        write(fd, auth.c_str(), auth.length()) == -1 || !expect_ok(fd) ||
+        write(fd, reg.c_str(), reg.length()) == -1 || !expect_ok(fd) ||
+        write(fd, req.c_str(), req.length()) == -1)
+    {
+        std::cerr << "Failed to set up raw stream: " << strerror(errno) << std::endl;
+        close(fd);
+        return false;
+    }
+
+    char buf[READBUF_SIZE];
+    uint64_t bytes = 0;
+
+    {
+        Measure m(result);
+
+        while (bytes < total)
+        {
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            ssize_t n;
+
+            if (poll(&pfd, 1, 10000) <= 0 || (n = read(fd, buf, sizeof(buf))) <= 0)
+            {
+                break;
+            }
+
+            bytes += n;
+        }
+    }
+
+    close(fd);
+    result.rows = config.rows;
+    result.bytes = bytes;
+    return bytes == total;
+}
+
+/**
+ * Line split: the stream is split into one string per line like the connector
+ * does it
+ */
+static void bench_split(const CDC::MockConfig& config, const std::string& stream,
+                        std::vector<std::string>& lines, Result& result)
+{
+    lines.clear();
+    lines.reserve(config.rows + 1);
+
+    {
+        Measure m(result);
+        std::string::const_iterator start = stream.begin();
+        std::string::const_iterator it;
+
+        while ((it = std::find(start, stream.end(), '\n')) != stream.end())
+        {
+            lines.push_back(std::string(start, it));
+            start = it + 1;
+        }
+    }
+
+    result.rows = config.rows;
+    result.bytes = stream.length();
+}
+
+/**
+ * JSON parse: each line is parsed with the same flags the connector uses
+ */
+static void bench_parse(const CDC::MockConfig& config, const std::vector<std::string>& lines,
+                        uint64_t total, Result& result)
+{
+    Measure m(result);
+
+    for (std::vector<std::string>::const_iterator it = lines.begin(); it != lines.end(); it++)
+    {
+        json_error_t err;
+        json_t* js = json_loads(it->c_str(), JSON_ALLOW_NUL, &err);
+        json_decref(js);
+    }
+
+    result.rows = config.rows;
+    result.bytes = total;
+}
+
+/**
+ * The full pipeline: Connection::read() with and without accessing the values.
+ * Only the read loop is measured, connecting is not part of any stage.
+ */
+static bool bench_connector(const CDC::MockConfig& config, uint16_t port, uint64_t total,
+                            bool access, Result& result)
+{
+    CDC::Connection conn("127.0.0.1", port, config.user, config.password);
+    bool ok = conn.connect("test.t1");
+
+    if (ok)
+    {
+        Measure m(result);
+
+        for (uint64_t i = 0; ok && i < config.rows; i++)
+        {
+            CDC::Row row = conn.read();
+
+            if (!row)
+            {
+                ok = false;
+            }
+            else if (access)
+            {
+                for (size_t j = 0; j < row->length(); j++)
+                {
+                    value_sink += row->value(j).length();
+                }
+            }
+        }
+    }
+
+    if (!ok)
+    {
+        std::cerr << "Failed to read stream: " << conn.error() << std::endl;
+    }
+
+    result.rows = config.rows;
+    result.bytes = total;
+    return ok;
+}
+
+static Result difference(const Result& a, const Result& b)
+{
+    Result r = a;
+    r.ns = a.ns - b.ns;
+    r.allocs = a.allocs - b.allocs;
+    return r;
+}
+
+static void usage()
+{
+    std::cout << "Usage: cdc_benchmark [--rows=N] [--workload=NAME]" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Workloads:";
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        std::cout << " " << workloads[i].name;
+    }
+
+    std::cout << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    static struct option long_options[] =
+    {
+        {"rows",     required_argument, 0, 'n'},
+        {"workload", required_argument, 0, 'w'},
+        {"help",     no_argument,       0, 'h'},
+        {0, 0, 0, 0}
+    };
+
+    uint64_t rows = 200000;
+    std::string only;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            rows = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'w':
+            only = optarg;
+            break;
+
+        default:
+            usage();
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    json_set_alloc_funcs(count_malloc, free);
+    int rval = 0;
+
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+    {
+        const Workload& w = workloads[i];
+
+        if (!only.empty() && only != w.name)
+        {
+            continue;
+        }
+
+        CDC::MockConfig config;
+        config.rows = rows;
+        config.int_columns = w.int_columns;
+        config.string_columns = w.string_columns;
+        config.string_size = w.string_size;
+
+        CDC::MockServer server(config);
+
+        if (!server.start())
+        {
+            std::cerr << server.error() << std::endl;
+            return 1;
+        }
+
+        std::string stream = CDC::MockServer::generate(config);
+        std::vector<std::string> lines;
+        Result socket, split, parse, connector, access;
+
+        if (!bench_socket(config, server.port(), stream.length(), socket) ||
+            !bench_connector(config, server.port(), stream.length(), false, connector) ||
+            !bench_connector(config, server.port(), stream.length(), true, access))
+        {
+            rval = 1;
+        }
+
+        bench_split(config, stream, lines, split);
+        bench_parse(config, lines, stream.length(), parse);
+
+        Result isolated = socket;
+        isolated.ns += split.ns + parse.ns;
+        isolated.allocs += split.allocs + parse.allocs;
+
+        print(w.name, "socket_read", false, socket);
+        print(w.name, "line_split", false, split);
+        print(w.name, "json_parse", false, parse);
+        print(w.name, "row_build", true, difference(connector, isolated));
+        print(w.name, "value_access", true, difference(access, connector));
+        print(w.name, "total", false, access);
+
+        server.stop();
+    }
+
+    return rval;
+}
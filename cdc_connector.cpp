@@ -20,31 +20,87 @@
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <atomic>
+#include <ctype.h>
+#include <deque>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <fstream>
 #include <iostream>
 #include <jansson.h>
+#include <math.h>
 #include <netdb.h>
 #include <openssl/sha.h>
 #include <poll.h>
+#include <sched.h>
 #include <sstream>
 #include <stdexcept>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 
 #define CDC_CONNECTOR_VERSION "1.0.0"
 
+/**
+ * USDT probes of the cdc_connector provider
+ *
+ * The probes use semaphores so that arguments that are expensive to compute
+ * are only computed while a tracer is attached. Without sys/sdt.h the probes
+ * compile to nothing.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define CDC_PROBE_SEMAPHORE(name) \
+    unsigned short cdc_connector_##name##_semaphore __attribute__((used, section(".probes")))
+#define CDC_PROBE_ENABLED(name) __builtin_expect(cdc_connector_##name##_semaphore, 0)
+#define CDC_PROBE0(name) DTRACE_PROBE(cdc_connector, name)
+#define CDC_PROBE1(name, a) DTRACE_PROBE1(cdc_connector, name, a)
+#define CDC_PROBE2(name, a, b) DTRACE_PROBE2(cdc_connector, name, a, b)
+
+CDC_PROBE_SEMAPHORE(read);
+CDC_PROBE_SEMAPHORE(line);
+CDC_PROBE_SEMAPHORE(parse_start);
+CDC_PROBE_SEMAPHORE(parse_end);
+CDC_PROBE_SEMAPHORE(schema);
+CDC_PROBE_SEMAPHORE(row);
+CDC_PROBE_SEMAPHORE(timeout);
+CDC_PROBE_SEMAPHORE(error);
+#else
+#define CDC_PROBE_ENABLED(name) false
+#define CDC_PROBE0(name)
+#define CDC_PROBE1(name, a)
+#define CDC_PROBE2(name, a, b)
+#endif
+
 #define ERRBUF_SIZE 512
 #define READBUF_SIZE 32 * 1024
 
+// The rows of a batch that are dictionary encoded regardless of their values
+#define DICTIONARY_MIN_ROWS 64
+
+// The precision of a DECIMAL stored in 128 bits
+#define MAX_DECIMAL_DIGITS 38
+
 static const char OK_RESPONSE[] = "OK\n";
 
 static const char CLOSE_MSG[] = "CLOSE";
 static const char REGISTER_MSG[] = "REGISTER UUID=CDC_CONNECTOR-" CDC_CONNECTOR_VERSION ", TYPE=";
 static const char REQUEST_MSG[] = "REQUEST-DATA ";
 
+static const char UPDATE_BEFORE[] = "update_before";
+static const char UPDATE_AFTER[] = "update_after";
+static const char UPDATE[] = "update";
+static const char INSERT[] = "insert";
+static const char DELETE[] = "delete";
+
 namespace
 {
 
@@ -114,143 +170,431 @@ std::string json_to_string(json_t* json)
     return ss.str();
 }
 
+// Resolves the address of a MaxScale server
+bool resolve_address(const std::string& address, uint16_t port, struct sockaddr_in& dest, std::string& error)
+{
+    struct addrinfo *ai = NULL, hint = {};
+    hint.ai_socktype = SOCK_STREAM;
+    hint.ai_family = AF_UNSPEC;
+    hint.ai_flags = AI_ALL;
+
+    if (getaddrinfo(address.c_str(), NULL, &hint, &ai) != 0 || ai == NULL)
+    {
+        char err[ERRBUF_SIZE];
+        error = "Invalid address (";
+        error += address;
+        error += "): ";
+        error += strerror_r(errno, err, sizeof(err));
+        return false;
+    }
+
+    memset(&dest, 0, sizeof(dest));
+    memcpy(&dest, ai->ai_addr, ai->ai_addrlen);
+    dest.sin_port = htons(port);
+    dest.sin_family = AF_INET;
+    freeaddrinfo(ai);
+    return true;
+}
+
+// The GTID of a change event in `domain-server_id-sequence` format
+std::string json_gtid(json_t* js)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%lld-%lld-%lld",
+             (long long)json_integer_value(json_object_get(js, "domain")),
+             (long long)json_integer_value(json_object_get(js, "server_id")),
+             (long long)json_integer_value(json_object_get(js, "sequence")));
+    return buf;
 }
 
-namespace CDC
+std::string info_gtid(const CDC::EventInfo& info)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%lld-%lld-%lld",
+             (long long)info.domain, (long long)info.server_id, (long long)info.sequence);
+    return buf;
+}
+
+inline const char* json_event_type(json_t* js)
+{
+    json_t* type = json_object_get(js, "event_type");
+    return json_is_string(type) ? json_string_value(type) : "";
+}
+
+// The column type of an Avro field type, nullable fields are unions with "null"
+CDC::Column::Type avro_column_type(json_t* type)
 {
+    if (json_is_array(type))
+    {
+        size_t i;
+        json_t* v;
+
+        json_array_foreach(type, i, v)
+        {
+            if (!json_is_string(v) || strcmp(json_string_value(v), "null") != 0)
+            {
+                return avro_column_type(v);
+            }
+        }
+    }
+    else if (json_is_string(type))
+    {
+        const char* name = json_string_value(type);
+
+        if (strcmp(name, "int") == 0 || strcmp(name, "long") == 0 || strcmp(name, "boolean") == 0)
+        {
+            return CDC::Column::INT64;
+        }
+        else if (strcmp(name, "float") == 0 || strcmp(name, "double") == 0)
+        {
+            return CDC::Column::DOUBLE;
+        }
+    }
+
+    return CDC::Column::STRING;
+}
 
 /**
- * Public functions
+ * Decode DECIMAL and temporal fields natively based on their SQL type
+ *
+ * DECIMAL fields need a scale, either as the Avro `scale` attribute or in a
+ * `decimal(p,s)` type, without one they keep the column type of their Avro
+ * type. Temporal fields are only decoded if they are sent as strings.
+ *
+ * @param field     The field in the schema
+ * @param type      The column type, updated if the field is decoded natively
+ * @param precision Set to the precision of a DECIMAL field
+ * @param scale     Set to the scale of a DECIMAL field
  */
+void sql_column_type(json_t* field, CDC::Column::Type& type, int& precision, int& scale)
+{
+    json_t* real_type = json_object_get(field, "real_type");
+    precision = 0;
+    scale = 0;
 
-Connection::Connection(const std::string& address,
-                       uint16_t port,
-                       const std::string& user,
-                       const std::string& password,
-                       int timeout) :
-    m_fd(-1),
-    m_address(address),
-    m_port(port),
-    m_user(user),
-    m_password(password),
-    m_timeout(timeout),
-    m_connected(false)
+    if (!json_is_string(real_type))
+    {
+        return;
+    }
+
+    std::string name = json_string_value(real_type);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    size_t paren = name.find('(');
+    std::string base = name.substr(0, paren);
+
+    if ((base == "date" || base == "datetime" || base == "timestamp") && type == CDC::Column::STRING)
+    {
+        type = CDC::Column::DATETIME;
+    }
+    else if (base == "decimal" || base == "numeric")
+    {
+        int p = -1;
+        int s = -1;
+        json_t* js_precision = json_object_get(field, "precision");
+        json_t* js_scale = json_object_get(field, "scale");
+
+        if (paren != std::string::npos)
+        {
+            sscanf(name.c_str() + paren, "(%d,%d)", &p, &s);
+        }
+
+        if (json_is_integer(js_precision))
+        {
+            p = json_integer_value(js_precision);
+        }
+
+        if (json_is_integer(js_scale))
+        {
+            s = json_integer_value(js_scale);
+        }
+
+        if (s >= 0 && s <= MAX_DECIMAL_DIGITS)
+        {
+            type = CDC::Column::DECIMAL;
+            precision = p >= s && p > 0 && p <= MAX_DECIMAL_DIGITS ? p : MAX_DECIMAL_DIGITS;
+            scale = s;
+        }
+    }
+}
+
+inline bool is_digit(char c)
 {
-    m_buf_ptr = m_buffer.begin();
+    return c >= '0' && c <= '9';
 }
 
-Connection::~Connection()
+// Checks that all eight bytes of a word are ASCII digits
+inline bool is_eight_digits(uint64_t word)
 {
-    close();
+    return ((word & 0xF0F0F0F0F0F0F0F0ULL) |
+            (((word + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) == 0x3333333333333333ULL;
 }
 
-bool Connection::connect(const std::string& table, const std::string& gtid)
+// Converts eight ASCII digits loaded as a little-endian word with three multiplications
+inline uint32_t parse_eight_digits(uint64_t word)
 {
-    m_error.clear();
-    bool rval = false;
+    const uint64_t mask = 0x000000FF000000FFULL;
+    const uint64_t mul1 = 100 + (1000000ULL << 32);
+    const uint64_t mul2 = 1 + (10000ULL << 32);
+    word -= 0x3030303030303030ULL;
+    word = word * 10 + (word >> 8);
+    return (((word & mask) * mul1) + (((word >> 16) & mask) * mul2)) >> 32;
+}
 
-    struct addrinfo *ai = NULL, hint = {};
-    hint.ai_socktype = SOCK_STREAM;
-    hint.ai_family = AF_UNSPEC;
-    hint.ai_flags = AI_ALL;
+/**
+ * Append decimal digits to a value
+ *
+ * @param ptr   The digits, moved past the digits that were read
+ * @param end   The end of the string
+ * @param max   The maximum number of digits to read
+ * @param value The value the digits are appended to
+ *
+ * @return The number of digits read
+ */
+int read_digits(const char*& ptr, const char* end, int max, CDC::Int128& value)
+{
+    int n = 0;
 
-    if (getaddrinfo(m_address.c_str(), NULL, &hint, &ai) != 0 || ai == NULL)
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (max - n >= 8 && end - ptr >= 8)
     {
-        char err[ERRBUF_SIZE];
-        m_error = "Invalid address (";
-        m_error += m_address;
-        m_error += "): ";
-        m_error += strerror_r(errno, err, sizeof(err));
-        return false;
+        uint64_t word;
+        memcpy(&word, ptr, sizeof(word));
+
+        if (!is_eight_digits(word))
+        {
+            break;
+        }
+
+        value = value * 100000000 + parse_eight_digits(word);
+        ptr += 8;
+        n += 8;
+    }
+#endif
+
+    while (n < max && ptr < end && is_digit(*ptr))
+    {
+        value = value * 10 + (*ptr++ - '0');
+        n++;
     }
 
-    struct sockaddr_in remote = {};
-    memcpy(&remote, ai->ai_addr, ai->ai_addrlen);
-    remote.sin_port = htons(m_port);
-    remote.sin_family = AF_INET;
+    return n;
+}
 
-    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+CDC::Int128 power_of_ten(int n)
+{
+    CDC::Int128 rval = 1;
 
-    if (fd == -1)
+    while (n-- > 0)
     {
-        char err[ERRBUF_SIZE];
-        m_error = "Failed to create socket: ";
-        m_error += strerror_r(errno, err, sizeof(err));
+        rval *= 10;
     }
 
-    m_fd = fd;
-    int fl;
+    return rval;
+}
 
-    if (::connect(fd, (struct sockaddr*) &remote, sizeof(remote)) == -1)
+// Converts a double into a DECIMAL, rounded half away from zero
+bool double_to_decimal(double value, int precision, int scale, CDC::Int128& dest)
+{
+    long double scaled = value;
+
+    for (int i = 0; i < scale; i++)
     {
-        char err[ERRBUF_SIZE];
-        m_error = "Failed to connect: ";
-        m_error += strerror_r(errno, err, sizeof(err));
+        scaled *= 10;
     }
-    else if ((fl = fcntl(fd, F_GETFL, 0)) == -1 ||
-             fcntl(fd, F_SETFL, fl | O_NONBLOCK) == -1)
+
+    scaled = roundl(scaled);
+
+    if (!(fabsl(scaled) < (long double)power_of_ten(precision)))
     {
-        char err[ERRBUF_SIZE];
-        m_error = "Failed to set socket non-blocking: ";
-        m_error += strerror_r(errno, err, sizeof(err));
+        return false;
     }
-    else if (do_auth() && do_registration())
+
+    dest = (CDC::Int128)scaled;
+    return true;
+}
+
+// Rows store the doubles of DECIMAL fields with the default stream formatting
+bool string_to_decimal(const std::string& value, int precision, int scale, CDC::Int128& dest)
+{
+    if (CDC::parse_decimal(value.c_str(), value.length(), precision, scale, dest))
     {
-        std::string req_msg(REQUEST_MSG);
-        req_msg += table;
+        return true;
+    }
 
-        if (gtid.length())
-        {
-            req_msg += " ";
-            req_msg += gtid;
-        }
+    char* end;
+    double d = strtod(value.c_str(), &end);
+    return *end == '\0' && double_to_decimal(d, precision, scale, dest);
+}
 
-        if (nointr_write(req_msg.c_str(), req_msg.length()) == -1)
-        {
-            char err[ERRBUF_SIZE];
-            m_error = "Failed to write request: ";
-            m_error += strerror_r(errno, err, sizeof(err));
-        }
-        else if ((m_first_row = read()))
+bool json_to_decimal(json_t* value, int precision, int scale, CDC::Int128& dest)
+{
+    if (json_is_string(value))
+    {
+        return CDC::parse_decimal(json_string_value(value), json_string_length(value), precision, scale, dest);
+    }
+    else if (json_is_integer(value))
+    {
+        CDC::Int128 limit = power_of_ten(precision - scale);
+        CDC::Int128 v = json_integer_value(value);
+
+        if (v >= limit || v <= -limit)
         {
-            m_connected = true;
-            rval = true;
+            return false;
         }
+
+        dest = v * power_of_ten(scale);
+        return true;
+    }
+    else if (json_is_real(value))
+    {
+        return double_to_decimal(json_real_value(value), precision, scale, dest);
     }
 
-    freeaddrinfo(ai);
-    return rval;
+    return false;
 }
 
-void Connection::close()
+// Days since 1970-01-01 in the proleptic Gregorian calendar
+int64_t days_from_civil(int64_t year, int month, int day)
 {
-    m_error.clear();
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t yoe = year - era * 400;
+    int64_t doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
 
-    if (m_fd != -1)
+// The value of two digits or -1 if they are not digits
+inline int two_digits(const char* str)
+{
+    return is_digit(str[0]) && is_digit(str[1]) ? (str[0] - '0') * 10 + (str[1] - '0') : -1;
+}
+
+// Fields that every change event has in addition to the table columns
+bool is_metadata(const std::string& key)
+{
+    return key == "domain" || key == "server_id" || key == "sequence" ||
+           key == "event_number" || key == "timestamp" || key == "event_type";
+}
+
+// Monotonic time in milliseconds
+int64_t monotonic_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Wall-clock time in milliseconds
+int64_t realtime_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Monotonic time in nanoseconds
+int64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 64-bit FNV-1a with a final mix so that the low bits are usable for partitioning
+uint64_t hash_bytes(const char* data, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < len; i++)
     {
-        nointr_write(CLOSE_MSG, sizeof(CLOSE_MSG) - 1);
-        ::close(m_fd);
-        m_fd = -1;
+        h ^= (uint8_t)data[i];
+        h *= 1099511628211ULL;
     }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
 }
 
-static inline bool is_schema(json_t* json)
+// Back off when busy-waiting, first by yielding and then by sleeping
+void backoff(int& spins)
 {
-    bool rval = false;
-    json_t* j = json_object_get(json, "fields");
+    if (++spins < 100)
+    {
+        sched_yield();
+    }
+    else
+    {
+        struct timespec ts = {0, 50000};
+        nanosleep(&ts, NULL);
+    }
+}
 
-    if (j && json_is_array(j) && json_array_size(j))
+/**
+ * Build the key of a row from the values of the key columns
+ *
+ * @param row   The row to build the key from
+ * @param key   The names of the key columns
+ * @param idx   Cached field indexes of the key columns, updated if the schema has changed
+ * @param dest  Where the key is stored
+ * @param error Where the error is stored if a key column is not found
+ *
+ * @return True if the key was built
+ */
+bool make_row_key(const CDC::Row& row,
+                  const CDC::ValueList& key,
+                  std::vector<size_t>& idx,
+                  std::string& dest,
+                  std::string& error)
+{
+    if (idx.size() != key.size())
     {
-        rval = json_object_get(json_array_get(j, 0), "name") != NULL;
+        idx.assign(key.size(), 0);
     }
 
-    return rval;
+    dest.clear();
+
+    for (size_t i = 0; i < key.size(); i++)
+    {
+        if (idx[i] >= row->length() || row->key(idx[i]) != key[i])
+        {
+            // The schema has changed, resolve the key column again
+            size_t j = 0;
+
+            while (j < row->length() && row->key(j) != key[i])
+            {
+                j++;
+            }
+
+            if (j == row->length())
+            {
+                error = "Key column not found: ";
+                error += key[i];
+                return false;
+            }
+
+            idx[i] = j;
+        }
+
+        dest += row->value(idx[i]);
+        dest += '\0';
+    }
+
+    return true;
 }
 
-void Connection::process_schema(json_t* json)
+
+// Identifies each distinct schema so that decoders know when theirs is out of date
+std::atomic<uint64_t> next_schema_id(1);
+
+// Parses the fields of a schema
+CDC::SchemaInfo* parse_schema(const std::string& schema, json_t* json)
 {
-    m_keys.clear();
-    m_types.clear();
+    CDC::SchemaInfo* rval = new CDC::SchemaInfo;
+    rval->json = schema;
+    rval->id = next_schema_id.fetch_add(1);
 
     json_t* arr = json_object_get(json, "fields");
     size_t i;
@@ -280,367 +624,3941 @@ void Connection::process_schema(json_t* json)
             }
         }
 
-        m_keys.push_back(nameval);
-        m_types.push_back(typeval);
-    }
-}
-
-Row Connection::process_row(json_t* js)
-{
-    ValueList values;
-    values.reserve(m_keys.size());
-    m_error.clear();
-
-    for (ValueList::iterator it = m_keys.begin();
-         it != m_keys.end(); it++)
-    {
-        json_t* v = json_object_get(js, it->c_str());
-
-        if (v)
+        if (nameval == "event_type")
         {
-            values.push_back(json_to_string(v));
+            rval->event_type = rval->keys.size();
         }
-        else
+        else if (nameval == "timestamp")
         {
-            m_error = "No value for key found: ";
-            m_error += *it;
-            break;
+            rval->timestamp = rval->keys.size();
         }
-    }
 
-    Row rval;
+        CDC::Column::Type column_type = avro_column_type(json_object_get(v, "type"));
+        int precision;
+        int scale;
+        sql_column_type(v, column_type, precision, scale);
 
-    if (m_error.empty())
-    {
-        rval = Row(new InternalRow(m_keys, m_types, values));
+        // Like a search from the start, the first of duplicate names wins
+        rval->index.insert(std::make_pair(nameval, rval->keys.size()));
+        rval->keys.push_back(nameval);
+        rval->types.push_back(typeval);
+        rval->column_types.push_back(column_type);
+        rval->precisions.push_back(precision);
+        rval->scales.push_back(scale);
     }
 
     return rval;
 }
 
-Row Connection::read()
-{
-    m_error.clear();
-    Row rval;
-    std::string row;
+/**
+ * The parsed schemas of the process, keyed by the hash of the schema JSON
+ *
+ * Sharded tables and reconnects see the same schemas over and over, so each
+ * distinct schema is parsed once and shared for as long as a connection or a
+ * row uses it. The cache only holds weak references, the expired entries are
+ * swept whenever the cache has doubled in size.
+ */
+typedef std::tr1::unordered_multimap<uint64_t, std::tr1::weak_ptr<const CDC::SchemaInfo> > SchemaCache;
 
-    if (m_first_row)
-    {
-        rval.swap(m_first_row);
-        assert(!m_first_row);
+SchemaCache schema_cache;
+size_t schema_cache_sweep = 64;
+pthread_mutex_t schema_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Find a parsed schema or parse and add it to the cache
+ *
+ * @param schema The schema JSON as it was received
+ * @param json   The parsed schema JSON
+ *
+ * @return The shared schema
+ */
+CDC::SharedSchema intern_schema(const std::string& schema, json_t* json)
+{
+    uint64_t hash = hash_bytes(schema.c_str(), schema.length());
+    CDC::SharedSchema rval;
+
+    pthread_mutex_lock(&schema_cache_lock);
+    std::pair<SchemaCache::iterator, SchemaCache::iterator> range = schema_cache.equal_range(hash);
+
+    for (SchemaCache::iterator it = range.first; it != range.second && !rval; it++)
+    {
+        CDC::SharedSchema cached = it->second.lock();
+
+        if (cached && cached->json == schema)
+        {
+            rval = cached;
+        }
+    }
+
+    if (!rval)
+    {
+        if (schema_cache.size() >= schema_cache_sweep)
+        {
+            for (SchemaCache::iterator it = schema_cache.begin(); it != schema_cache.end();)
+            {
+                if (it->second.expired())
+                {
+                    it = schema_cache.erase(it);
+                }
+                else
+                {
+                    it++;
+                }
+            }
+
+            schema_cache_sweep = std::max(schema_cache_sweep, schema_cache.size() * 2);
+        }
+
+        rval.reset(parse_schema(schema, json));
+        schema_cache.insert(std::make_pair(hash, std::tr1::weak_ptr<const CDC::SchemaInfo>(rval)));
+    }
+
+    pthread_mutex_unlock(&schema_cache_lock);
+    return rval;
+}
+
+}
+
+namespace CDC
+{
+
+/**
+ * Statistics
+ */
+
+struct Histogram::Counters
+{
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+};
+
+Histogram::Histogram():
+    m_counters(new Counters)
+{
+    for (size_t i = 0; i < BUCKETS; i++)
+    {
+        m_counters->buckets[i] = 0;
+    }
+
+    m_counters->count = 0;
+    m_counters->sum = 0;
+}
+
+Histogram::~Histogram()
+{
+    delete m_counters;
+}
+
+void Histogram::add(uint64_t ns)
+{
+    size_t i = ns ? 64 - __builtin_clzll(ns) : 0;
+    m_counters->buckets[std::min(i, BUCKETS - 1)].fetch_add(1, std::memory_order_relaxed);
+    m_counters->count.fetch_add(1, std::memory_order_relaxed);
+    m_counters->sum.fetch_add(ns, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::bucket(size_t i) const
+{
+    return m_counters->buckets[i].load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::count() const
+{
+    return m_counters->count.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::sum() const
+{
+    return m_counters->sum.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::percentile(double p) const
+{
+    uint64_t total = 0;
+    uint64_t counts[BUCKETS];
+
+    for (size_t i = 0; i < BUCKETS; i++)
+    {
+        counts[i] = bucket(i);
+        total += counts[i];
+    }
+
+    uint64_t target = total * p / 100;
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < BUCKETS; i++)
+    {
+        seen += counts[i];
+
+        if (counts[i] && seen >= target)
+        {
+            return 1ULL << i;
+        }
+    }
+
+    return 0;
+}
+
+struct Stats::Counters
+{
+    std::atomic<uint64_t> counters[N_COUNTERS];
+    std::atomic<int64_t>  gauges[N_GAUGES];
+};
+
+Stats::Stats():
+    m_counters(new Counters)
+{
+    for (size_t i = 0; i < N_COUNTERS; i++)
+    {
+        m_counters->counters[i] = 0;
+    }
+
+    for (size_t i = 0; i < N_GAUGES; i++)
+    {
+        m_counters->gauges[i] = 0;
+    }
+
+    m_counters->gauges[LAST_ROW] = -1;
+}
+
+Stats::~Stats()
+{
+    delete m_counters;
+}
+
+void Stats::inc(Counter counter, uint64_t n)
+{
+    m_counters->counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+void Stats::set(Gauge gauge, int64_t value)
+{
+    m_counters->gauges[gauge].store(value, std::memory_order_relaxed);
+}
+
+int64_t Stats::get(Gauge gauge) const
+{
+    return m_counters->gauges[gauge].load(std::memory_order_relaxed);
+}
+
+uint64_t Stats::bytes() const
+{
+    return m_counters->counters[BYTES].load(std::memory_order_relaxed);
+}
+
+uint64_t Stats::rows() const
+{
+    return m_counters->counters[ROWS].load(std::memory_order_relaxed);
+}
+
+uint64_t Stats::schemaChanges() const
+{
+    return m_counters->counters[SCHEMA_CHANGES].load(std::memory_order_relaxed);
+}
+
+uint64_t Stats::syscalls() const
+{
+    return m_counters->counters[SYSCALLS].load(std::memory_order_relaxed);
+}
+
+uint64_t Stats::pollWakeups() const
+{
+    return m_counters->counters[POLL_WAKEUPS].load(std::memory_order_relaxed);
+}
+
+uint64_t Stats::bufferHighWater() const
+{
+    return get(BUFFER_HIGH_WATER);
+}
+
+int64_t Stats::lag() const
+{
+    return get(LAG);
+}
+
+int64_t Stats::receiveLag() const
+{
+    return get(RECEIVE_LAG);
+}
+
+int64_t Stats::sinceLastRow() const
+{
+    int64_t last = get(LAST_ROW);
+    return last == -1 ? -1 : (monotonic_ns() - last) / 1000000;
+}
+
+/**
+ * Native values
+ */
+
+bool parse_datetime(const char* str, size_t len, int64_t& dest)
+{
+    static const int days_in_month[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+
+    if (len < 10 || str[4] != '-' || str[7] != '-')
+    {
+        return false;
+    }
+
+    int century = two_digits(str);
+    int year = two_digits(str + 2);
+    int month = two_digits(str + 5);
+    int day = two_digits(str + 8);
+    int hour = 0;
+    int minute = 0;
+    int second = 0;
+    int usec = 0;
+
+    if (len > 10)
+    {
+        if (len < 19 || (str[10] != ' ' && str[10] != 'T') || str[13] != ':' || str[16] != ':')
+        {
+            return false;
+        }
+
+        hour = two_digits(str + 11);
+        minute = two_digits(str + 14);
+        second = two_digits(str + 17);
+
+        if (len > 19)
+        {
+            if (str[19] != '.' || len == 20 || len > 26)
+            {
+                return false;
+            }
+
+            for (size_t i = 20; i < 26; i++)
+            {
+                usec *= 10;
+
+                if (i < len)
+                {
+                    if (!is_digit(str[i]))
+                    {
+                        return false;
+                    }
+
+                    usec += str[i] - '0';
+                }
+            }
+        }
+    }
+
+    if (century < 0 || year < 0 || month < 1 || month > 12 || day < 1 || day > days_in_month[month - 1] ||
+        hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 59)
+    {
+        return false;
+    }
+
+    year += century * 100;
+
+    if (month == 2 && day == 29 && (year % 4 != 0 || (year % 100 == 0 && year % 400 != 0)))
+    {
+        return false;
+    }
+
+    int64_t seconds = days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+    dest = seconds * 1000000 + usec;
+    return true;
+}
+
+bool parse_decimal(const char* str, size_t len, int precision, int scale, Int128& dest)
+{
+    const char* ptr = str;
+    const char* end = str + len;
+    bool negative = false;
+
+    if (ptr < end && (*ptr == '-' || *ptr == '+'))
+    {
+        negative = *ptr++ == '-';
+    }
+
+    // Leading zeros do not count towards the precision
+    const char* start = ptr;
+
+    while (ptr < end && *ptr == '0')
+    {
+        ptr++;
+    }
+
+    Int128 value = 0;
+    bool digits = read_digits(ptr, end, precision - scale, value) > 0 || ptr > start;
+    int fraction = 0;
+    bool round_up = false;
+
+    if (ptr < end && is_digit(*ptr))
+    {
+        // Too many integer digits
+        return false;
+    }
+    else if (ptr < end && *ptr == '.')
+    {
+        ptr++;
+        start = ptr;
+        fraction = read_digits(ptr, end, scale, value);
+        round_up = ptr < end && *ptr >= '5' && *ptr <= '9';
+
+        while (ptr < end && is_digit(*ptr))
+        {
+            ptr++;
+        }
+
+        digits = digits || ptr > start;
+    }
+
+    if (!digits || ptr != end)
+    {
+        return false;
+    }
+
+    for (; fraction < scale; fraction++)
+    {
+        value *= 10;
+    }
+
+    if (round_up && ++value == power_of_ten(precision))
+    {
+        return false;
+    }
+
+    dest = negative ? -value : value;
+    return true;
+}
+
+/**
+ * Columns
+ */
+
+Column::Column(const std::string& name, Type type, const std::string& sql_type,
+               int precision, int scale, size_t dictionary_limit):
+    m_name(name),
+    m_type(type),
+    m_sql_type(sql_type),
+    m_precision(precision),
+    m_scale(scale),
+    m_length(0),
+    m_null_count(0),
+    m_dictionary(type == STRING && dictionary_limit > 0),
+    m_dictionary_limit(dictionary_limit)
+{
+    if (m_type == STRING)
+    {
+        m_offsets.push_back(0);
+    }
+}
+
+void Column::set_valid(bool valid)
+{
+    if (m_length % 8 == 0)
+    {
+        m_validity.push_back(0);
+    }
+
+    if (valid)
+    {
+        m_validity.back() |= 1 << (m_length % 8);
+    }
+    else
+    {
+        m_null_count++;
+    }
+
+    m_length++;
+}
+
+void Column::append_null()
+{
+    switch (m_type)
+    {
+    case INT64:
+    case DATETIME:
+        m_ints.push_back(0);
+        break;
+
+    case DOUBLE:
+        m_doubles.push_back(0);
+        break;
+
+    case DECIMAL:
+        m_decimals.push_back(0);
+        break;
+
+    case STRING:
+        if (m_dictionary)
+        {
+            m_codes.push_back(0);
+        }
+        else
+        {
+            m_offsets.push_back(m_data.size());
+        }
+        break;
+    }
+
+    set_valid(false);
+}
+
+void Column::append(json_t* value)
+{
+    if (json_is_null(value))
+    {
+        append_null();
+        return;
+    }
+
+    switch (m_type)
+    {
+    case INT64:
+        m_ints.push_back(json_is_integer(value) ? json_integer_value(value) :
+                         json_is_real(value) ? (int64_t)json_real_value(value) :
+                         json_is_true(value) ? 1 :
+                         json_is_string(value) ? strtoll(json_string_value(value), NULL, 10) : 0);
+        break;
+
+    case DOUBLE:
+        m_doubles.push_back(json_is_number(value) ? json_number_value(value) :
+                            json_is_string(value) ? strtod(json_string_value(value), NULL) : 0);
+        break;
+
+    case STRING:
+        if (json_is_string(value))
+        {
+            append_string(json_string_value(value), json_string_length(value));
+        }
+        else
+        {
+            std::string str = json_to_string(value);
+            append_string(str.c_str(), str.length());
+        }
+        break;
+
+    case DECIMAL:
+        {
+            Int128 decimal;
+
+            if (!json_to_decimal(value, m_precision, m_scale, decimal))
+            {
+                append_null();
+                return;
+            }
+
+            m_decimals.push_back(decimal);
+        }
+        break;
+
+    case DATETIME:
+        {
+            int64_t usec;
+
+            if (!json_is_string(value) ||
+                !parse_datetime(json_string_value(value), json_string_length(value), usec))
+            {
+                append_null();
+                return;
+            }
+
+            m_ints.push_back(usec);
+        }
+        break;
+    }
+
+    set_valid(true);
+}
+
+void Column::append(const std::string& value)
+{
+    // Rows do not distinguish nulls from empty strings
+    if (value.empty() && m_type != STRING)
+    {
+        append_null();
+        return;
+    }
+
+    switch (m_type)
+    {
+    case INT64:
+        m_ints.push_back(value == "true" ? 1 : strtoll(value.c_str(), NULL, 10));
+        break;
+
+    case DOUBLE:
+        m_doubles.push_back(strtod(value.c_str(), NULL));
+        break;
+
+    case STRING:
+        append_string(value.c_str(), value.length());
+        break;
+
+    case DECIMAL:
+        {
+            Int128 decimal;
+
+            if (!string_to_decimal(value, m_precision, m_scale, decimal))
+            {
+                append_null();
+                return;
+            }
+
+            m_decimals.push_back(decimal);
+        }
+        break;
+
+    case DATETIME:
+        {
+            int64_t usec;
+
+            if (!parse_datetime(value.c_str(), value.length(), usec))
+            {
+                append_null();
+                return;
+            }
+
+            m_ints.push_back(usec);
+        }
+        break;
+    }
+
+    set_valid(true);
+}
+
+void Column::append_string(const char* str, size_t len)
+{
+    if (m_dictionary)
+    {
+        int32_t code = dictionary_code(str, len);
+
+        if (code != -1)
+        {
+            m_codes.push_back(code);
+            return;
+        }
+
+        decode_dictionary();
+    }
+
+    m_data.append(str, len);
+    m_offsets.push_back(m_data.size());
+}
+
+/**
+ * Find or add a value to the dictionary
+ *
+ * @param str The value
+ * @param len The length of the value
+ *
+ * @return The code of the value or -1 if the column has too many distinct
+ *         values to be worth encoding
+ */
+int32_t Column::dictionary_code(const char* str, size_t len)
+{
+    if (m_slots.empty())
+    {
+        m_slots.resize(16);
+    }
+
+    size_t mask = m_slots.size() - 1;
+    size_t i = hash_bytes(str, len) & mask;
+
+    while (m_slots[i])
+    {
+        int32_t code = m_slots[i] - 1;
+
+        if ((size_t)(m_offsets[code + 1] - m_offsets[code]) == len &&
+            memcmp(m_data.data() + m_offsets[code], str, len) == 0)
+        {
+            return code;
+        }
+
+        i = (i + 1) & mask;
+    }
+
+    // A new value, give up if there are too many of them. The first rows
+    // are always encoded so that a few unique values do not decide it.
+    size_t n = m_offsets.size() - 1;
+
+    if (n >= m_dictionary_limit || (m_length >= DICTIONARY_MIN_ROWS && (n + 1) * 2 > m_length + 1))
+    {
+        return -1;
+    }
+
+    m_data.append(str, len);
+    m_offsets.push_back(m_data.size());
+    m_slots[i] = n + 1;
+
+    if ((n + 1) * 2 > m_slots.size())
+    {
+        rehash_dictionary();
+    }
+
+    return n;
+}
+
+// Doubles the size of the hash table of the dictionary
+void Column::rehash_dictionary()
+{
+    std::vector<int32_t> slots(m_slots.size() * 2);
+    size_t mask = slots.size() - 1;
+
+    for (size_t code = 0; code + 1 < m_offsets.size(); code++)
+    {
+        size_t i = hash_bytes(m_data.data() + m_offsets[code], m_offsets[code + 1] - m_offsets[code]) & mask;
+
+        while (slots[i])
+        {
+            i = (i + 1) & mask;
+        }
+
+        slots[i] = code + 1;
+    }
+
+    m_slots.swap(slots);
+}
+
+// Converts the column into plain strings
+void Column::decode_dictionary()
+{
+    std::string data;
+    std::vector<int32_t> offsets;
+    offsets.reserve(m_codes.size() + 1);
+    offsets.push_back(0);
+
+    for (size_t i = 0; i < m_codes.size(); i++)
+    {
+        if (!isNull(i))
+        {
+            int32_t code = m_codes[i];
+            data.append(m_data, m_offsets[code], m_offsets[code + 1] - m_offsets[code]);
+        }
+
+        offsets.push_back(data.size());
+    }
+
+    m_data.swap(data);
+    m_offsets.swap(offsets);
+    std::vector<int32_t>().swap(m_codes);
+    std::vector<int32_t>().swap(m_slots);
+    m_dictionary = false;
+}
+
+/**
+ * Arrow export
+ */
+
+namespace
+{
+
+// The exported data, shared by the arrays and the schemas of a batch. The
+// children can be moved out of their parents, so each exported structure
+// holds a reference.
+struct ArrowExport
+{
+    std::atomic<int>          refs;
+    std::vector<Column>       columns;
+    std::vector<const void*>  buffers;          // Three per column
+    std::vector<ArrowArray>   child_arrays;
+    std::vector<ArrowArray*>  child_array_ptrs;
+    std::vector<ArrowSchema>  child_schemas;
+    std::vector<ArrowSchema*> child_schema_ptrs;
+    std::vector<std::string>  metadata;
+    std::vector<const void*>  dictionary_buffers; // Three per column
+    std::vector<ArrowArray>   dictionary_arrays;
+    std::vector<ArrowSchema>  dictionary_schemas;
+    std::vector<std::string>  formats;
+    const void*               struct_buffer;
+};
+
+void arrow_unref(void* data)
+{
+    ArrowExport* exp = static_cast<ArrowExport*>(data);
+
+    if (exp->refs.fetch_sub(1) == 1)
+    {
+        delete exp;
+    }
+}
+
+void arrow_release_array(struct ArrowArray* array)
+{
+    for (int64_t i = 0; i < array->n_children; i++)
+    {
+        if (array->children[i]->release)
+        {
+            array->children[i]->release(array->children[i]);
+        }
+    }
+
+    if (array->dictionary && array->dictionary->release)
+    {
+        array->dictionary->release(array->dictionary);
+    }
+
+    arrow_unref(array->private_data);
+    array->release = NULL;
+}
+
+void arrow_release_schema(struct ArrowSchema* schema)
+{
+    for (int64_t i = 0; i < schema->n_children; i++)
+    {
+        if (schema->children[i]->release)
+        {
+            schema->children[i]->release(schema->children[i]);
+        }
+    }
+
+    if (schema->dictionary && schema->dictionary->release)
+    {
+        schema->dictionary->release(schema->dictionary);
+    }
+
+    arrow_unref(schema->private_data);
+    schema->release = NULL;
+}
+
+// Encodes one key-value pair in the Arrow metadata format
+std::string arrow_metadata(const std::string& key, const std::string& value)
+{
+    int32_t n = 1;
+    int32_t len;
+    std::string rval((const char*)&n, sizeof(n));
+    len = key.length();
+    rval.append((const char*)&len, sizeof(len));
+    rval += key;
+    len = value.length();
+    rval.append((const char*)&len, sizeof(len));
+    rval += value;
+    return rval;
+}
+
+// Arrow does not allow null data buffers, empty columns point here
+const int64_t empty_buffer[1] = {0};
+
+const void* nonnull(const void* ptr)
+{
+    return ptr ? ptr : empty_buffer;
+}
+
+}
+
+void Batch::exportArrow(struct ArrowSchema* schema, struct ArrowArray* array)
+{
+    ArrowExport* exp = new ArrowExport;
+    exp->columns.swap(m_columns);
+    size_t n = exp->columns.size();
+    size_t dictionaries = 0;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        if (exp->columns[i].isDictionary())
+        {
+            dictionaries++;
+        }
+    }
+
+    exp->refs = 2 * n + 2 * dictionaries + 2;
+    exp->buffers.resize(3 * n);
+    exp->child_arrays.resize(n);
+    exp->child_schemas.resize(n);
+    exp->dictionary_buffers.resize(3 * n);
+    exp->dictionary_arrays.resize(n);
+    exp->dictionary_schemas.resize(n);
+    exp->formats.resize(n);
+    exp->struct_buffer = NULL;
+
+    for (size_t i = 0; i < n; i++)
+    {
+        const Column& col = exp->columns[i];
+        const void** buffers = &exp->buffers[3 * i];
+        ArrowArray& child = exp->child_arrays[i];
+        ArrowSchema& field = exp->child_schemas[i];
+
+        buffers[0] = col.nullCount() ? col.validity().data() : NULL;
+
+        switch (col.type())
+        {
+        case Column::INT64:
+            field.format = "l";
+            buffers[1] = nonnull(col.ints().data());
+            break;
+
+        case Column::DOUBLE:
+            field.format = "g";
+            buffers[1] = nonnull(col.doubles().data());
+            break;
+
+        case Column::DECIMAL:
+            {
+                std::stringstream ss;
+                ss << "d:" << col.precision() << "," << col.scale();
+                exp->formats[i] = ss.str();
+                field.format = exp->formats[i].c_str();
+                buffers[1] = nonnull(col.decimals().data());
+            }
+            break;
+
+        case Column::DATETIME:
+            field.format = "tsu:";
+            buffers[1] = nonnull(col.ints().data());
+            break;
+
+        case Column::STRING:
+            if (col.isDictionary())
+            {
+                field.format = "i";
+                buffers[1] = nonnull(col.codes().data());
+            }
+            else
+            {
+                field.format = "u";
+                buffers[1] = col.offsets().data();
+                buffers[2] = nonnull(col.data().data());
+            }
+            break;
+        }
+
+        if (col.isDictionary())
+        {
+            // The distinct values as a utf8 array without nulls
+            const void** dict_buffers = &exp->dictionary_buffers[3 * i];
+            ArrowArray& dict = exp->dictionary_arrays[i];
+            ArrowSchema& dict_field = exp->dictionary_schemas[i];
+
+            dict_buffers[0] = NULL;
+            dict_buffers[1] = col.offsets().data();
+            dict_buffers[2] = nonnull(col.data().data());
+
+            dict.length = col.offsets().size() - 1;
+            dict.null_count = 0;
+            dict.offset = 0;
+            dict.n_buffers = 3;
+            dict.n_children = 0;
+            dict.buffers = dict_buffers;
+            dict.children = NULL;
+            dict.dictionary = NULL;
+            dict.release = arrow_release_array;
+            dict.private_data = exp;
+
+            dict_field.format = "u";
+            dict_field.name = NULL;
+            dict_field.metadata = NULL;
+            dict_field.flags = 0;
+            dict_field.n_children = 0;
+            dict_field.children = NULL;
+            dict_field.dictionary = NULL;
+            dict_field.release = arrow_release_schema;
+            dict_field.private_data = exp;
+        }
+
+        child.length = col.length();
+        child.null_count = col.nullCount();
+        child.offset = 0;
+        child.n_buffers = col.type() == Column::STRING && !col.isDictionary() ? 3 : 2;
+        child.n_children = 0;
+        child.buffers = buffers;
+        child.children = NULL;
+        child.dictionary = col.isDictionary() ? &exp->dictionary_arrays[i] : NULL;
+        child.release = arrow_release_array;
+        child.private_data = exp;
+        exp->child_array_ptrs.push_back(&child);
+
+        exp->metadata.push_back(arrow_metadata("real_type", col.sqlType()));
+        field.name = col.name().c_str();
+        field.flags = ARROW_FLAG_NULLABLE;
+        field.n_children = 0;
+        field.children = NULL;
+        field.dictionary = col.isDictionary() ? &exp->dictionary_schemas[i] : NULL;
+        field.release = arrow_release_schema;
+        field.private_data = exp;
+        exp->child_schema_ptrs.push_back(&field);
+    }
+
+    // Set once the metadata strings no longer move as the vector grows
+    for (size_t i = 0; i < n; i++)
+    {
+        exp->child_schemas[i].metadata = exp->metadata[i].c_str();
+    }
+
+    array->length = m_length;
+    array->null_count = 0;
+    array->offset = 0;
+    array->n_buffers = 1;
+    array->n_children = n;
+    array->buffers = &exp->struct_buffer;
+    array->children = n ? &exp->child_array_ptrs[0] : NULL;
+    array->dictionary = NULL;
+    array->release = arrow_release_array;
+    array->private_data = exp;
+
+    schema->format = "+s";
+    schema->name = "";
+    schema->metadata = NULL;
+    schema->flags = 0;
+    schema->n_children = n;
+    schema->children = n ? &exp->child_schema_ptrs[0] : NULL;
+    schema->dictionary = NULL;
+    schema->release = arrow_release_schema;
+    schema->private_data = exp;
+
+    m_length = 0;
+}
+
+/**
+ * Public functions
+ */
+
+Connection::Connection(const std::string& address,
+                       uint16_t port,
+                       const std::string& user,
+                       const std::string& password,
+                       int timeout) :
+    m_fd(-1),
+    m_address(address),
+    m_port(port),
+    m_user(user),
+    m_password(password),
+    m_schema_info(new SchemaInfo),
+    m_timeout(timeout),
+    m_first_event(NULL),
+    m_connected(false),
+    m_pair_updates(false),
+    m_checkpoint(NULL),
+    m_last_complete(false),
+    m_batch(false),
+    m_spool_segment_size(0),
+    m_spool_max_size(0),
+    m_spool(NULL),
+    m_capture_fd(-1),
+    m_dictionary_limit(1024),
+    m_replay(false),
+    m_pace_speed(0),
+    m_pace_timestamp(-1),
+    m_pace_time(0),
+    m_receive_time(0),
+    m_nowait(false),
+    m_no_io(false),
+    m_handshake(HANDSHAKE_NONE)
+{
+    m_buf_ptr = m_buffer.begin();
+}
+
+Connection::~Connection()
+{
+    close();
+    json_decref(m_first_event);
+}
+
+bool Connection::connect(const std::string& table, const std::string& gtid)
+{
+    close();
+    reset_stream();
+    bool rval = false;
+    struct sockaddr_in remote;
+
+    if (!resolve_address(m_address, m_port, remote, m_error))
+    {
+        return false;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    if (fd == -1)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to create socket: ";
+        m_error += strerror_r(errno, err, sizeof(err));
+    }
+
+    m_fd = fd;
+    int fl;
+
+    if (::connect(fd, (struct sockaddr*) &remote, sizeof(remote)) == -1)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to connect: ";
+        m_error += strerror_r(errno, err, sizeof(err));
+    }
+    else if ((fl = fcntl(fd, F_GETFL, 0)) == -1 ||
+             fcntl(fd, F_SETFL, fl | O_NONBLOCK) == -1)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to set socket non-blocking: ";
+        m_error += strerror_r(errno, err, sizeof(err));
+    }
+    else if (do_auth() && do_registration())
+    {
+        std::string req_msg = make_request(table, gtid);
+        int64_t start;
+        int64_t parsed;
+
+        if (nointr_write(req_msg.c_str(), req_msg.length()) == -1)
+        {
+            char err[ERRBUF_SIZE];
+            m_error = "Failed to write request: ";
+            m_error += strerror_r(errno, err, sizeof(err));
+        }
+        else if ((m_first_event = read_json(start, parsed)))
+        {
+            // Kept as JSON so that the batch and decoder reads store it as is
+            m_connected = true;
+            rval = m_spool_dir.empty() || start_spool();
+        }
+    }
+
+    return rval;
+}
+
+bool Connection::connectAsync(const std::string& table, const std::string& gtid)
+{
+    close();
+    reset_stream();
+    m_response.clear();
+    struct sockaddr_in remote;
+    int fl;
+
+    if (!resolve_address(m_address, m_port, remote, m_error))
+    {
+        return false;
+    }
+    else if ((m_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to create socket: ";
+        m_error += strerror_r(errno, err, sizeof(err));
+    }
+    else if ((fl = fcntl(m_fd, F_GETFL, 0)) == -1 ||
+             fcntl(m_fd, F_SETFL, fl | O_NONBLOCK) == -1)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to set socket non-blocking: ";
+        m_error += strerror_r(errno, err, sizeof(err));
+    }
+    else if (::connect(m_fd, (struct sockaddr*) &remote, sizeof(remote)) == -1 && errno != EINPROGRESS)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to connect: ";
+        m_error += strerror_r(errno, err, sizeof(err));
+    }
+    else
+    {
+        m_request = make_request(table, gtid);
+        m_handshake = HANDSHAKE_CONNECTING;
+        return true;
+    }
+
+    return false;
+}
+
+bool Connection::onWritable()
+{
+    m_error.clear();
+
+    if (m_handshake == HANDSHAKE_CONNECTING)
+    {
+        int error = 0;
+        socklen_t len = sizeof(error);
+
+        if (getsockopt(m_fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error)
+        {
+            char err[ERRBUF_SIZE];
+            m_error = "Failed to connect: ";
+            m_error += strerror_r(error ? error : errno, err, sizeof(err));
+            return false;
+        }
+
+        m_pending_write = generateAuthString(m_user, m_password);
+        m_handshake = HANDSHAKE_AUTH;
+    }
+
+    return flush_pending();
+}
+
+bool Connection::onReadable()
+{
+    m_error.clear();
+
+    if (m_handshake == HANDSHAKE_AUTH || m_handshake == HANDSHAKE_REGISTER)
+    {
+        return read_response();
+    }
+    else if (m_handshake == HANDSHAKE_CONNECTING)
+    {
+        return true;
+    }
+
+    bool rval = true;
+    m_nowait = true;
+
+    // Bounded so that one busy stream does not starve the others in the loop
+    for (int i = 0; i < 16; i++)
+    {
+        char buf[READBUF_SIZE + 1];
+        int rc = read_data(buf, READBUF_SIZE);
+
+        if (rc == -1)
+        {
+            rval = false;
+
+            if (m_error.empty())
+            {
+                char err[ERRBUF_SIZE];
+                m_error = "Failed to read data: ";
+                m_error += strerror_r(errno, err, sizeof(err));
+            }
+            break;
+        }
+        else if (rc == 0)
+        {
+            break;
+        }
+
+        if (!m_connected)
+        {
+            // Error responses to the request lack the newline, see read_row
+            buf[rc] = '\0';
+
+            if (is_error(buf))
+            {
+                rval = false;
+                break;
+            }
+        }
+
+        buffer_data(buf, rc);
+
+        if (rc < READBUF_SIZE)
+        {
+            break;
+        }
+    }
+
+    m_nowait = false;
+    return rval;
+}
+
+Row Connection::readBuffered()
+{
+    m_nowait = true;
+    m_no_io = true;
+    Row rval;
+
+    if (!m_connected)
+    {
+        // The first event of the stream, kept like connect() does so that it
+        // is read as the first row of a connected stream
+        int64_t start;
+        int64_t parsed;
+
+        if ((m_first_event = read_json(start, parsed)))
+        {
+            m_connected = true;
+        }
+    }
+
+    if (m_connected)
+    {
+        rval = read();
+    }
+
+    m_nowait = false;
+    m_no_io = false;
+
+    if (!rval && m_error == CDC::TIMEOUT)
+    {
+        m_error.clear();
+    }
+
+    return rval;
+}
+
+void Connection::close()
+{
+    m_error.clear();
+    stop_spool();
+
+    if (m_fd != -1)
+    {
+        if (!m_replay && m_handshake != HANDSHAKE_CONNECTING)
+        {
+            nointr_write(CLOSE_MSG, sizeof(CLOSE_MSG) - 1);
+        }
+
+        ::close(m_fd);
+        m_fd = -1;
+    }
+
+    m_handshake = HANDSHAKE_NONE;
+    m_pending_write.clear();
+}
+
+void Connection::reset_stream()
+{
+    // Nothing read from a previous connection is returned from the new one
+    m_connected = false;
+    m_buffer.clear();
+    m_buf_ptr = m_buffer.begin();
+    m_first_row.reset();
+    json_decref(m_first_event);
+    m_first_event = NULL;
+    m_trx_rows.clear();
+}
+
+static inline bool is_schema(json_t* json)
+{
+    bool rval = false;
+    json_t* j = json_object_get(json, "fields");
+
+    if (j && json_is_array(j) && json_array_size(j))
+    {
+        rval = json_object_get(json_array_get(j, 0), "name") != NULL;
+    }
+
+    return rval;
+}
+
+void Connection::process_schema(json_t* json)
+{
+    m_schema_info = intern_schema(m_schema, json);
+}
+
+Row Connection::process_row(json_t* js)
+{
+    ValueList values;
+    values.reserve(m_schema_info->keys.size());
+    m_error.clear();
+    int64_t timestamp = -1;
+
+    for (ValueList::const_iterator it = m_schema_info->keys.begin();
+         it != m_schema_info->keys.end(); it++)
+    {
+        json_t* v = json_object_get(js, it->c_str());
+
+        if (v)
+        {
+            if (it - m_schema_info->keys.begin() == m_schema_info->timestamp && json_is_integer(v))
+            {
+                timestamp = json_integer_value(v);
+            }
+
+            values.push_back(json_to_string(v));
+        }
+        else
+        {
+            m_error = "No value for key found: ";
+            m_error += *it;
+            break;
+        }
+    }
+
+    Row rval;
+
+    if (m_error.empty())
+    {
+        rval = Row(new InternalRow(m_schema_info, values, timestamp, m_receive_time));
+    }
+
+    return rval;
+}
+
+Row Connection::read()
+{
+    m_error.clear();
+
+    if (!m_batch && !commit_batch())
+    {
+        return Row();
+    }
+
+    Row rval = next_event();
+
+    if (m_checkpoint && m_connected)
+    {
+        if (rval && m_batch)
+        {
+            defer_checkpoint(rval->gtid());
+        }
+        else if (rval && !update_checkpoint(rval->gtid()))
+        {
+            // Return the row on the next read
+            m_first_row.swap(rval);
+        }
+        else if (!rval && m_error == CDC::TIMEOUT && !m_nowait)
+        {
+            // Store the pending checkpoint while the stream is idle
+            m_checkpoint->flush();
+        }
+    }
+
+    return pair_update(rval);
+}
+
+size_t Connection::readBatch(RowList& dest, size_t max)
+{
+    dest.clear();
+    Row row;
+
+    if (max > 0 && (row = read()))
+    {
+        RowList rest;
+        readAvailable(rest, max - 1);
+        dest.push_back(row);
+        dest.insert(dest.end(), rest.begin(), rest.end());
+    }
+
+    return dest.size();
+}
+
+size_t Connection::readAvailable(RowList& dest, size_t max)
+{
+    dest.clear();
+    Row row;
+
+    if (!commit_batch())
+    {
+        return 0;
+    }
+
+    m_nowait = true;
+    m_batch = true;
+
+    while (dest.size() < max && (row = read()))
+    {
+        dest.push_back(row);
+    }
+
+    m_nowait = false;
+    m_batch = false;
+
+    if (m_error == CDC::TIMEOUT)
+    {
+        m_error.clear();
+    }
+
+    return dest.size();
+}
+
+size_t Connection::readBatch(Batch& dest, size_t max)
+{
+    m_error.clear();
+    dest.clear();
+
+    if (!commit_batch())
+    {
+        return 0;
+    }
+
+    m_batch = true;
+    uint64_t schema_id = 0;
+    Row first;
+    first.swap(m_first_row);
+
+    if (m_first_event && max > 0)
+    {
+        // An event that was read ahead, stored from its JSON values
+        json_t* js = m_first_event;
+        int64_t now = monotonic_ns();
+        EventInfo info;
+        m_first_event = NULL;
+
+        if (append_event(dest, js, info.timestamp))
+        {
+            schema_id = m_schema_info->id;
+            finish_event(js, info, now, now);
+        }
+
+        json_decref(js);
+    }
+    else if (first && max > 0)
+    {
+        // A row that was read ahead by the row API, stored from its string values
+        const SchemaInfo& schema = *first->m_schema;
+
+        for (size_t i = 0; i < first->length(); i++)
+        {
+            dest.m_columns.push_back(Column(schema.keys[i], schema.column_types[i], schema.types[i],
+                                            schema.precisions[i], schema.scales[i], m_dictionary_limit));
+            dest.m_columns.back().append(first->value(i));
+        }
+
+        dest.m_length++;
+        schema_id = schema.id;
+        measure_lag(first->timestamp(), first->receiveTime());
+
+        if (m_checkpoint && m_connected)
+        {
+            defer_checkpoint(first->gtid());
+        }
+    }
+    else if (first)
+    {
+        m_first_row.swap(first);
+    }
+
+    while (m_error.empty() && dest.m_length < max)
+    {
+        // Only read what has already arrived after the first row
+        m_nowait = dest.m_length > 0;
+        int64_t start;
+        int64_t parsed;
+        json_t* js = read_json(start, parsed);
+
+        if (!js)
+        {
+            break;
+        }
+        else if (dest.m_length > 0 && m_schema_info->id != schema_id)
+        {
+            // The rows of a batch share the columns, this one goes to the next batch
+            m_first_event = js;
+            break;
+        }
+
+        EventInfo info;
+
+        if (append_event(dest, js, info.timestamp))
+        {
+            schema_id = m_schema_info->id;
+            finish_event(js, info, start, parsed);
+        }
+
+        json_decref(js);
+    }
+
+    m_nowait = false;
+    m_batch = false;
+
+    if (dest.m_length > 0 && m_error == CDC::TIMEOUT)
+    {
+        m_error.clear();
+    }
+    else if (m_error == CDC::TIMEOUT && m_checkpoint && m_connected)
+    {
+        // Store the pending checkpoint while the stream is idle
+        m_checkpoint->flush();
+    }
+
+    return dest.m_length;
+}
+
+// Accounts for an event that was delivered straight from the JSON, or from its text if js is NULL
+void Connection::finish_event(json_t* js, const EventInfo& info, int64_t start, int64_t parsed)
+{
+    int64_t built = monotonic_ns();
+    m_stats.m_parse_time.add(parsed - start);
+    m_stats.m_build_time.add(built - parsed);
+    m_stats.inc(Stats::ROWS);
+    m_stats.set(Stats::LAST_ROW, built);
+
+    if (m_pace_speed > 0)
+    {
+        pace(info.timestamp);
+    }
+
+    measure_lag(info.timestamp, m_receive_time);
+
+    if (CDC_PROBE_ENABLED(row))
+    {
+        std::string gtid = js ? json_gtid(js) : info_gtid(info);
+        CDC_PROBE2(row, gtid.c_str(), js ? json_event_type(js) : info.event_type);
+    }
+
+    if (m_checkpoint && m_connected && m_batch)
+    {
+        defer_checkpoint(js ? json_gtid(js) : info_gtid(info));
+    }
+    else if (m_checkpoint && m_connected)
+    {
+        // A failure is reported after the row, the update is retried with the next row
+        update_checkpoint(js ? json_gtid(js) : info_gtid(info));
+    }
+}
+
+bool Connection::append_event(Batch& dest, json_t* js, int64_t& timestamp)
+{
+    const SchemaInfo& schema = *m_schema_info;
+    m_event_values.resize(schema.keys.size());
+
+    // Look up all values first so that a missing one leaves the columns intact
+    for (size_t i = 0; i < schema.keys.size(); i++)
+    {
+        if ((m_event_values[i] = json_object_get(js, schema.keys[i].c_str())) == NULL)
+        {
+            m_error = "No value for key found: ";
+            m_error += schema.keys[i];
+            return false;
+        }
+    }
+
+    if (dest.m_columns.empty())
+    {
+        for (size_t i = 0; i < schema.keys.size(); i++)
+        {
+            dest.m_columns.push_back(Column(schema.keys[i], schema.column_types[i], schema.types[i],
+                                            schema.precisions[i], schema.scales[i], m_dictionary_limit));
+        }
+    }
+
+    for (size_t i = 0; i < schema.keys.size(); i++)
+    {
+        dest.m_columns[i].append(m_event_values[i]);
+    }
+
+    if (schema.timestamp != -1 && json_is_integer(m_event_values[schema.timestamp]))
+    {
+        timestamp = json_integer_value(m_event_values[schema.timestamp]);
+    }
+
+    dest.m_length++;
+    return true;
+}
+
+void decode_value(std::string& dest, json_t* value)
+{
+    if (json_is_string(value))
+    {
+        dest.assign(json_string_value(value), json_string_length(value));
+    }
+    else if (json_is_null(value))
+    {
+        dest.clear();
+    }
+    else
+    {
+        dest = json_to_string(value);
+    }
+}
+
+bool Connection::read(Decoder& dest)
+{
+    m_error.clear();
+
+    if (!commit_batch())
+    {
+        return false;
+    }
+
+    if (m_first_event)
+    {
+        // An event that was read ahead, decoded from its JSON values
+        json_t* js = m_first_event;
+        int64_t now = monotonic_ns();
+        EventInfo info;
+        bool rval = decode_event(dest, js, info.timestamp);
+        m_first_event = NULL;
+
+        if (rval)
+        {
+            finish_event(js, info, now, now);
+        }
+
+        json_decref(js);
+        return rval;
+    }
+
+    Row first;
+    first.swap(m_first_row);
+
+    if (first)
+    {
+        // A row that was read ahead by the row API, decoded from its string values
+        const SchemaInfo& schema = *first->m_schema;
+
+        if (dest.m_schema_id != schema.id)
+        {
+            dest.setSchema(schema.keys, schema.types);
+            dest.m_schema_id = schema.id;
+        }
+
+        for (size_t i = 0; i < first->length(); i++)
+        {
+            json_t* value = json_stringn(first->value(i).c_str(), first->value(i).length());
+            dest.decode(i, value);
+            json_decref(value);
+        }
+
+        measure_lag(first->timestamp(), first->receiveTime());
+
+        if (m_checkpoint && m_connected)
+        {
+            update_checkpoint(first->gtid());
+        }
+
+        return true;
+    }
+
+    std::string line;
+    bool rval = false;
+
+    while (!rval && m_error.empty() && read_row(line))
+    {
+        json_error_t err;
+        int64_t start = monotonic_ns();
+        EventInfo info;
+
+        if (dest.m_schema_id != m_schema_info->id && !m_schema_info->keys.empty())
+        {
+            dest.setSchema(m_schema_info->keys, m_schema_info->types);
+            dest.m_schema_id = m_schema_info->id;
+        }
+
+        if (dest.m_schema_id == m_schema_info->id && dest.decodeLine(line, info))
+        {
+            finish_event(NULL, info, start, monotonic_ns());
+            rval = true;
+            break;
+        }
+
+        CDC_PROBE1(parse_start, line.length());
+        json_t* js = json_loads(line.c_str(), JSON_ALLOW_NUL, &err);
+        CDC_PROBE1(parse_end, js != NULL);
+        int64_t parsed = monotonic_ns();
+
+        if (!js)
+        {
+            m_error = "Failed to parse JSON: ";
+            m_error += err.text;
+            break;
+        }
+
+        if (is_schema(js))
+        {
+            m_schema = line;
+            process_schema(js);
+            m_stats.inc(Stats::SCHEMA_CHANGES);
+            CDC_PROBE2(schema, m_schema_info->keys.size(), m_schema.c_str());
+        }
+        else if (decode_event(dest, js, info.timestamp))
+        {
+            finish_event(js, info, start, parsed);
+            rval = true;
+        }
+
+        json_decref(js);
+    }
+
+    if (!rval && m_error == CDC::TIMEOUT && !m_nowait && m_checkpoint && m_connected)
+    {
+        // Store the pending checkpoint while the stream is idle
+        m_checkpoint->flush();
+    }
+
+    return rval;
+}
+
+bool Connection::decode_event(Decoder& dest, json_t* js, int64_t& timestamp)
+{
+    const SchemaInfo& schema = *m_schema_info;
+    m_event_values.resize(schema.keys.size());
+
+    // Look up all values first so that a missing one leaves the decoder intact
+    for (size_t i = 0; i < schema.keys.size(); i++)
+    {
+        if ((m_event_values[i] = json_object_get(js, schema.keys[i].c_str())) == NULL)
+        {
+            m_error = "No value for key found: ";
+            m_error += schema.keys[i];
+            return false;
+        }
+    }
+
+    if (dest.m_schema_id != schema.id)
+    {
+        dest.setSchema(schema.keys, schema.types);
+        dest.m_schema_id = schema.id;
+    }
+
+    for (size_t i = 0; i < schema.keys.size(); i++)
+    {
+        dest.decode(i, m_event_values[i]);
+    }
+
+    if (schema.timestamp != -1 && json_is_integer(m_event_values[schema.timestamp]))
+    {
+        timestamp = json_integer_value(m_event_values[schema.timestamp]);
+    }
+
+    return true;
+}
+
+Transaction Connection::readTransaction()
+{
+    m_error.clear();
+    Transaction rval;
+
+    if (!commit_batch())
+    {
+        return rval;
+    }
+
+    if (m_checkpoint && m_connected && m_last_complete && m_last_gtid.length() &&
+        !m_checkpoint->update(m_last_gtid))
+    {
+        // The previously returned transaction has been processed
+        m_error = "Failed to store checkpoint: ";
+        m_error += m_checkpoint->error();
+        return rval;
+    }
+
+    Row row;
+
+    while ((row = next_row()))
+    {
+        if (!m_trx_rows.empty() && row->gtid() != m_trx_rows.front()->gtid())
+        {
+            // The first row of the next transaction, kept for the next read
+            std::string gtid = m_trx_rows.front()->gtid();
+            rval = Transaction(new InternalTransaction(gtid, m_trx_rows));
+            m_trx_rows.assign(1, row);
+            m_last_gtid = gtid;
+            m_last_complete = true;
+            break;
+        }
+
+        m_trx_rows.push_back(row);
+    }
+
+    if (!rval && m_checkpoint && m_connected && m_error == CDC::TIMEOUT)
+    {
+        m_checkpoint->flush();
+    }
+
+    return rval;
+}
+
+/**
+ * Private functions
+ */
+
+bool Connection::do_auth()
+{
+    bool rval = false;
+    std::string auth_str = generateAuthString(m_user, m_password);
+
+    /** Send the auth string */
+    if (nointr_write(auth_str.c_str(), auth_str.length()) == -1)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to write authentication data: ";
+        m_error += strerror_r(errno, err, sizeof(err));
+    }
+    else
+    {
+        /** Read the response */
+        char buf[READBUF_SIZE];
+        int bytes;
+
+        if ((bytes = nointr_read(buf, sizeof(buf))) == -1)
+        {
+            char err[ERRBUF_SIZE];
+            m_error = "Failed to read authentication response: ";
+            m_error += strerror_r(errno, err, sizeof(err));
+        }
+        else if (memcmp(buf, OK_RESPONSE, sizeof(OK_RESPONSE) - 1) != 0)
+        {
+            buf[bytes] = '\0';
+            m_error = "Authentication failed: ";
+            m_error += buf;
+        }
+        else
+        {
+            rval = true;
+        }
+    }
+
+    return rval;
+}
+
+std::string Connection::make_request(const std::string& table, const std::string& gtid)
+{
+    std::string req_msg(REQUEST_MSG);
+    req_msg += table;
+    m_last_gtid.clear();
+    m_last_complete = false;
+    m_batch_checkpoint.clear();
+    m_batch_last_gtid.clear();
+
+    if (gtid.length())
+    {
+        req_msg += " ";
+        req_msg += gtid;
+    }
+    else if (m_checkpoint && m_checkpoint->gtid().length())
+    {
+        req_msg += " ";
+        req_msg += m_checkpoint->gtid();
+    }
+
+    return req_msg;
+}
+
+bool Connection::read_response()
+{
+    char buf[READBUF_SIZE];
+    ssize_t rc;
+
+    while ((rc = ::read(m_fd, buf, sizeof(buf))) == -1 && errno == EINTR)
+    {
+        m_stats.inc(Stats::SYSCALLS);
+    }
+
+    m_stats.inc(Stats::SYSCALLS);
+
+    if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+        return true;
+    }
+    else if (rc == -1)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to read response: ";
+        m_error += strerror_r(errno, err, sizeof(err));
+        return false;
+    }
+    else if (rc == 0)
+    {
+        m_error = "Connection closed by MaxScale";
+        return false;
+    }
+
+    m_response.append(buf, rc);
+    const char* step = m_handshake == HANDSHAKE_AUTH ? "Authentication" : "Registration";
+
+    if (m_response.compare(0, 3, "ERR") == 0)
+    {
+        // Error responses lack the newline
+        m_error = step;
+        m_error += " failed: ";
+        m_error += m_response;
+        return false;
+    }
+    else if (m_response.find('\n') == std::string::npos)
+    {
+        // Not complete yet
+        return true;
+    }
+    else if (m_response.compare(0, sizeof(OK_RESPONSE) - 1, OK_RESPONSE) != 0)
+    {
+        m_error = step;
+        m_error += " failed: ";
+        m_error += m_response;
+        return false;
+    }
+
+    m_response.clear();
+
+    if (m_handshake == HANDSHAKE_AUTH)
+    {
+        m_pending_write = REGISTER_MSG;
+        m_pending_write += "JSON";
+        m_handshake = HANDSHAKE_REGISTER;
+    }
+    else
+    {
+        m_pending_write = m_request;
+        m_handshake = HANDSHAKE_NONE;
+    }
+
+    return flush_pending();
+}
+
+bool Connection::flush_pending()
+{
+    while (!m_pending_write.empty())
+    {
+        ssize_t rc = ::write(m_fd, m_pending_write.c_str(), m_pending_write.length());
+        m_stats.inc(Stats::SYSCALLS);
+
+        if (rc > 0)
+        {
+            m_pending_write.erase(0, rc);
+        }
+        else if (rc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        else if (rc == -1 && errno != EINTR)
+        {
+            char err[ERRBUF_SIZE];
+            m_error = "Failed to write data: ";
+            m_error += strerror_r(errno, err, sizeof(err));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool Connection::do_registration()
+{
+    bool rval = false;
+    std::string reg_msg(REGISTER_MSG);
+    reg_msg += "JSON";
+
+    /** Send the registration message */
+    if (nointr_write(reg_msg.c_str(), reg_msg.length()) == -1)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to write registration message: ";
+        m_error += strerror_r(errno, err, sizeof(err));
+    }
+    else
+    {
+        /** Read the response */
+        char buf[READBUF_SIZE];
+        int bytes;
+
+        if ((bytes = nointr_read(buf, sizeof(buf))) == -1)
+        {
+            char err[ERRBUF_SIZE];
+            m_error = "Failed to read registration response: ";
+            m_error += strerror_r(errno, err, sizeof(err));
+        }
+        else if (memcmp(buf, OK_RESPONSE, sizeof(OK_RESPONSE) - 1) != 0)
+        {
+            buf[bytes] = '\0';
+            m_error = "Registration failed: ";
+            m_error += buf;
+        }
+        else
+        {
+            rval = true;
+        }
+    }
+
+    return rval;
+}
+
+json_t* Connection::read_json(int64_t& start, int64_t& parsed)
+{
+    json_t* js = NULL;
+    std::string row;
+
+    while (!js && read_row(row))
+    {
+        json_error_t err;
+        start = monotonic_ns();
+        CDC_PROBE1(parse_start, row.length());
+        js = json_loads(row.c_str(), JSON_ALLOW_NUL, &err);
+        CDC_PROBE1(parse_end, js != NULL);
+        parsed = monotonic_ns();
+
+        if (!js)
+        {
+            m_error = "Failed to parse JSON: ";
+            m_error += err.text;
+            break;
+        }
+        else if (is_schema(js))
+        {
+            m_schema = row;
+            process_schema(js);
+            m_stats.inc(Stats::SCHEMA_CHANGES);
+            CDC_PROBE2(schema, m_schema_info->keys.size(), m_schema.c_str());
+            json_decref(js);
+            js = NULL;
+        }
+    }
+
+    return js;
+}
+
+Row Connection::read_event()
+{
+    Row rval;
+    int64_t start = monotonic_ns();
+    int64_t parsed = start;
+    json_t* js = m_first_event;
+    m_first_event = NULL;
+
+    if (js || (js = read_json(start, parsed)))
+    {
+        if ((rval = process_row(js)))
+        {
+            int64_t built = monotonic_ns();
+            m_stats.m_parse_time.add(parsed - start);
+            m_stats.m_build_time.add(built - parsed);
+            m_stats.inc(Stats::ROWS);
+            m_stats.set(Stats::LAST_ROW, built);
+        }
+
+        json_decref(js);
+    }
+
+    return rval;
+}
+
+bool Connection::update_checkpoint(const std::string& gtid)
+{
+    if (gtid != m_last_gtid)
+    {
+        // All rows of the previous transaction have been processed
+        if (m_last_gtid.length() && !m_checkpoint->update(m_last_gtid))
+        {
+            m_error = "Failed to store checkpoint: ";
+            m_error += m_checkpoint->error();
+            return false;
+        }
+
+        m_last_gtid = gtid;
+        m_last_complete = false;
+    }
+
+    return true;
+}
+
+void Connection::defer_checkpoint(const std::string& gtid)
+{
+    std::string last = m_batch_last_gtid.empty() ? m_last_gtid : m_batch_last_gtid;
+
+    if (gtid != last)
+    {
+        // The previous transaction is complete once the batch has been processed
+        m_batch_checkpoint = last;
+        m_batch_last_gtid = gtid;
+    }
+}
+
+bool Connection::commit_batch()
+{
+    if (m_batch_last_gtid.empty())
+    {
+        return true;
+    }
+
+    // All rows of the previous batch have been processed
+    if (m_checkpoint && m_batch_checkpoint.length() && !m_checkpoint->update(m_batch_checkpoint))
+    {
+        m_error = "Failed to store checkpoint: ";
+        m_error += m_checkpoint->error();
+        return false;
+    }
+
+    m_last_gtid = m_batch_last_gtid;
+    m_last_complete = false;
+    m_batch_checkpoint.clear();
+    m_batch_last_gtid.clear();
+    return true;
+}
+
+Row Connection::next_event()
+{
+    Row rval;
+
+    if (m_first_row)
+    {
+        rval.swap(m_first_row);
+        assert(!m_first_row);
+    }
+    else
+    {
+        rval = read_event();
+    }
+
+    if (rval && m_pace_speed > 0)
+    {
+        pace(rval->timestamp());
+    }
+
+    if (rval)
+    {
+        measure_lag(rval->timestamp(), rval->receiveTime());
+
+        if (CDC_PROBE_ENABLED(row))
+        {
+            std::string gtid = rval->gtid();
+            CDC_PROBE2(row, gtid.c_str(),
+                       m_schema_info->event_type != -1 ? rval->value(m_schema_info->event_type).c_str() : "");
+        }
+    }
+    else if (m_error == CDC::TIMEOUT)
+    {
+        CDC_PROBE0(timeout);
+    }
+    else
+    {
+        CDC_PROBE1(error, m_error.c_str());
+    }
+
+    return rval;
+}
+
+void Connection::measure_lag(int64_t timestamp, int64_t receive_time)
+{
+    int64_t now = realtime_ms();
+
+    if (timestamp != -1)
+    {
+        int64_t lag = now - timestamp * 1000;
+        m_stats.set(Stats::LAG, lag);
+        m_stats.m_lag_time.add(lag > 0 ? lag * 1000000 : 0);
+    }
+
+    m_stats.set(Stats::RECEIVE_LAG, now - receive_time);
+}
+
+void Connection::pace(int64_t timestamp)
+{
+    if (timestamp == -1)
+    {
+        return;
+    }
+
+    int64_t now = monotonic_ms();
+
+    if (m_pace_timestamp == -1)
+    {
+        m_pace_timestamp = timestamp;
+        m_pace_time = now;
+    }
+
+    int64_t due = m_pace_time + (timestamp - m_pace_timestamp) * 1000 / m_pace_speed;
+
+    if (due > now)
+    {
+        struct timespec ts;
+        ts.tv_sec = (due - now) / 1000;
+        ts.tv_nsec = ((due - now) % 1000) * 1000000;
+
+        while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        {
+            ;
+        }
+    }
+}
+
+Row Connection::next_row()
+{
+    return pair_update(next_event());
+}
+
+Row Connection::pair_update(Row before)
+{
+    if (!before || !m_pair_updates || m_schema_info->event_type == -1 ||
+        before->value(m_schema_info->event_type) != UPDATE_BEFORE)
+    {
+        return before;
+    }
+
+    Row rval = before;
+    Row after = read_event();
+
+    if (after && after->value(m_schema_info->event_type) == UPDATE_AFTER &&
+        after->length() == before->length())
+    {
+        after->m_values[m_schema_info->event_type] = UPDATE;
+        after->m_before.swap(before->m_values);
+        after->m_changed.resize(after->length());
+
+        for (size_t i = 0; i < after->length(); i++)
+        {
+            after->m_changed[i] = !is_metadata(after->m_schema->keys[i]) &&
+                                  after->m_values[i] != after->m_before[i];
+        }
+
+        rval = after;
+    }
+    else if (after)
+    {
+        // Not the matching after image, return it on the next read
+        m_first_row = after;
+    }
+    else if (m_error == CDC::TIMEOUT)
+    {
+        // The after image has not arrived yet, try again on the next read
+        m_first_row = before;
+        rval.reset();
+    }
+    else
+    {
+        rval.reset();
+    }
+
+    return rval;
+}
+
+bool Connection::is_error(const char* str)
+{
+    bool rval = false;
+
+    if (str[0] == 'E' && str[1] == 'R' && str[2] == 'R')
+    {
+        m_error = "MaxScale responded with an error: ";
+        m_error += str;
+        rval = true;
+    }
+
+    return rval;
+}
+
+bool Connection::read_row(std::string& dest)
+{
+    bool rval = true;
+
+    while (true)
+    {
+        if (!m_buffer.empty())
+        {
+            std::vector<char>::iterator it = std::find(m_buf_ptr, m_buffer.end(), '\n');
+            if (it != m_buffer.end())
+            {
+                dest.assign(m_buf_ptr, it);
+                m_buf_ptr = it + 1;
+                CDC_PROBE1(line, dest.length());
+                break;
+            }
+        }
+
+        char buf[READBUF_SIZE + 1];
+        int rc = read_data(buf, READBUF_SIZE);
+
+        if (rc == -1)
+        {
+            rval = false;
+
+            if (m_error.empty())
+            {
+                char err[ERRBUF_SIZE];
+                m_error = "Failed to read row: ";
+                m_error += strerror_r(errno, err, sizeof(err));
+            }
+            break;
+        }
+        else if (rc == 0)
+        {
+            rval = false;
+            // A recording is always readable, reading nothing means it has ended
+            m_error = m_replay ? CDC::END_OF_STREAM : CDC::TIMEOUT;
+            break;
+        }
+
+        if (!m_connected)
+        {
+            // This is here to work around a missing newline in MaxScale error messages
+            buf[rc] = '\0';
+
+            if (is_error(buf))
+            {
+                rval = false;
+                break;
+            }
+        }
+
+        assert(std::find(m_buf_ptr, m_buffer.end(), '\n') == m_buffer.end());
+        buffer_data(buf, rc);
+    }
+
+    if (!m_connected && is_error(dest.c_str()))
+    {
+        rval = false;
+    }
+
+    return rval;
+}
+
+void Connection::buffer_data(const char* data, size_t size)
+{
+    m_buffer.erase(m_buffer.begin(), m_buf_ptr);
+    m_buffer.insert(m_buffer.end(), data, data + size);
+    m_buf_ptr = m_buffer.begin();
+    m_receive_time = realtime_ms();
+
+    if (m_buffer.size() > m_stats.bufferHighWater())
+    {
+        m_stats.set(Stats::BUFFER_HIGH_WATER, m_buffer.size());
+    }
+}
+
+/**
+ * The spool between the network and the consumer
+ */
+
+// A memory-mapped segment file of the spool
+struct SpoolSegment
+{
+    std::string path;
+    int         fd;
+    char*       data;
+    size_t      size;
+    size_t      written;    // Protected by the spool lock
+    uint64_t    syncs;      // Checkpoint syncs when the segment was read
+};
+
+struct Connection::Spool
+{
+    std::string               dir;
+    size_t                    segment_size;
+    size_t                    max_segments; // Maximum number of segment files, 0 for no limit
+    int                       fd;
+    pthread_t                 thread;
+    pthread_mutex_t           lock;
+    pthread_cond_t            cond;
+    pthread_cond_t            space;        // Signaled when a segment is deleted
+    std::deque<SpoolSegment*> segments;     // Protected by lock, the first one is being read
+    std::deque<SpoolSegment*> retired;      // Read segments waiting for a checkpoint
+    size_t                    n_segments;   // Protected by lock, number of segment files
+    uint64_t                  next_id;      // Number of the next segment file
+    size_t                    read_pos;     // Read position in the first segment
+    bool                      done;         // Protected by lock, set when the writer stops
+    bool                      stop;         // Protected by lock
+    std::string               error;        // Protected by lock
+    Stats*                    stats;        // The statistics of the connection
+};
+
+namespace
+{
+
+const char SPOOL_PREFIX[] = "cdc_spool.";
+
+SpoolSegment* create_segment(const std::string& dir, uint64_t id, size_t size, std::string& error)
+{
+    std::stringstream ss;
+    ss << dir << "/" << SPOOL_PREFIX << id;
+
+    SpoolSegment* seg = new SpoolSegment;
+    seg->path = ss.str();
+    seg->size = size;
+    seg->written = 0;
+    seg->syncs = 0;
+    seg->data = NULL;
+    seg->fd = open(seg->path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+    if (seg->fd == -1 || ftruncate(seg->fd, size) == -1 ||
+        (seg->data = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0)) == MAP_FAILED)
+    {
+        char err[ERRBUF_SIZE];
+        error = "Failed to create spool segment '";
+        error += seg->path;
+        error += "': ";
+        error += strerror_r(errno, err, sizeof(err));
+
+        if (seg->fd != -1)
+        {
+            close(seg->fd);
+            unlink(seg->path.c_str());
+        }
+
+        delete seg;
+        seg = NULL;
+    }
+
+    return seg;
+}
+
+void delete_segment(SpoolSegment* seg)
+{
+    munmap(seg->data, seg->size);
+    close(seg->fd);
+    unlink(seg->path.c_str());
+    delete seg;
+}
+
+// Removes the segment files left over by an earlier spool in the directory
+void remove_segments(const std::string& dir)
+{
+    DIR* d = opendir(dir.c_str());
+
+    if (d)
+    {
+        struct dirent* ent;
+
+        while ((ent = readdir(d)))
+        {
+            if (strncmp(ent->d_name, SPOOL_PREFIX, sizeof(SPOOL_PREFIX) - 1) == 0)
+            {
+                std::string path = dir + "/" + ent->d_name;
+                unlink(path.c_str());
+            }
+        }
+
+        closedir(d);
+    }
+}
+
+}
+
+void* Connection::spool_writer(void* data)
+{
+    Spool* spool = static_cast<Spool*>(data);
+    SpoolSegment* seg = NULL;
+    size_t written = 0;
+    std::string error;
+
+    while (error.empty())
+    {
+        pthread_mutex_lock(&spool->lock);
+        bool stop = spool->stop;
+        pthread_mutex_unlock(&spool->lock);
+
+        if (stop)
+        {
+            break;
+        }
+
+        if (seg == NULL || written == seg->size)
+        {
+            pthread_mutex_lock(&spool->lock);
+            bool full = spool->max_segments && spool->n_segments >= spool->max_segments;
+
+            if (full)
+            {
+                // Stop reading the network until the consumer frees a segment
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += 1;
+                pthread_cond_timedwait(&spool->space, &spool->lock, &deadline);
+            }
+
+            pthread_mutex_unlock(&spool->lock);
+
+            if (full)
+            {
+                continue;
+            }
+
+            if ((seg = create_segment(spool->dir, spool->next_id++, spool->segment_size, error)) == NULL)
+            {
+                break;
+            }
+
+            written = 0;
+            pthread_mutex_lock(&spool->lock);
+            spool->segments.push_back(seg);
+            spool->n_segments++;
+            pthread_mutex_unlock(&spool->lock);
+        }
+
+        struct pollfd pfd;
+        pfd.fd = spool->fd;
+        pfd.events = POLLIN;
+        int rc = poll(&pfd, 1, 1000);
+        spool->stats->inc(Stats::SYSCALLS);
+
+        if (rc == 0 || (rc == -1 && errno == EINTR))
+        {
+            continue;
+        }
+        else if (rc == -1)
+        {
+            char err[ERRBUF_SIZE];
+            error = "Failed to wait for event: ";
+            error += strerror_r(errno, err, sizeof(err));
+            break;
+        }
+
+        spool->stats->inc(Stats::POLL_WAKEUPS);
+
+        // Read straight into the mapped segment
+        ssize_t n = ::read(spool->fd, seg->data + written, seg->size - written);
+        spool->stats->inc(Stats::SYSCALLS);
+
+        if (n > 0)
+        {
+            written += n;
+            spool->stats->inc(Stats::BYTES, n);
+            pthread_mutex_lock(&spool->lock);
+            seg->written = written;
+            pthread_cond_signal(&spool->cond);
+            pthread_mutex_unlock(&spool->lock);
+        }
+        else if (n == 0)
+        {
+            error = "Connection closed by MaxScale";
+        }
+        else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            char err[ERRBUF_SIZE];
+            error = "Failed to read data: ";
+            error += strerror_r(errno, err, sizeof(err));
+        }
+    }
+
+    pthread_mutex_lock(&spool->lock);
+    spool->error = error;
+    spool->done = true;
+    pthread_cond_signal(&spool->cond);
+    pthread_mutex_unlock(&spool->lock);
+
+    return NULL;
+}
+
+bool Connection::start_spool()
+{
+    Spool* spool = new Spool;
+    spool->dir = m_spool_dir;
+    spool->segment_size = m_spool_segment_size;
+    spool->max_segments = 0;
+    spool->fd = m_fd;
+    spool->n_segments = 0;
+    spool->next_id = 0;
+    spool->read_pos = 0;
+    spool->done = false;
+    spool->stop = false;
+    spool->stats = &m_stats;
+    pthread_mutex_init(&spool->lock, NULL);
+    pthread_cond_init(&spool->cond, NULL);
+    pthread_cond_init(&spool->space, NULL);
+
+    if (m_spool_max_size)
+    {
+        spool->max_segments = std::max(m_spool_max_size / m_spool_segment_size, (size_t)2);
+    }
+
+    remove_segments(m_spool_dir);
+    int rc = pthread_create(&spool->thread, NULL, spool_writer, spool);
+
+    if (rc != 0)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to create spool thread: ";
+        m_error += strerror_r(rc, err, sizeof(err));
+        pthread_mutex_destroy(&spool->lock);
+        pthread_cond_destroy(&spool->cond);
+        pthread_cond_destroy(&spool->space);
+        delete spool;
+        return false;
+    }
+
+    m_spool = spool;
+    return true;
+}
+
+void Connection::stop_spool()
+{
+    if (m_spool)
+    {
+        pthread_mutex_lock(&m_spool->lock);
+        m_spool->stop = true;
+        pthread_mutex_unlock(&m_spool->lock);
+        pthread_join(m_spool->thread, NULL);
+
+        std::for_each(m_spool->segments.begin(), m_spool->segments.end(), delete_segment);
+        std::for_each(m_spool->retired.begin(), m_spool->retired.end(), delete_segment);
+        pthread_mutex_destroy(&m_spool->lock);
+        pthread_cond_destroy(&m_spool->cond);
+        pthread_cond_destroy(&m_spool->space);
+        delete m_spool;
+        m_spool = NULL;
+    }
+}
+
+int Connection::read_data(void *dest, size_t size)
+{
+    if (m_no_io)
+    {
+        // Only the buffered data is used
+        return 0;
+    }
+
+    int rc = read_stream(dest, size);
+    CDC_PROBE2(read, m_fd, rc);
+
+    if (rc > 0 && m_capture_fd != -1 && !write_capture(dest, rc))
+    {
+        rc = -1;
+    }
+
+    return rc;
+}
+
+bool Connection::write_capture(const void *src, size_t size)
+{
+    const char* ptr = static_cast<const char*>(src);
+
+    while (size > 0)
+    {
+        ssize_t rc = ::write(m_capture_fd, ptr, size);
+
+        if (rc == -1 && errno != EINTR)
+        {
+            char err[ERRBUF_SIZE];
+            m_error = "Failed to write captured data: ";
+            m_error += strerror_r(errno, err, sizeof(err));
+            return false;
+        }
+        else if (rc > 0)
+        {
+            ptr += rc;
+            size -= rc;
+        }
+    }
+
+    return true;
+}
+
+int Connection::read_stream(void *dest, size_t size)
+{
+    if (!m_spool)
+    {
+        return nointr_read(dest, size);
+    }
+
+    Spool* spool = m_spool;
+
+    while (!spool->retired.empty() &&
+           (!m_checkpoint || m_checkpoint->syncs() > spool->retired.front()->syncs))
+    {
+        delete_segment(spool->retired.front());
+        spool->retired.pop_front();
+        pthread_mutex_lock(&spool->lock);
+        spool->n_segments--;
+        pthread_cond_signal(&spool->space);
+        pthread_mutex_unlock(&spool->lock);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += m_nowait ? 0 : m_timeout;
+
+    pthread_mutex_lock(&spool->lock);
+    int n_bytes = 0;
+
+    while (true)
+    {
+        SpoolSegment* seg = spool->segments.empty() ? NULL : spool->segments.front();
+
+        if (seg && spool->read_pos < seg->written)
+        {
+            // The written part of a segment does not change, the copy can be done unlocked
+            size_t avail = seg->written - spool->read_pos;
+            pthread_mutex_unlock(&spool->lock);
+
+            n_bytes = std::min(avail, size);
+            memcpy(dest, seg->data + spool->read_pos, n_bytes);
+            spool->read_pos += n_bytes;
+            return n_bytes;
+        }
+        else if (seg && seg->written == seg->size && spool->segments.size() > 1)
+        {
+            // The segment is full and completely read
+            seg->syncs = m_checkpoint ? m_checkpoint->syncs() : 0;
+            spool->segments.pop_front();
+            spool->retired.push_back(seg);
+            spool->read_pos = 0;
+        }
+        else if (spool->done)
+        {
+            m_error = spool->error;
+            n_bytes = -1;
+            break;
+        }
+        else if (pthread_cond_timedwait(&spool->cond, &spool->lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&spool->lock);
+    return n_bytes;
+}
+
+#define is_poll_error(e) ((e & (POLLERR | POLLHUP | POLLNVAL)))
+
+static std::string event_to_string(int event)
+{
+    std::string rval;
+
+    if (event & POLLIN)
+    {
+        rval += "POLLIN ";
+    }
+    if (event & POLLPRI)
+    {
+        rval += "POLLPRI ";
+    }
+    if (event & POLLOUT)
+    {
+        rval += "POLLOUT ";
+    }
+#ifdef POLLRDHUP
+    if (event & POLLRDHUP)
+    {
+        rval += "POLLRDHUP ";
+    }
+#endif
+    if (event & POLLERR)
+    {
+        rval += "POLLERR ";
+    }
+    if (event & POLLHUP)
+    {
+        rval += "POLLHUP ";
+    }
+    if (event & POLLNVAL)
+    {
+        rval += "POLLNVAL ";
+    }
+
+    return rval;
+}
+
+int Connection::wait_for_event(short events)
+{
+    nfds_t nfds = 1;
+    struct pollfd pfd;
+    pfd.fd = m_fd;
+    pfd.events = events;
+    int rc;
+
+    while ((rc = poll(&pfd, nfds, m_nowait ? 0 : m_timeout * 1000)) < 0 && errno == EINTR)
+    {
+        m_stats.inc(Stats::SYSCALLS);
+    }
+
+    m_stats.inc(Stats::SYSCALLS);
+
+    if (rc > 0)
+    {
+        m_stats.inc(Stats::POLL_WAKEUPS);
+    }
+
+    if (rc > 0 && is_poll_error(pfd.revents))
+    {
+        rc = -1;
+        m_error += "Error when waiting event; ";
+        m_error += event_to_string(pfd.revents);
+    }
+    else if (rc < 0)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to wait for event: ";
+        m_error += strerror_r(errno, err, sizeof(err));
+    }
+
+    return rc;
+}
+
+int Connection::nointr_read(void *dest, size_t size)
+{
+    int n_bytes = 0;
+
+    // The socket is non-blocking, without waiting the read just finds nothing
+    if (m_nowait || wait_for_event(POLLIN) > 0)
+    {
+        int rc = 0;
+
+        while ((rc = ::read(m_fd, dest, size)) < 0 && errno == EINTR)
+        {
+            m_stats.inc(Stats::SYSCALLS);
+        }
+
+        m_stats.inc(Stats::SYSCALLS);
+
+        if (rc == -1 && errno != EWOULDBLOCK && errno != EAGAIN)
+        {
+            char err[ERRBUF_SIZE];
+            m_error = "Failed to read data: ";
+            m_error += strerror_r(errno, err, sizeof(err));
+            n_bytes = -1;
+        }
+        else if (rc == 0 && !m_replay)
+        {
+            // Readable with nothing to read, not a timeout
+            m_error = "Connection closed by MaxScale";
+            n_bytes = -1;
+        }
+        else if (rc > 0)
+        {
+            n_bytes += rc;
+            m_stats.inc(Stats::BYTES, rc);
+        }
+    }
+
+    return n_bytes;
+}
+
+int Connection::nointr_write(const void *src, size_t size)
+{
+    int rc = 0;
+    int n_bytes = 0;
+
+    if (wait_for_event(POLLOUT) > 0)
+    {
+        while ((rc = ::write(m_fd, src, size)) < 0 && errno == EINTR)
+        {
+            m_stats.inc(Stats::SYSCALLS);
+        }
+
+        m_stats.inc(Stats::SYSCALLS);
+
+        if (rc < 0 && errno != EWOULDBLOCK && errno != EAGAIN)
+        {
+            char err[ERRBUF_SIZE];
+            m_error = "Failed to write data: ";
+            m_error += strerror_r(errno, err, sizeof(err));
+            n_bytes = -1;
+        }
+        else if (rc > 0)
+        {
+            n_bytes += rc;
+        }
+    }
+
+    return n_bytes;
+}
+
+/**
+ * ReplaySource
+ */
+
+ReplaySource::ReplaySource(const std::string& path, Timing timing, double speed):
+    Connection("", 0, "", ""),
+    m_path(path),
+    m_timing(timing),
+    m_speed(speed)
+{
+    m_replay = true;
+}
+
+ReplaySource::~ReplaySource()
+{
+    close();
+}
+
+bool ReplaySource::open()
+{
+    close();
+    reset_stream();
+    m_pace_speed = m_timing == ORIGINAL && m_speed > 0 ? m_speed : 0;
+    m_pace_timestamp = -1;
+
+    if ((m_fd = ::open(m_path.c_str(), O_RDONLY)) == -1)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to open '";
+        m_error += m_path;
+        m_error += "': ";
+        m_error += strerror_r(errno, err, sizeof(err));
+        return false;
+    }
+
+    int64_t start;
+    int64_t parsed;
+
+    if ((m_first_event = read_json(start, parsed)))
+    {
+        m_connected = true;
+    }
+
+    return m_connected;
+}
+
+bool ReplaySource::connectAsync(const std::string&, const std::string&)
+{
+    close();
+    reset_stream();
+    m_error = "A replay cannot be read asynchronously";
+    return false;
+}
+
+/**
+ * CheckpointStore
+ */
+
+CheckpointStore::CheckpointStore(const std::string& path, int interval, size_t max_pending):
+    m_path(path),
+    m_interval(interval),
+    m_max_pending(max_pending),
+    m_pending(0),
+    m_last_sync(monotonic_ms()),
+    m_syncs(0)
+{
+    std::ifstream file(path.c_str());
+    std::getline(file, m_gtid);
+}
+
+CheckpointStore::~CheckpointStore()
+{
+    flush();
+}
+
+bool CheckpointStore::update(const std::string& gtid)
+{
+    if (gtid == m_gtid)
+    {
+        return true;
+    }
+
+    m_gtid = gtid;
+    m_pending++;
+
+    if (m_pending >= m_max_pending || monotonic_ms() - m_last_sync >= m_interval)
+    {
+        return flush();
+    }
+
+    return true;
+}
+
+bool CheckpointStore::flush()
+{
+    if (m_pending == 0)
+    {
+        return true;
+    }
+
+    m_error.clear();
+    std::string tmp = m_path + ".tmp";
+    std::string data = m_gtid + "\n";
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd == -1)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to open checkpoint file: ";
+        m_error += strerror_r(errno, err, sizeof(err));
+        return false;
+    }
+
+    ssize_t rc = write(fd, data.c_str(), data.length());
+    bool ok = false;
+
+    if (rc == -1)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to write checkpoint file: ";
+        m_error += strerror_r(errno, err, sizeof(err));
+    }
+    else if (rc != (ssize_t)data.length())
+    {
+        m_error = "Short write to checkpoint file";
+    }
+    else if (fsync(fd) == -1)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to sync checkpoint file: ";
+        m_error += strerror_r(errno, err, sizeof(err));
+    }
+    else
+    {
+        ok = true;
+    }
+
+    ::close(fd);
+
+    if (ok && rename(tmp.c_str(), m_path.c_str()) == -1)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to rename checkpoint file: ";
+        m_error += strerror_r(errno, err, sizeof(err));
+        ok = false;
+    }
+
+    if (ok)
+    {
+        // Sync the directory to make the rename durable
+        size_t pos = m_path.find_last_of('/');
+        std::string dir = pos == std::string::npos ? "." : pos == 0 ? "/" : m_path.substr(0, pos);
+        int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+
+        if (dirfd != -1)
+        {
+            fsync(dirfd);
+            ::close(dirfd);
+        }
+
+        m_pending = 0;
+        m_last_sync = monotonic_ms();
+        m_syncs++;
+    }
+
+    return ok;
+}
+
+/**
+ * Coalescer
+ */
+
+Coalescer::Coalescer(Connection& conn,
+                     const ValueList& key,
+                     size_t max_rows,
+                     int max_time):
+    m_conn(conn),
+    m_key(key),
+    m_max_rows(max_rows),
+    m_max_time(max_time),
+    m_output_pos(0),
+    m_seq(0)
+{
+}
+
+Row Coalescer::read()
+{
+    m_error.clear();
+    Row rval;
+
+    if (m_output_pos == m_output.size() && m_pending_error.empty())
+    {
+        fill();
+    }
+
+    if (m_output_pos < m_output.size())
+    {
+        rval.swap(m_output[m_output_pos++]);
+    }
+    else
+    {
+        // All changes have been returned, report why the window ended
+        m_error.swap(m_pending_error);
+        m_pending_error.clear();
+    }
+
+    return rval;
+}
+
+bool Coalescer::make_key(const Row& row, std::string& dest)
+{
+    return make_row_key(row, m_key, m_key_idx, dest, m_pending_error);
+}
+
+void Coalescer::add_change(const Row& row)
+{
+    const std::string& type = row->value("event_type");
+    Op op;
+
+    if (type == INSERT)
+    {
+        op = OP_INSERT;
     }
-    else if (read_row(row))
+    else if (type == DELETE)
     {
-        json_error_t err;
-        json_t* js = json_loads(row.c_str(), JSON_ALLOW_NUL, &err);
+        op = OP_DELETE;
+    }
+    else if (type == UPDATE_AFTER || type == UPDATE)
+    {
+        op = OP_UPDATE;
+    }
+    else
+    {
+        // An unpaired update_before, only the after image is kept
+        return;
+    }
+
+    std::string key;
+
+    if (!make_key(row, key))
+    {
+        return;
+    }
+
+    ChangeMap::iterator it = m_changes.find(key);
+
+    if (it == m_changes.end())
+    {
+        Change change;
+        change.row = row;
+        change.first = row;
+        change.op = op;
+        change.seq = m_seq++;
+        m_changes.insert(std::make_pair(key, change));
+        return;
+    }
+
+    Change& change = it->second;
+
+    if (change.op == OP_INSERT && op == OP_DELETE)
+    {
+        // The row never existed outside of this window
+        m_changes.erase(it);
+        return;
+    }
+
+    if (change.op == OP_INSERT)
+    {
+        // Inserting the final values is enough
+        op = OP_INSERT;
+    }
+    else if (change.op == OP_DELETE && op == OP_INSERT)
+    {
+        op = OP_UPDATE;
+    }
+
+    if (change.op != OP_UPDATE)
+    {
+        // A new chain of updates starts here
+        change.first = change.op == OP_DELETE ? change.row : row;
+    }
+
+    change.row = row;
+    change.op = op;
+    change.seq = m_seq++;
+}
+
+Row Coalescer::finish_change(Change& change)
+{
+    Row& row = change.row;
+    const char* type = NULL;
+    int idx = row->m_schema->event_type;
+
+    if (change.op == OP_INSERT)
+    {
+        type = INSERT;
+        row->m_before.clear();
+        row->m_changed.clear();
+    }
+    else if (change.op == OP_UPDATE)
+    {
+        type = m_conn.m_pair_updates ? UPDATE : UPDATE_AFTER;
+
+        if (m_conn.m_pair_updates && change.first != row &&
+            change.first->length() == row->length())
+        {
+            // Use the before image of the whole chain
+            if (change.first->paired())
+            {
+                row->m_before = change.first->m_before;
+            }
+            else
+            {
+                row->m_before = change.first->m_values;
+            }
+
+            row->m_changed.resize(row->length());
+
+            for (size_t i = 0; i < row->length(); i++)
+            {
+                row->m_changed[i] = !is_metadata(row->m_schema->keys[i]) &&
+                                    row->m_values[i] != row->m_before[i];
+            }
+        }
+    }
+
+    if (type && idx != -1)
+    {
+        row->m_values[idx] = type;
+    }
+
+    return row;
+}
+
+bool Coalescer::change_order(const Change* a, const Change* b)
+{
+    return a->seq < b->seq;
+}
+
+void Coalescer::fill()
+{
+    m_output.clear();
+    m_output_pos = 0;
+
+    // Changes can cancel each other out, keep reading windows until something
+    // is left to return or the stream stops
+    while (m_output.empty() && m_pending_error.empty())
+    {
+        m_changes.clear();
+
+        int64_t end = monotonic_ms() + m_max_time;
+        size_t n_rows = 0;
+        Row row;
+
+        while (n_rows < m_max_rows && m_pending_error.empty())
+        {
+            if ((row = m_conn.read()))
+            {
+                add_change(row);
+                n_rows++;
+
+                if (monotonic_ms() >= end)
+                {
+                    break;
+                }
+            }
+            else
+            {
+                m_pending_error = m_conn.error();
+            }
+        }
+
+        std::vector<Change*> changes;
+        changes.reserve(m_changes.size());
+
+        for (ChangeMap::iterator it = m_changes.begin(); it != m_changes.end(); it++)
+        {
+            changes.push_back(&it->second);
+        }
+
+        std::sort(changes.begin(), changes.end(), change_order);
+        m_output.reserve(changes.size());
+
+        for (std::vector<Change*>::iterator it = changes.begin(); it != changes.end(); it++)
+        {
+            m_output.push_back(finish_change(**it));
+        }
+
+        m_changes.clear();
+
+        if (m_pending_error == CDC::TIMEOUT && !m_output.empty())
+        {
+            // The window ended because the stream is idle
+            m_pending_error.clear();
+        }
+    }
+}
+
+/**
+ * MaterializedTable
+ */
+
+namespace
+{
+
+// Locks a read-write lock for the lifetime of the object
+class ReadLock
+{
+public:
+    ReadLock(pthread_rwlock_t* lock):
+        m_lock(lock)
+    {
+        pthread_rwlock_rdlock(m_lock);
+    }
+
+    ~ReadLock()
+    {
+        pthread_rwlock_unlock(m_lock);
+    }
+
+private:
+    pthread_rwlock_t* m_lock;
+};
+
+}
+
+MaterializedTable::MaterializedTable(Connection& conn, const ValueList& key, size_t shards):
+    m_conn(conn),
+    m_key(key),
+    m_shards(new Shard[shards ? shards : 1]),
+    m_n_shards(shards ? shards : 1),
+    m_trx(0)
+{
+    for (size_t i = 0; i < m_n_shards; i++)
+    {
+        pthread_rwlock_init(&m_shards[i].lock, NULL);
+        m_shards[i].trx = 0;
+    }
+
+    pthread_mutex_init(&m_gtid_lock, NULL);
+}
+
+MaterializedTable::~MaterializedTable()
+{
+    for (size_t i = 0; i < m_n_shards; i++)
+    {
+        pthread_rwlock_destroy(&m_shards[i].lock);
+    }
+
+    pthread_mutex_destroy(&m_gtid_lock);
+    delete[] m_shards;
+}
+
+std::string MaterializedTable::make_key(const ValueList& key)
+{
+    std::string rval;
+
+    for (ValueList::const_iterator it = key.begin(); it != key.end(); it++)
+    {
+        rval += *it;
+        rval += '\0';
+    }
+
+    return rval;
+}
+
+size_t MaterializedTable::shard_of(const std::string& key) const
+{
+    return hash_bytes(key.data(), key.length()) % m_n_shards;
+}
+
+void MaterializedTable::pack(const Row& row, const std::vector<size_t>& idx, std::string& dest)
+{
+    size_t len = 0;
+
+    for (std::vector<size_t>::const_iterator it = idx.begin(); it != idx.end(); it++)
+    {
+        len += sizeof(uint32_t) + row->value(*it).length();
+    }
+
+    // Each value is stored as a 32-bit length followed by the data
+    dest.clear();
+    dest.reserve(len);
+
+    for (std::vector<size_t>::const_iterator it = idx.begin(); it != idx.end(); it++)
+    {
+        const std::string& value = row->value(*it);
+        uint32_t n = value.length();
+        dest.append((const char*)&n, sizeof(n));
+        dest.append(value);
+    }
+}
+
+void MaterializedTable::unpack(const std::string& src, ValueList& dest)
+{
+    dest.clear();
+    const char* ptr = src.data();
+    const char* end = ptr + src.length();
+
+    while (ptr < end)
+    {
+        uint32_t n;
+        memcpy(&n, ptr, sizeof(n));
+        ptr += sizeof(n);
+        dest.push_back(std::string(ptr, n));
+        ptr += n;
+    }
+}
+
+bool MaterializedTable::same_layout(const Row& row) const
+{
+    if (row->length() != m_row_keys.size())
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < m_row_keys.size(); i++)
+    {
+        if (row->key(i) != m_row_keys[i])
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void MaterializedTable::repack(std::string& row, const std::vector<int>& mapping)
+{
+    ValueList old_values;
+    unpack(row, old_values);
+    std::string packed;
+
+    for (std::vector<int>::const_iterator m = mapping.begin(); m != mapping.end(); m++)
+    {
+        static const std::string empty;
+        const std::string& value = *m == -1 ? empty : old_values[*m];
+        uint32_t n = value.length();
+        packed.append((const char*)&n, sizeof(n));
+        packed.append(value);
+    }
+
+    row.swap(packed);
+}
+
+bool MaterializedTable::change_layout(const Row& row, std::vector<Change>& pending)
+{
+    std::vector<size_t> key_idx;
+    std::vector<size_t> data_idx;
+    ValueList columns;
+    ValueList row_keys;
+
+    for (size_t i = 0; i < row->length(); i++)
+    {
+        row_keys.push_back(row->key(i));
+
+        if (!is_metadata(row->key(i)))
+        {
+            data_idx.push_back(i);
+            columns.push_back(row->key(i));
+        }
+    }
+
+    for (ValueList::iterator it = m_key.begin(); it != m_key.end(); it++)
+    {
+        size_t idx = std::find(row_keys.begin(), row_keys.end(), *it) - row_keys.begin();
+
+        if (idx == row_keys.size())
+        {
+            m_error = "Key column not found: ";
+            m_error += *it;
+            return false;
+        }
+
+        key_idx.push_back(idx);
+    }
+
+    // Map the stored columns to the new layout, new columns are left empty
+    std::vector<int> mapping;
+
+    for (ValueList::iterator it = columns.begin(); it != columns.end(); it++)
+    {
+        size_t idx = std::find(m_columns.begin(), m_columns.end(), *it) - m_columns.begin();
+        mapping.push_back(idx == m_columns.size() ? -1 : (int)idx);
+    }
+
+    for (size_t i = 0; i < m_n_shards; i++)
+    {
+        pthread_rwlock_wrlock(&m_shards[i].lock);
+    }
+
+    for (size_t i = 0; i < m_n_shards; i++)
+    {
+        for (RowMap::iterator it = m_shards[i].rows.begin(); it != m_shards[i].rows.end(); it++)
+        {
+            repack(it->second, mapping);
+        }
+    }
+
+    // The changes not yet applied were packed with the old layout as well
+    for (std::vector<Change>::iterator it = pending.begin(); it != pending.end(); it++)
+    {
+        if (!it->remove)
+        {
+            repack(it->row, mapping);
+        }
+    }
+
+    m_row_keys.swap(row_keys);
+    m_columns.swap(columns);
+    m_key_idx.swap(key_idx);
+    m_data_idx.swap(data_idx);
+
+    for (size_t i = 0; i < m_n_shards; i++)
+    {
+        pthread_rwlock_unlock(&m_shards[i].lock);
+    }
+
+    return true;
+}
+
+void MaterializedTable::apply(std::vector<Change>& changes, const std::string& gtid)
+{
+    std::vector<bool> touched(m_n_shards, false);
+
+    for (std::vector<Change>::iterator it = changes.begin(); it != changes.end(); it++)
+    {
+        touched[it->shard] = true;
+    }
+
+    // Locking the shards in order prevents deadlocks with snapshot lookups
+    for (size_t i = 0; i < m_n_shards; i++)
+    {
+        if (touched[i])
+        {
+            pthread_rwlock_wrlock(&m_shards[i].lock);
+        }
+    }
+
+    for (std::vector<Change>::iterator it = changes.begin(); it != changes.end(); it++)
+    {
+        RowMap& rows = m_shards[it->shard].rows;
+
+        if (it->remove)
+        {
+            rows.erase(it->key);
+        }
+        else
+        {
+            rows[it->key].swap(it->row);
+        }
+    }
+
+    for (size_t i = 0; i < m_n_shards; i++)
+    {
+        if (touched[i])
+        {
+            m_shards[i].trx = m_trx;
+            m_shards[i].gtid = gtid;
+            pthread_rwlock_unlock(&m_shards[i].lock);
+        }
+    }
+
+    changes.clear();
+}
+
+bool MaterializedTable::ingest()
+{
+    m_error = m_fatal_error;
+
+    if (!m_error.empty())
+    {
+        return false;
+    }
+
+    Transaction trx = m_conn.readTransaction();
+
+    if (!trx)
+    {
+        m_error = m_conn.error();
+        return false;
+    }
+
+    std::vector<Change> changes;
+    changes.reserve(trx->length());
+
+    for (RowList::const_iterator it = trx->rows().begin(); it != trx->rows().end(); it++)
+    {
+        const Row& row = *it;
+
+        if (!same_layout(row) && !change_layout(row, changes))
+        {
+            // The transaction has been read, the table can no longer follow the stream
+            m_fatal_error = m_error;
+            return false;
+        }
+
+        // The before image of an update removes the row with the old key, the
+        // after image that follows it inserts the row with the new key
+        const std::string& type = row->value("event_type");
+        bool remove = type == DELETE || type == UPDATE_BEFORE;
+
+        if (!remove && type != INSERT && type != UPDATE_AFTER && type != UPDATE)
+        {
+            continue;
+        }
+
+        Change change;
+        change.remove = remove;
+
+        for (std::vector<size_t>::iterator k = m_key_idx.begin(); k != m_key_idx.end(); k++)
+        {
+            change.key += row->value(*k);
+            change.key += '\0';
+        }
+
+        change.shard = shard_of(change.key);
 
-        if (js)
+        if (row->paired())
         {
-            if (is_schema(js))
+            // The key can change in an update, the row with the old key is removed
+            Change old;
+            old.remove = true;
+
+            for (std::vector<size_t>::iterator k = m_key_idx.begin(); k != m_key_idx.end(); k++)
             {
-                m_schema = row;
-                process_schema(js);
-                rval = Connection::read();
+                old.key += row->before(*k);
+                old.key += '\0';
             }
-            else
+
+            if (old.key != change.key)
             {
-                rval = process_row(js);
+                old.shard = shard_of(old.key);
+                changes.push_back(old);
             }
-
-            json_decref(js);
         }
-        else
+
+        if (!remove)
         {
-            m_error = "Failed to parse JSON: ";
-            m_error += err.text;
+            pack(row, m_data_idx, change.row);
         }
+
+        changes.push_back(change);
     }
 
-    return rval;
+    m_trx++;
+    apply(changes, trx->gtid());
+
+    pthread_mutex_lock(&m_gtid_lock);
+    m_gtid = trx->gtid();
+    pthread_mutex_unlock(&m_gtid_lock);
+
+    return true;
 }
 
-/**
- * Private functions
- */
+bool MaterializedTable::lookup(const ValueList& key, ValueList& dest) const
+{
+    std::string k = make_key(key);
+    Shard& shard = m_shards[shard_of(k)];
+    ReadLock lock(&shard.lock);
+    RowMap::const_iterator it = shard.rows.find(k);
 
-bool Connection::do_auth()
+    if (it != shard.rows.end())
+    {
+        unpack(it->second, dest);
+        return true;
+    }
+
+    return false;
+}
+
+size_t MaterializedTable::lookup(const std::vector<ValueList>& keys,
+                                 std::vector<ValueList>& dest,
+                                 std::string* gtid) const
 {
-    bool rval = false;
-    std::string auth_str = generateAuthString(m_user, m_password);
+    std::vector<std::string> k;
+    std::vector<bool> needed(m_n_shards, false);
+    size_t found = 0;
 
-    /** Send the auth string */
-    if (nointr_write(auth_str.c_str(), auth_str.length()) == -1)
+    for (std::vector<ValueList>::const_iterator it = keys.begin(); it != keys.end(); it++)
     {
-        char err[ERRBUF_SIZE];
-        m_error = "Failed to write authentication data: ";
-        m_error += strerror_r(errno, err, sizeof(err));
+        k.push_back(make_key(*it));
+        needed[shard_of(k.back())] = true;
     }
-    else
+
+    for (size_t i = 0; i < m_n_shards; i++)
     {
-        /** Read the response */
-        char buf[READBUF_SIZE];
-        int bytes;
+        if (needed[i])
+        {
+            pthread_rwlock_rdlock(&m_shards[i].lock);
+        }
+    }
 
-        if ((bytes = nointr_read(buf, sizeof(buf))) == -1)
+    dest.clear();
+    dest.resize(keys.size());
+    uint64_t latest = 0;
+
+    for (size_t i = 0; i < k.size(); i++)
+    {
+        const Shard& shard = m_shards[shard_of(k[i])];
+        RowMap::const_iterator it = shard.rows.find(k[i]);
+
+        if (it != shard.rows.end())
         {
-            char err[ERRBUF_SIZE];
-            m_error = "Failed to read authentication response: ";
-            m_error += strerror_r(errno, err, sizeof(err));
+            unpack(it->second, dest[i]);
+            found++;
         }
-        else if (memcmp(buf, OK_RESPONSE, sizeof(OK_RESPONSE) - 1) != 0)
+
+        if (gtid && shard.trx > latest)
         {
-            buf[bytes] = '\0';
-            m_error = "Authentication failed: ";
-            m_error += buf;
+            latest = shard.trx;
+            *gtid = shard.gtid;
         }
-        else
+    }
+
+    for (size_t i = 0; i < m_n_shards; i++)
+    {
+        if (needed[i])
         {
-            rval = true;
+            pthread_rwlock_unlock(&m_shards[i].lock);
         }
     }
 
+    return found;
+}
+
+size_t MaterializedTable::size() const
+{
+    size_t rval = 0;
+
+    for (size_t i = 0; i < m_n_shards; i++)
+    {
+        ReadLock lock(&m_shards[i].lock);
+        rval += m_shards[i].rows.size();
+    }
+
     return rval;
 }
 
-bool Connection::do_registration()
+ValueList MaterializedTable::columns() const
 {
-    bool rval = false;
-    std::string reg_msg(REGISTER_MSG);
-    reg_msg += "JSON";
+    // The columns only change when all shards are locked
+    ReadLock lock(&m_shards[0].lock);
+    return m_columns;
+}
 
-    /** Send the registration message */
-    if (nointr_write(reg_msg.c_str(), reg_msg.length()) == -1)
+std::string MaterializedTable::gtid() const
+{
+    pthread_mutex_lock(&m_gtid_lock);
+    std::string rval = m_gtid;
+    pthread_mutex_unlock(&m_gtid_lock);
+    return rval;
+}
+
+/**
+ * Dispatcher
+ */
+
+// A worker thread and its single-producer single-consumer queue
+struct Dispatcher::Worker
+{
+    Dispatcher*              owner;
+    size_t                   id;
+    pthread_t                thread;
+    bool                     running;
+    std::vector<Row>         rows;
+    std::vector<uint64_t>    seqs;
+    size_t                   mask;
+    std::atomic<uint64_t>    head;      // Next slot to process, written by the worker
+    std::atomic<uint64_t>    tail;      // Next slot to fill, written by the dispatcher
+    std::atomic<uint64_t>    done;      // Sequence number of the latest processed row
+    uint64_t                 queued;    // Sequence number of the latest queued row
+    std::atomic<bool>        stop;
+};
+
+Dispatcher::Dispatcher(Connection& conn,
+                       const ValueList& key,
+                       RowHandler& handler,
+                       size_t workers,
+                       size_t queue_size):
+    m_conn(conn),
+    m_key(key),
+    m_handler(handler),
+    m_seq(0),
+    m_trx_pos(0)
+{
+    size_t size = 1;
+
+    while (size < queue_size)
     {
-        char err[ERRBUF_SIZE];
-        m_error = "Failed to write registration message: ";
-        m_error += strerror_r(errno, err, sizeof(err));
+        size <<= 1;
     }
-    else
+
+    for (size_t i = 0; i < std::max(workers, (size_t)1); i++)
     {
-        /** Read the response */
-        char buf[READBUF_SIZE];
-        int bytes;
+        Worker* w = new Worker;
+        w->owner = this;
+        w->id = i;
+        w->rows.resize(size);
+        w->seqs.resize(size);
+        w->mask = size - 1;
+        w->head = 0;
+        w->tail = 0;
+        w->done = 0;
+        w->queued = 0;
+        w->stop = false;
+        int rc = pthread_create(&w->thread, NULL, run_worker, w);
+        w->running = rc == 0;
 
-        if ((bytes = nointr_read(buf, sizeof(buf))) == -1)
+        if (!w->running && m_error.empty())
         {
+            // pthread_create returns the error instead of setting errno
             char err[ERRBUF_SIZE];
-            m_error = "Failed to read registration response: ";
-            m_error += strerror_r(errno, err, sizeof(err));
-        }
-        else if (memcmp(buf, OK_RESPONSE, sizeof(OK_RESPONSE) - 1) != 0)
-        {
-            buf[bytes] = '\0';
-            m_error = "Registration failed: ";
-            m_error += buf;
-        }
-        else
-        {
-            rval = true;
+            m_error = "Failed to create worker thread: ";
+            m_error += strerror_r(rc, err, sizeof(err));
         }
-    }
 
-    return rval;
+        m_workers.push_back(w);
+    }
 }
 
-bool Connection::is_error(const char* str)
+Dispatcher::~Dispatcher()
 {
-    bool rval = false;
+    stop();
 
-    if (str[0] == 'E' && str[1] == 'R' && str[2] == 'R')
+    for (std::vector<Worker*>::iterator it = m_workers.begin(); it != m_workers.end(); it++)
     {
-        m_error = "MaxScale responded with an error: ";
-        m_error += str;
-        rval = true;
+        delete *it;
     }
-
-    return rval;
 }
 
-bool Connection::read_row(std::string& dest)
+void* Dispatcher::run_worker(void* data)
 {
-    bool rval = true;
+    Worker* w = static_cast<Worker*>(data);
+    uint64_t head = w->head.load(std::memory_order_relaxed);
+    int spins = 0;
 
     while (true)
     {
-        if (!m_buffer.empty())
+        if (head == w->tail.load(std::memory_order_acquire))
         {
-            std::vector<char>::iterator it = std::find(m_buf_ptr, m_buffer.end(), '\n');
-            if (it != m_buffer.end())
+            if (w->stop.load(std::memory_order_acquire) &&
+                head == w->tail.load(std::memory_order_acquire))
             {
-                dest.assign(m_buf_ptr, it);
-                m_buf_ptr = it + 1;
                 break;
             }
-        }
-
-        char buf[READBUF_SIZE + 1];
-        int rc = nointr_read(&buf, sizeof(buf));
-
-        if (rc == -1)
-        {
-            rval = false;
-            char err[ERRBUF_SIZE];
-            m_error = "Failed to read row: ";
-            m_error += strerror_r(errno, err, sizeof(err));
-            break;
-        }
-        else if (rc == 0)
-        {
-            rval = false;
-            m_error = CDC::TIMEOUT;
-            break;
-        }
-
-        if (!m_connected)
-        {
-            // This is here to work around a missing newline in MaxScale error messages
-            buf[rc] = '\0';
 
-            if (is_error(buf))
-            {
-                rval = false;
-                break;
-            }
+            backoff(spins);
+            continue;
         }
 
-        m_buffer.erase(m_buffer.begin(), m_buf_ptr);
-        assert(std::find(m_buffer.begin(), m_buffer.end(), '\n') == m_buffer.end());
-        m_buffer.insert(m_buffer.end(), buf, buf + rc);
-        m_buf_ptr = m_buffer.begin();
-    }
+        spins = 0;
+        Row& row = w->rows[head & w->mask];
+        uint64_t seq = w->seqs[head & w->mask];
+        w->owner->m_handler.process(w->id, row);
+        row.reset();
 
-    if (!m_connected && is_error(dest.c_str()))
-    {
-        rval = false;
+        w->done.store(seq, std::memory_order_release);
+        w->head.store(++head, std::memory_order_release);
     }
 
-    return rval;
+    return NULL;
 }
 
-#define is_poll_error(e) ((e & (POLLERR | POLLHUP | POLLNVAL)))
-
-static std::string event_to_string(int event)
+bool Dispatcher::dispatch()
 {
-    std::string rval;
+    m_error.clear();
+    Row row = m_conn.read();
+    std::string key;
 
-    if (event & POLLIN)
-    {
-        rval += "POLLIN ";
-    }
-    if (event & POLLPRI)
-    {
-        rval += "POLLPRI ";
-    }
-    if (event & POLLOUT)
+    if (!row)
     {
-        rval += "POLLOUT ";
+        m_error = m_conn.error();
+        return false;
     }
-#ifdef POLLRDHUP
-    if (event & POLLRDHUP)
+    else if (!make_row_key(row, m_key, m_key_idx, key, m_error))
     {
-        rval += "POLLRDHUP ";
+        return false;
     }
-#endif
-    if (event & POLLERR)
+
+    Worker* w = m_workers[hash_bytes(key.data(), key.length()) % m_workers.size()];
+
+    if (!w->running)
     {
-        rval += "POLLERR ";
+        m_error = "Worker thread is not running";
+        return false;
     }
-    if (event & POLLHUP)
+
+    std::string gtid = row->gtid();
+
+    if (gtid != m_gtid)
     {
-        rval += "POLLHUP ";
+        if (m_seq > 0)
+        {
+            // The previous transaction ended with the previous row
+            m_trx.push_back(std::make_pair(m_seq, m_gtid));
+        }
+
+        m_gtid = gtid;
     }
-    if (event & POLLNVAL)
+
+    uint64_t tail = w->tail.load(std::memory_order_relaxed);
+    int spins = 0;
+
+    while (tail - w->head.load(std::memory_order_acquire) > w->mask)
     {
-        rval += "POLLNVAL ";
+        // The queue is full
+        backoff(spins);
     }
 
-    return rval;
+    w->rows[tail & w->mask].swap(row);
+    w->seqs[tail & w->mask] = ++m_seq;
+    w->queued = m_seq;
+    w->tail.store(tail + 1, std::memory_order_release);
+
+    return true;
 }
 
-int Connection::wait_for_event(short events)
+void Dispatcher::stop()
 {
-    nfds_t nfds = 1;
-    struct pollfd pfd;
-    pfd.fd = m_fd;
-    pfd.events = events;
-    int rc;
-
-    while ((rc = poll(&pfd, nfds, m_timeout * 1000)) < 0 && errno == EINTR)
+    for (std::vector<Worker*>::iterator it = m_workers.begin(); it != m_workers.end(); it++)
     {
-        ;
+        (*it)->stop.store(true, std::memory_order_release);
     }
 
-    if (rc > 0 && is_poll_error(pfd.revents))
-    {
-        rc = -1;
-        m_error += "Error when waiting event; ";
-        m_error += event_to_string(pfd.revents);
-    }
-    else if (rc < 0)
+    for (std::vector<Worker*>::iterator it = m_workers.begin(); it != m_workers.end(); it++)
     {
-        char err[ERRBUF_SIZE];
-        m_error = "Failed to wait for event: ";
-        m_error += strerror_r(errno, err, sizeof(err));
+        if ((*it)->running)
+        {
+            pthread_join((*it)->thread, NULL);
+            (*it)->running = false;
+        }
     }
-
-    return rc;
 }
 
-int Connection::nointr_read(void *dest, size_t size)
+const std::string& Dispatcher::watermark()
 {
-    int n_bytes = 0;
+    // All rows up to this sequence number have been processed
+    uint64_t processed = m_seq;
 
-    if (wait_for_event(POLLIN) > 0)
+    for (std::vector<Worker*>::iterator it = m_workers.begin(); it != m_workers.end(); it++)
     {
-        int rc = 0;
-
-        while ((rc = ::read(m_fd, dest, size)) < 0 && errno == EINTR)
-        {
-            ;
-        }
+        uint64_t done = (*it)->done.load(std::memory_order_acquire);
 
-        if (rc == -1 && errno != EWOULDBLOCK && errno != EAGAIN)
-        {
-            char err[ERRBUF_SIZE];
-            m_error = "Failed to read data: ";
-            m_error += strerror_r(errno, err, sizeof(err));
-            n_bytes = -1;
-        }
-        else if (rc > 0)
+        if (done != (*it)->queued)
         {
-            n_bytes += rc;
+            // The next unprocessed row of this worker comes after the processed one
+            processed = std::min(processed, done);
         }
     }
 
-    return n_bytes;
-}
-
-int Connection::nointr_write(const void *src, size_t size)
-{
-    int rc = 0;
-    int n_bytes = 0;
-
-    if (wait_for_event(POLLOUT) > 0)
+    while (m_trx_pos < m_trx.size() && m_trx[m_trx_pos].first <= processed)
     {
-        while ((rc = ::write(m_fd, src, size)) < 0 && errno == EINTR)
-        {
-            ;
-        }
+        m_watermark.swap(m_trx[m_trx_pos].second);
+        m_trx_pos++;
+    }
 
-        if (rc < 0 && errno != EWOULDBLOCK && errno != EAGAIN)
-        {
-            char err[ERRBUF_SIZE];
-            m_error = "Failed to write data: ";
-            m_error += strerror_r(errno, err, sizeof(err));
-            n_bytes = -1;
-        }
-        else if (rc > 0)
-        {
-            n_bytes += rc;
-        }
+    if (m_trx_pos > 1024 && m_trx_pos * 2 > m_trx.size())
+    {
+        m_trx.erase(m_trx.begin(), m_trx.begin() + m_trx_pos);
+        m_trx_pos = 0;
     }
 
-    return n_bytes;
+    return m_watermark;
 }
 
 }
@@ -16,13 +16,69 @@
  * MA 02110-1301  USA
  */
 
+#include <cstddef>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 #include <tr1/memory>
+#include <tr1/unordered_map>
 #include <vector>
 #include <map>
 #include <algorithm>
+#include <type_traits>
 #include <jansson.h>
+#include <pthread.h>
+
+// The Arrow C Data Interface, see https://arrow.apache.org/docs/format/CDataInterface.html
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+extern "C"
+{
+
+struct ArrowSchema
+{
+    // Array type description
+    const char* format;
+    const char* name;
+    const char* metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema** children;
+    struct ArrowSchema* dictionary;
+
+    // Release callback
+    void (*release)(struct ArrowSchema*);
+    // Opaque producer-specific data
+    void* private_data;
+};
+
+struct ArrowArray
+{
+    // Array data description
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void** buffers;
+    struct ArrowArray** children;
+    struct ArrowArray* dictionary;
+
+    // Release callback
+    void (*release)(struct ArrowArray*);
+    // Opaque producer-specific data
+    void* private_data;
+};
+
+}
+
+#endif  // ARROW_C_DATA_INTERFACE
 
 namespace CDC
 {
@@ -31,228 +87,2271 @@ namespace CDC
 // check for the most common errors (which right now is only the timeout).
 static const std::string TIMEOUT = "Request timed out";
 
+// Returned by a ReplaySource when the whole recording has been read
+static const std::string END_OF_STREAM = "End of stream";
+
 // The typedef for the Row type
 class InternalRow;
 typedef std::tr1::shared_ptr<InternalRow> Row;
 
+// The typedef for the Transaction type
+class InternalTransaction;
+typedef std::tr1::shared_ptr<InternalTransaction> Transaction;
+
+typedef std::vector<Row> RowList;
+
+class CheckpointStore;
+
 typedef std::vector<std::string> ValueList;
 typedef std::map<std::string, std::string> ValueMap;
 
-// A class that represents a CDC connection
-class Connection
+// The unscaled value of a DECIMAL
+typedef __int128 Int128;
+
+// A histogram of durations with power-of-two nanosecond buckets
+class Histogram
 {
 public:
+    // Bucket i counts durations below 2^i nanoseconds that did not fit in
+    // the previous bucket, the last bucket counts everything longer
+    static const size_t BUCKETS = 40;
+
+    Histogram();
+    ~Histogram();
+
     /**
-     * Create a new CDC connection
+     * Add a duration to the histogram
      *
-     * @param address  The address of the MaxScale server
-     * @param port     The port where the CDC service listens
-     * @param user     Username for the service
-     * @param password Password for the user
-     * @param timeout  Network operation timeout, both for reads and writes
+     * @param ns The duration in nanoseconds
      */
-    Connection(const std::string& address,
-               uint16_t port,
-               const std::string& user,
-               const std::string& password,
-               int timeout = 10);
-    virtual ~Connection();
+    void add(uint64_t ns);
 
     /**
-     * Connect to MaxScale and request a data stream for a table
+     * Get the number of durations in a bucket
      *
-     * @param table The table to stream in `database.table` format
-     * @param gtid The optional starting GTID position in `domain-server_id-sequence` format
+     * @param i The bucket index
      *
-     * @return True if the connection was successfully created and the stream was successfully requested
+     * @return The number of durations in the bucket
      */
-    bool connect(const std::string& table, const std::string& gtid = "");
+    uint64_t bucket(size_t i) const;
 
     /**
-     * Read one change event
+     * Get the number of durations added to the histogram
      *
-     * @return A Row of data or an empty Row on error. The empty row evaluates
-     * to false. If the read timed out, string returned by getError is empty.
-     *
-     * @see InternalRow
+     * @return The number of durations
      */
-    Row read();
+    uint64_t count() const;
 
     /**
-     * Explicitly close the connection
+     * Get the sum of the durations
      *
-     * The connection is closed in the destructor if it is still open when it is called
+     * @return The sum in nanoseconds
      */
-    void close();
+    uint64_t sum() const;
 
     /**
-     * Get the JSON schema in string form
+     * Get an approximate percentile
      *
-     * @return A reference to the string form of theJSON schema
+     * @param p The percentile between 0 and 100
+     *
+     * @return The upper bound of the bucket that contains the percentile in
+     *         nanoseconds or 0 if the histogram is empty
      */
-    const std::string& schema() const
+    uint64_t percentile(double p) const;
+
+private:
+    // The atomic counters, kept out of the header
+    struct Counters;
+    Counters* m_counters;
+
+    // Not intended to be copied
+    Histogram(const Histogram&);
+    Histogram& operator=(const Histogram&);
+};
+
+// Statistics of a Connection
+//
+// The statistics are updated with relaxed atomic operations and can be read
+// from any thread while the connection is being used.
+class Stats
+{
+public:
+    Stats();
+    ~Stats();
+
+    // Bytes received from MaxScale
+    uint64_t bytes() const;
+
+    // Rows built from the stream
+    uint64_t rows() const;
+
+    // Schemas received, the first one included
+    uint64_t schemaChanges() const;
+
+    // Network system calls made: polls, reads and writes
+    uint64_t syscalls() const;
+
+    // Polls that returned with the socket ready
+    uint64_t pollWakeups() const;
+
+    // The largest size the read buffer has had in bytes
+    uint64_t bufferHighWater() const;
+
+    // Time spent parsing the JSON of each row
+    const Histogram& parseTime() const
     {
-        return m_schema;
+        return m_parse_time;
+    }
+
+    // Time spent building each row from the parsed JSON
+    const Histogram& buildTime() const
+    {
+        return m_build_time;
+    }
+
+    // Replication lag of the last delivered row in milliseconds: the time
+    // from the event being written to the binary log until it was delivered
+    int64_t lag() const;
+
+    // Milliseconds from the last delivered row being received until it was
+    // delivered, the part of the lag spent in the connector and the consumer
+    int64_t receiveLag() const;
+
+    // Replication lag of each delivered row. The event timestamps have a
+    // resolution of one second.
+    const Histogram& lagTime() const
+    {
+        return m_lag_time;
     }
 
     /**
-     * Get the latest error
+     * Get the time since the last row was built
      *
-     * @return The latest error or an empty string if no errors have occurred
+     * @return Milliseconds since the last row or -1 if no rows have been built
      */
-    const std::string& error() const
+    int64_t sinceLastRow() const;
+
+private:
+    friend class Connection;
+
+    enum Counter
     {
-        return m_error;
+        BYTES,
+        ROWS,
+        SCHEMA_CHANGES,
+        SYSCALLS,
+        POLL_WAKEUPS,
+        N_COUNTERS
+    };
+
+    enum Gauge
+    {
+        BUFFER_HIGH_WATER,
+        LAST_ROW,
+        LAG,
+        RECEIVE_LAG,
+        N_GAUGES
+    };
+
+    // The atomic counters and gauges, kept out of the header
+    struct Counters;
+    Counters* m_counters;
+    Histogram m_parse_time;
+    Histogram m_build_time;
+    Histogram m_lag_time;
+
+    // Not intended to be copied
+    Stats(const Stats&);
+    Stats& operator=(const Stats&);
+
+    void inc(Counter counter, uint64_t n = 1);
+    void set(Gauge gauge, int64_t value);
+    int64_t get(Gauge gauge) const;
+};
+
+// A column of a Batch
+//
+// The values are stored like in Apache Arrow: fixed-width values in one
+// array, strings as one data buffer with an array of start offsets and the
+// nulls as a validity bitmap with one bit per value, set for non-null values.
+//
+// STRING columns with few distinct values are dictionary encoded: the data
+// and the offsets hold each distinct value once and the rows are stored as
+// codes into them. A column starts out encoded and is converted to plain
+// strings once it has too many distinct values, see
+// Connection::setDictionaryLimit().
+class Column
+{
+public:
+    enum Type
+    {
+        INT64,   // Avro int, long and boolean
+        DOUBLE,  // Avro float and double
+        STRING,  // Everything else
+        DECIMAL, // DECIMAL with a scale in the schema, see scale()
+        DATETIME // DATE, DATETIME and TIMESTAMP sent as strings
+    };
+
+    /**
+     * Get the name of the column
+     *
+     * @return The field name
+     */
+    const std::string& name() const
+    {
+        return m_name;
     }
 
     /**
-     * Get the types of the fields mapped by field name
+     * Get the type of the column
      *
-     * @return A map of field names mapped to the SQL type
+     * @return The type of the values, decided from the Avro type and the SQL
+     *         type of the field
      */
-    ValueMap fields() const
+    Type type() const
     {
-        ValueMap fields;
+        return m_type;
+    }
 
-        for (size_t i = 0; i < m_keys.size(); i++)
-        {
-            fields[m_keys[i]] = m_types[i];
-        }
+    /**
+     * Get the SQL type of the column
+     *
+     * @return The SQL type like InternalRow::type() returns it
+     */
+    const std::string& sqlType() const
+    {
+        return m_sql_type;
+    }
 
-        return fields;
+    /**
+     * Get the number of values
+     *
+     * @return The number of values in the column
+     */
+    size_t length() const
+    {
+        return m_length;
     }
 
-private:
-    int m_fd;
-    uint16_t m_port;
-    std::string m_address;
-    std::string m_user;
-    std::string m_password;
-    std::string m_error;
-    std::string m_schema;
-    ValueList m_keys;
-    ValueList m_types;
-    int m_timeout;
-    std::vector<char> m_buffer;
-    std::vector<char>::iterator m_buf_ptr;
-    Row m_first_row;
-    bool m_connected;
+    /**
+     * Get the number of null values
+     *
+     * @return The number of null values in the column
+     */
+    size_t nullCount() const
+    {
+        return m_null_count;
+    }
 
-    bool do_auth();
-    bool do_registration();
-    bool read_row(std::string& dest);
-    void process_schema(json_t* json);
-    Row process_row(json_t*);
-    bool is_error(const char* str);
+    /**
+     * Check whether a value is null
+     *
+     * @param i The value index
+     *
+     * @return True if the value is null
+     */
+    bool isNull(size_t i) const
+    {
+        return !(m_validity[i / 8] & (1 << (i % 8)));
+    }
 
-    // Lower-level functions
-    int wait_for_event(short events);
-    int nointr_read(void *dest, size_t size);
-    int nointr_write(const void *src, size_t size);
-};
+    /**
+     * Get the precision of a DECIMAL column
+     *
+     * @return The maximum number of digits, 38 if the schema does not say
+     */
+    int precision() const
+    {
+        return m_precision;
+    }
 
-// Internal representation of a row, used via the Row type
-class InternalRow
-{
-public:
+    /**
+     * Get the scale of a DECIMAL column
+     *
+     * @return The number of digits after the decimal point
+     */
+    int scale() const
+    {
+        return m_scale;
+    }
 
     /**
-     * Get field count for the row
+     * Get the values of an INT64 or a DATETIME column
      *
-     * @return Number of fields in row
+     * DATETIME values are microseconds since 1970-01-01 00:00:00, without a
+     * time zone conversion. Values that are not valid dates, zero dates
+     * included, are null.
+     *
+     * @return One value per row, null values are zero
      */
-    size_t length() const
+    const std::vector<int64_t>& ints() const
     {
-        return m_values.size();
+        return m_ints;
     }
 
     /**
-     * Get the value of a field by index
+     * Get the values of a DECIMAL column
      *
-     * @param i The field index
+     * Values that are not numbers or that do not fit the precision are null.
      *
-     * @return A reference to the internal value
+     * @return One value per row scaled by 10^scale(), null values are zero
      */
-    const std::string& value(size_t i) const
+    const std::vector<Int128>& decimals() const
     {
-        return m_values[i];
+        return m_decimals;
     }
 
     /**
-     * Get the value of a field by name
+     * Get the values of a DOUBLE column
      *
-     * @param i The field index to get
+     * @return One value per row, null values are zero
+     */
+    const std::vector<double>& doubles() const
+    {
+        return m_doubles;
+    }
+
+    /**
+     * Check whether a STRING column is dictionary encoded
      *
-     * @return A reference to the internal value
+     * @return True if the values are stored as codes(), false if they are
+     *         stored in data() in row order
      */
-    const std::string& value(const std::string& str) const
+    bool isDictionary() const
     {
-        ValueList::const_iterator it = std::find(m_keys.begin(), m_keys.end(), str);
-        return m_values[it - m_keys.begin()];
+        return m_dictionary;
     }
 
     /**
-     * Get the GTID of this row
+     * Get the dictionary codes of a dictionary encoded column
      *
-     * @return The GTID of the row in `domain-server_id-sequence` format
+     * @return One value per row, the index of the value in the dictionary
+     *         described by offsets() and data(). Null values are zero.
      */
-    const std::string gtid() const
+    const std::vector<int32_t>& codes() const
     {
-        std::string s;
-        s += value("domain");
-        s += "-";
-        s += value("server_id");
-        s +=  "-";
-        s += value("sequence");
-        return s;
+        return m_codes;
     }
 
     /**
-     * Get field names by index
+     * Get the string offsets of a STRING column
      *
-     * @return Reference to field name
+     * @return The start offsets of the values in data(), followed by the
+     *         size of the data. Null values are empty strings. For a
+     *         dictionary encoded column, the offsets of the dictionary values.
      */
-    const std::string& key(size_t i) const
+    const std::vector<int32_t>& offsets() const
     {
-        return m_keys[i];
+        return m_offsets;
     }
 
     /**
-     * Get field types by index
+     * Get the string data of a STRING column
      *
-     * @return Reference to field type
+     * @return The values of the column concatenated, for a dictionary
+     *         encoded column the distinct values
      */
-    const std::string& type(size_t i) const
+    const std::string& data() const
     {
-        return m_types[i];
+        return m_data;
     }
 
-    ~InternalRow()
+    /**
+     * Get a string value of a STRING column
+     *
+     * @param i The value index
+     *
+     * @return A copy of the value
+     */
+    std::string stringValue(size_t i) const
+    {
+        size_t j = m_dictionary ? m_codes[i] : i;
+        return m_data.substr(m_offsets[j], m_offsets[j + 1] - m_offsets[j]);
+    }
+
+    /**
+     * Get the validity bitmap
+     *
+     * @return One bit per value, least significant bit first, set if the
+     *         value is not null
+     */
+    const std::vector<uint8_t>& validity() const
     {
+        return m_validity;
     }
 
 private:
-    ValueList m_keys;
-    ValueList m_types;
-    ValueList m_values;
+    friend class Connection;
 
-    // Not intended to be copied
-    InternalRow(const InternalRow&);
-    InternalRow& operator=(const InternalRow&);
-    InternalRow();
+    std::string          m_name;
+    Type                 m_type;
+    std::string          m_sql_type;
+    int                  m_precision;
+    int                  m_scale;
+    size_t               m_length;
+    size_t               m_null_count;
+    std::vector<int64_t> m_ints;
+    std::vector<double>  m_doubles;
+    std::vector<Int128>  m_decimals;
+    std::vector<int32_t> m_offsets;
+    std::string          m_data;
+    std::vector<uint8_t> m_validity;
+    bool                 m_dictionary;
+    size_t               m_dictionary_limit;
+    std::vector<int32_t> m_codes;
+    std::vector<int32_t> m_slots;   // Hash table of the dictionary, code + 1 or 0 if free
 
-    // Only a Connection should construct an InternalRow
-    friend class Connection;
+    Column(const std::string& name, Type type, const std::string& sql_type,
+           int precision, int scale, size_t dictionary_limit);
+
+    void append(json_t* value);
+    void append(const std::string& value);
+    void append_null();
+    void append_string(const char* str, size_t len);
+    int32_t dictionary_code(const char* str, size_t len);
+    void rehash_dictionary();
+    void decode_dictionary();
+    void set_valid(bool valid);
+};
+
+// A batch of change events stored by column
+class Batch
+{
+public:
+    Batch():
+        m_length(0)
+    {
+    }
+
+    /**
+     * Get the number of rows
+     *
+     * @return The number of rows in the batch
+     */
+    size_t length() const
+    {
+        return m_length;
+    }
 
-    InternalRow(const ValueList& keys,
-                const ValueList& types,
-                ValueList& values):
-        m_keys(keys),
-        m_types(types)
+    /**
+     * Get the number of columns
+     *
+     * @return The number of columns, the event metadata fields included
+     */
+    size_t columns() const
     {
-        m_values.swap(values);
+        return m_columns.size();
+    }
+
+    /**
+     * Get a column by index
+     *
+     * @param i The column index
+     *
+     * @return A reference to the column
+     */
+    const Column& column(size_t i) const
+    {
+        return m_columns[i];
+    }
+
+    /**
+     * Remove all rows and columns
+     */
+    void clear()
+    {
+        m_columns.clear();
+        m_length = 0;
     }
 
+    /**
+     * Export the batch through the Arrow C Data Interface
+     *
+     * The batch is exported as a non-nullable struct array with one child per
+     * column: INT64 columns as int64, DOUBLE columns as float64 and STRING
+     * columns as utf8. Dictionary encoded columns are exported as int32
+     * indices with a utf8 dictionary, DECIMAL columns as decimal128 and
+     * DATETIME columns as timestamps in microseconds. The SQL type of each column is stored in the field
+     * metadata under the key `real_type`. This is the layout Arrow
+     * implementations import as a record batch.
+     *
+     * The column buffers are moved to the exported array without copying and
+     * the batch is empty afterwards. The exported array and schema are owned
+     * by the caller and are freed by calling their release callbacks.
+     *
+     * @param schema Where the schema is exported
+     * @param array  Where the array is exported
+     */
+    void exportArrow(struct ArrowSchema* schema, struct ArrowArray* array);
+
+private:
+    friend class Connection;
+
+    std::vector<Column> m_columns;
+    size_t              m_length;
+};
+
+/**
+ * Parse a DATE, DATETIME or TIMESTAMP value
+ *
+ * @param str  The value as `YYYY-MM-DD` or `YYYY-MM-DD HH:MM:SS` with up to
+ *             six fractional digits
+ * @param len  The length of the value
+ * @param dest Where the value is stored as microseconds since 1970-01-01 00:00:00
+ *
+ * @return True if the value is a valid date, zero dates are not
+ */
+bool parse_datetime(const char* str, size_t len, int64_t& dest);
+
+/**
+ * Parse a DECIMAL value
+ *
+ * Extra fractional digits are rounded half away from zero.
+ *
+ * @param str       The value as an optional sign, digits and an optional fraction
+ * @param len       The length of the value
+ * @param precision The total number of digits, at most 38
+ * @param scale     The number of fractional digits to keep
+ * @param dest      Where the value is stored scaled by 10^scale
+ *
+ * @return True if the value is a number that fits in the precision
+ */
+bool parse_decimal(const char* str, size_t len, int precision, int scale, Int128& dest);
+
+/**
+ * The parsed form of a schema
+ *
+ * Identical schemas are parsed once per process and shared by all the
+ * connections and rows that use them, see Connection::process_schema().
+ */
+struct SchemaInfo
+{
+    SchemaInfo():
+        id(0),
+        event_type(-1),
+        timestamp(-1)
+    {
+    }
+
+    std::string                                  json;       // The schema as it was received
+    uint64_t                                     id;         // Unique for each distinct schema
+    ValueList                                    keys;
+    ValueList                                    types;      // SQL types with the lengths
+    std::vector<Column::Type>                    column_types;
+    std::vector<int>                             precisions; // Of DECIMAL columns
+    std::vector<int>                             scales;     // Of DECIMAL columns
+    std::tr1::unordered_map<std::string, size_t> index;      // Field positions by name
+    int                                          event_type; // Position of `event_type`, -1 if none
+    int                                          timestamp;  // Position of `timestamp`, -1 if none
+};
+
+typedef std::tr1::shared_ptr<const SchemaInfo> SharedSchema;
+
+// The position and time of an event decoded by Decoder::decodeLine()
+struct EventInfo
+{
+    EventInfo():
+        domain(0),
+        server_id(0),
+        sequence(0),
+        timestamp(-1),
+        event_type("")
+    {
+    }
+
+    int64_t     domain;
+    int64_t     server_id;
+    int64_t     sequence;
+    int64_t     timestamp;  // -1 if not known
+    const char* event_type; // Must stay valid until the next event is decoded
+};
+
+/**
+ * Reads the values of a JSON object from its text in a fixed field order
+ *
+ * This is for decoders that know the exact layout of the events of a schema,
+ * see Decoder::decodeLine(). Each function returns false if the text is not
+ * what was expected, including valid JSON that needs the full parser such
+ * as escaped strings. The caller then falls back to the parsed JSON.
+ */
+class Scanner
+{
+public:
+    Scanner(const std::string& line):
+        m_ptr(line.c_str()),
+        m_end(line.c_str() + line.length())
+    {
+    }
+
+    // The opening brace of the object
+    bool start()
+    {
+        skip_space();
+        return m_ptr < m_end && *m_ptr++ == '{';
+    }
+
+    // A key and the colon after it
+    template<size_t N>
+    bool key(const char (&name)[N])
+    {
+        skip_space();
+
+        if (m_end - m_ptr < (ptrdiff_t)N + 1 || *m_ptr != '"' ||
+            memcmp(m_ptr + 1, name, N - 1) != 0 || m_ptr[N] != '"')
+        {
+            return false;
+        }
+
+        m_ptr += N + 1;
+        skip_space();
+        return m_ptr < m_end && *m_ptr++ == ':';
+    }
+
+    // The comma between two values
+    bool next()
+    {
+        skip_space();
+        return m_ptr < m_end && *m_ptr++ == ',';
+    }
+
+    // The closing brace of the object and the end of the text
+    bool end()
+    {
+        skip_space();
+
+        if (m_ptr == m_end || *m_ptr++ != '}')
+        {
+            return false;
+        }
+
+        skip_space();
+        return m_ptr == m_end;
+    }
+
+    // Consumes a null value
+    bool null()
+    {
+        skip_space();
+
+        if (m_end - m_ptr >= 4 && memcmp(m_ptr, "null", 4) == 0)
+        {
+            m_ptr += 4;
+            return true;
+        }
+
+        return false;
+    }
+
+    bool integer(int64_t& dest)
+    {
+        skip_space();
+        const char* p = m_ptr;
+        bool negative = p < m_end && *p == '-';
+        p += negative;
+        const char* digits = p;
+        uint64_t value = 0;
+
+        while (p < m_end && *p >= '0' && *p <= '9' && p - digits < 18)
+        {
+            value = value * 10 + (*p++ - '0');
+        }
+
+        if (p == digits || (p < m_end && ((*p >= '0' && *p <= '9') || *p == '.' || *p == 'e' || *p == 'E')))
+        {
+            // Not an integer or too long to be converted without checking for overflow
+            return false;
+        }
+
+        dest = negative ? -(int64_t)value : (int64_t)value;
+        m_ptr = p;
+        return true;
+    }
+
+    bool number(double& dest)
+    {
+        skip_space();
+
+        if (m_ptr == m_end || (*m_ptr != '-' && (*m_ptr < '0' || *m_ptr > '9')))
+        {
+            return false;
+        }
+
+        // The line is followed by a null terminator so strtod stops at the end
+        char* p;
+        dest = strtod(m_ptr, &p);
+
+        if (p == m_ptr || p > m_end)
+        {
+            return false;
+        }
+
+        m_ptr = p;
+        return true;
+    }
+
+    // A JSON true or false, stored as one or zero like the INT64 columns of Avro booleans
+    bool boolean(int64_t& dest)
+    {
+        skip_space();
+
+        if (m_end - m_ptr >= 4 && memcmp(m_ptr, "true", 4) == 0)
+        {
+            dest = 1;
+            m_ptr += 4;
+            return true;
+        }
+        else if (m_end - m_ptr >= 5 && memcmp(m_ptr, "false", 5) == 0)
+        {
+            dest = 0;
+            m_ptr += 5;
+            return true;
+        }
+
+        return false;
+    }
+
+    bool string(std::string& dest)
+    {
+        skip_space();
+
+        if (m_ptr == m_end || *m_ptr != '"')
+        {
+            return false;
+        }
+
+        const char* start = m_ptr + 1;
+        const char* p = start;
+
+        while (p < m_end && *p != '"' && *p != '\\')
+        {
+            p++;
+        }
+
+        if (p == m_end || *p != '"')
+        {
+            return false;
+        }
+
+        dest.assign(start, p - start);
+        m_ptr = p + 1;
+        return true;
+    }
+
+    // Nullable versions, a null is stored as zero or as an empty string
+    bool integer(int64_t& dest, bool& is_null)
+    {
+        if ((is_null = null()))
+        {
+            dest = 0;
+            return true;
+        }
+
+        return integer(dest);
+    }
+
+    bool number(double& dest, bool& is_null)
+    {
+        if ((is_null = null()))
+        {
+            dest = 0;
+            return true;
+        }
+
+        return number(dest);
+    }
+
+    bool boolean(int64_t& dest, bool& is_null)
+    {
+        if ((is_null = null()))
+        {
+            dest = 0;
+            return true;
+        }
+
+        return boolean(dest);
+    }
+
+    bool string(std::string& dest, bool& is_null)
+    {
+        if ((is_null = null()))
+        {
+            dest.clear();
+            return true;
+        }
+
+        return string(dest);
+    }
+
+private:
+    const char* m_ptr;
+    const char* m_end;
+
+    void skip_space()
+    {
+        while (m_ptr < m_end && (*m_ptr == ' ' || *m_ptr == '\t' || *m_ptr == '\r' || *m_ptr == '\n'))
+        {
+            m_ptr++;
+        }
+    }
+};
+
+// Receives the values of change events straight from the parsed JSON, see Connection::read(Decoder&)
+class Decoder
+{
+public:
+    Decoder():
+        m_schema_id(0)
+    {
+    }
+
+    virtual ~Decoder()
+    {
+    }
+
+    /**
+     * Called before the first event and after each schema change
+     *
+     * Resolve the fields that are decoded to their positions here so that
+     * decode() does not need to look them up by name.
+     *
+     * @param keys  The field names, the event metadata fields included
+     * @param types The SQL types of the fields
+     */
+    virtual void setSchema(const ValueList& keys, const ValueList& types) = 0;
+
+    /**
+     * Decode one value of an event
+     *
+     * Called once for each field of the event in schema order.
+     *
+     * @param field The position of the field in the schema
+     * @param value The value, a JSON null for SQL NULL values
+     */
+    virtual void decode(size_t field, json_t* value) = 0;
+
+    /**
+     * Decode an event from its JSON text
+     *
+     * An optional fast path that is tried before the event is parsed. It is
+     * only called after setSchema() has been called for the current schema.
+     * If this returns false, the event is parsed and given to decode() as
+     * usual, so it may give up at any point, for example with the Scanner
+     * class when the text is not in the expected layout.
+     *
+     * @param line The JSON text of the event, this can also be a schema
+     * @param info Where the position and time of the event are stored
+     *
+     * @return True if the event was decoded
+     */
+    virtual bool decodeLine(const std::string&, EventInfo&)
+    {
+        return false;
+    }
+
+private:
+    friend class Connection;
+
+    uint64_t m_schema_id; // The schema given to setSchema()
+};
+
+/**
+ * Store a JSON value in a variable of the matching C++ type
+ *
+ * Integers and floating point values are converted from JSON numbers and
+ * from numeric strings, strings from any JSON value. Nulls become zero or an
+ * empty string.
+ */
+void decode_value(std::string& dest, json_t* value);
+
+inline void decode_number(double& dest, json_t* value)
+{
+    dest = json_is_number(value) ? json_number_value(value) :
+           json_is_string(value) ? strtod(json_string_value(value), NULL) : 0;
+}
+
+inline void decode_number(json_int_t& dest, json_t* value)
+{
+    dest = json_is_integer(value) ? json_integer_value(value) :
+           json_is_real(value) ? (json_int_t)json_real_value(value) :
+           json_is_true(value) ? 1 :
+           json_is_string(value) ? (strcmp(json_string_value(value), "true") == 0 ? 1 :
+                                    strtoll(json_string_value(value), NULL, 10)) : 0;
+}
+
+template<class T>
+void decode_value(T& dest, json_t* value)
+{
+    typedef typename std::conditional<std::is_floating_point<T>::value, double, json_int_t>::type Wide;
+    Wide wide;
+    decode_number(wide, value);
+    dest = static_cast<T>(wide);
+}
+
+/**
+ * Decodes change events into a struct
+ *
+ * The fields are bound to the members of the struct by name:
+ *
+ *     struct Order
+ *     {
+ *         int64_t     id;
+ *         std::string customer;
+ *         double      total;
+ *     };
+ *
+ *     CDC::Binding<Order> order;
+ *     order.bind("id", &Order::id).bind("customer", &Order::customer).bind("total", &Order::total);
+ *
+ *     while (conn.read(order))
+ *     {
+ *         apply(order.value());
+ *     }
+ *
+ * The names are resolved to schema positions only when the schema changes
+ * and the values are converted with decode_value() for the type of each
+ * member. Members that are not in the schema keep their default value.
+ */
+template<class T>
+class Binding: public Decoder
+{
+public:
+    Binding()
+    {
+    }
+
+    /**
+     * Bind a field to a member
+     *
+     * @param name   The field name
+     * @param member The member the value is stored in
+     *
+     * @return The binding itself so that calls can be chained
+     */
+    template<class M>
+    Binding& bind(const std::string& name, M T::* member)
+    {
+        m_fields.push_back(FieldPtr(new Member<M>(name, member)));
+        return *this;
+    }
+
+    /**
+     * Get the decoded event
+     *
+     * @return The values of the latest event
+     */
+    const T& value() const
+    {
+        return m_value;
+    }
+
+    void setSchema(const ValueList& keys, const ValueList&)
+    {
+        m_value = T();
+        m_positions.assign(keys.size(), NULL);
+
+        for (typename std::vector<FieldPtr>::iterator it = m_fields.begin(); it != m_fields.end(); it++)
+        {
+            ValueList::const_iterator pos = std::find(keys.begin(), keys.end(), (*it)->name);
+
+            if (pos != keys.end())
+            {
+                // A field can be bound to more than one member
+                (*it)->next = m_positions[pos - keys.begin()];
+                m_positions[pos - keys.begin()] = it->get();
+            }
+        }
+    }
+
+    void decode(size_t field, json_t* value)
+    {
+        for (Field* f = field < m_positions.size() ? m_positions[field] : NULL; f; f = f->next)
+        {
+            f->set(m_value, value);
+        }
+    }
+
+private:
+    struct Field
+    {
+        Field(const std::string& name):
+            name(name),
+            next(NULL)
+        {
+        }
+
+        virtual ~Field()
+        {
+        }
+
+        virtual void set(T& dest, json_t* value) = 0;
+
+        std::string name;
+        Field*      next; // The next field bound to the same schema position
+    };
+
+    template<class M>
+    struct Member: public Field
+    {
+        Member(const std::string& name, M T::* member):
+            Field(name),
+            member(member)
+        {
+        }
+
+        void set(T& dest, json_t* value)
+        {
+            decode_value(dest.*member, value);
+        }
+
+        M T::* member;
+    };
+
+    typedef std::tr1::shared_ptr<Field> FieldPtr;
+
+    T                     m_value;
+    std::vector<FieldPtr> m_fields;
+    std::vector<Field*>   m_positions; // The bound fields of each schema position
+
+    // Not intended to be copied
+    Binding(const Binding&);
+    Binding& operator=(const Binding&);
+};
+
+// A class that represents a CDC connection
+class Connection
+{
+public:
+    /**
+     * Create a new CDC connection
+     *
+     * @param address  The address of the MaxScale server
+     * @param port     The port where the CDC service listens
+     * @param user     Username for the service
+     * @param password Password for the user
+     * @param timeout  Network operation timeout, both for reads and writes
+     */
+    Connection(const std::string& address,
+               uint16_t port,
+               const std::string& user,
+               const std::string& password,
+               int timeout = 10);
+    virtual ~Connection();
+
+    /**
+     * Connect to MaxScale and request a data stream for a table
+     *
+     * A previous connection is closed first and the rows that were read from
+     * it but not returned are discarded.
+     *
+     * @param table The table to stream in `database.table` format
+     * @param gtid The optional starting GTID position in `domain-server_id-sequence` format.
+     *             If empty and a checkpoint store is set, the stream resumes from
+     *             the stored checkpoint.
+     *
+     * @return True if the connection was successfully created and the stream was successfully requested
+     */
+    virtual bool connect(const std::string& table, const std::string& gtid = "");
+
+    /**
+     * Read one change event
+     *
+     * @return A Row of data or an empty Row on error. The empty row evaluates
+     * to false. If the read timed out, string returned by getError is empty.
+     *
+     * @see InternalRow
+     */
+    Row read();
+
+    /**
+     * Read one change event into a Decoder
+     *
+     * The values are given to the decoder from the parsed JSON without
+     * building a Row. The schema is given to the decoder before the first
+     * event and after each schema change. Update events are not paired, the
+     * before and after images are read as separate events.
+     *
+     * @param dest The decoder that receives the event
+     *
+     * @return True if an event was read. On false, the error is available
+     * from error() like with read().
+     *
+     * @see Binding
+     */
+    bool read(Decoder& dest);
+
+    /**
+     * Read one complete transaction
+     *
+     * Consecutive change events with the same GTID are grouped into one
+     * transaction. As the stream does not mark the end of a transaction, the
+     * transaction is complete only when an event with a different GTID is
+     * read. That event is kept as the first event of the next transaction.
+     * The events of a transaction that is not complete are kept in the
+     * connection over timeouts and errors, so the latest transaction of an
+     * idle stream is returned only once the next one starts.
+     *
+     * @return A Transaction or an empty Transaction on error. The empty
+     * transaction evaluates to false. If the read timed out before a
+     * transaction was complete, the string returned by getError is
+     * CDC::TIMEOUT.
+     *
+     * @see InternalTransaction
+     */
+    Transaction readTransaction();
+
+    /**
+     * Read a batch of change events
+     *
+     * Waits for the first event like read() and then reads more events only
+     * as long as they can be read without waiting for the network. This
+     * returns the rows that have already arrived with one call without
+     * adding latency when the stream is slow.
+     *
+     * @param dest Where the rows are stored, any previous contents are removed
+     * @param max  The maximum number of rows to read
+     *
+     * @return The number of rows read. If no rows were read, the error is
+     * available from error() like with read(). If an error occurs after the
+     * first row, the rows read before it are returned and error() is set.
+     */
+    size_t readBatch(RowList& dest, size_t max);
+
+    /**
+     * Read a batch of change events into columns
+     *
+     * Reads like readBatch() but stores the values straight from the parsed
+     * JSON into typed columns without building rows. All rows of a batch have
+     * the same schema: a schema change ends the batch and the next batch has
+     * the new columns. Update events are not paired.
+     *
+     * @param dest Where the rows are stored, any previous contents are removed
+     * @param max  The maximum number of rows to read
+     *
+     * @return The number of rows read, errors are reported like with readBatch()
+     */
+    size_t readBatch(Batch& dest, size_t max);
+
+    /**
+     * Read the change events that are available without waiting
+     *
+     * Reads what has arrived from the network and returns the complete rows.
+     * This never blocks and is intended for event loops that wait for the
+     * file descriptor returned by fd() to become readable. As rows can remain
+     * buffered in the connection, call this until it returns no rows before
+     * waiting for the descriptor again.
+     *
+     * @param dest Where the rows are stored, any previous contents are removed
+     * @param max  The maximum number of rows to read
+     *
+     * @return The number of rows read. If no rows were read and error() is
+     * empty, no complete rows were available.
+     */
+    size_t readAvailable(RowList& dest, size_t max);
+
+    /**
+     * Start connecting without blocking
+     *
+     * This is the event loop version of connect(). The socket is created and
+     * the connection is started, after which the handshake is driven by
+     * calling onWritable() when fd() is writable and wantsWrite() returns
+     * true, and onReadable() when fd() is readable. Once the handshake is
+     * done, onReadable() reads the stream into the connection and the rows
+     * are taken with readBuffered(). Resolving the address may block. A spool
+     * is not used with connections started this way. A previous connection is
+     * closed first, like with connect().
+     *
+     * @param table The table to stream in `database.table` format
+     * @param gtid  The optional starting GTID position, see connect()
+     *
+     * @return True if connecting was started
+     */
+    virtual bool connectAsync(const std::string& table, const std::string& gtid = "");
+
+    /**
+     * Check whether the connection needs to write
+     *
+     * @return True if onWritable() should be called when fd() is writable
+     */
+    bool wantsWrite() const
+    {
+        return m_handshake == HANDSHAKE_CONNECTING || !m_pending_write.empty();
+    }
+
+    /**
+     * Continue after fd() has become writable
+     *
+     * Never blocks.
+     *
+     * @return False on error, the error is available from error()
+     */
+    bool onWritable();
+
+    /**
+     * Continue after fd() has become readable
+     *
+     * During the handshake this reads and processes the responses. After it,
+     * the data that has arrived is read into the connection without parsing
+     * it. Never blocks.
+     *
+     * @return False on error, the error is available from error()
+     */
+    bool onReadable();
+
+    /**
+     * Read one change event from the data already in the connection
+     *
+     * Does not read from the network. Call this after onReadable() until it
+     * returns an empty row.
+     *
+     * @return A Row or an empty Row if no complete row is buffered or on
+     *         error. If error() is empty, no complete row was buffered.
+     */
+    Row readBuffered();
+
+    /**
+     * Get the file descriptor of the connection
+     *
+     * The descriptor becomes readable when more data arrives. It must not be
+     * read from or written to. It is not meaningful when a spool is used as
+     * the data is then read by the spool thread.
+     *
+     * @return The file descriptor or -1 if the connection is not open
+     */
+    int fd() const
+    {
+        return m_fd;
+    }
+
+    /**
+     * Enable or disable pairing of update events
+     *
+     * When enabled, an `update_before` event and the `update_after` event that
+     * follows it are returned as one row. The row contains the values of the
+     * after image and its `event_type` is `update`. The before image and the
+     * changed columns can be inspected with InternalRow::before() and
+     * InternalRow::changed(). Pairing is disabled by default.
+     *
+     * If a read times out between the two images, the read returns the
+     * timeout and the before image is kept until its after image arrives.
+     *
+     * @param enable Whether to pair update events
+     */
+    void setUpdatePairing(bool enable)
+    {
+        m_pair_updates = enable;
+    }
+
+    /**
+     * Set the checkpoint store of the connection
+     *
+     * When a row of a new transaction is read, the previous transaction has
+     * been completely read and processed, and its GTID is given to the store.
+     * With readTransaction(), the previous transaction is given to the store
+     * when the next one is requested. Coalescer and Dispatcher read rows
+     * before they are processed, so the checkpoints of a connection used by
+     * them are only accurate up to the rows they have buffered.
+     * The stored GTID is used as the starting position in connect() if no
+     * position is given. This gives at-least-once delivery: after a restart,
+     * the stream resumes at or before the first unprocessed transaction.
+     *
+     * The rows returned by readBatch() and readAvailable() are checkpointed
+     * when the next read starts, only then have all of them been processed.
+     *
+     * The store is flushed when a blocking read times out. If the store fails
+     * to save the checkpoint, read() returns an empty row with the error and
+     * the row is returned by the next read. The batch reads return no rows
+     * with the error and store the checkpoint on the next call.
+     *
+     * @param store The store to use or NULL to disable checkpointing. The
+     *              store must outlive the connection.
+     */
+    void setCheckpointStore(CheckpointStore* store)
+    {
+        m_checkpoint = store;
+    }
+
+    /**
+     * Spool the stream to local disk
+     *
+     * When enabled, a background thread reads the stream from the network as
+     * fast as it arrives and appends it to memory-mapped segment files in the
+     * given directory. The rows are then read from the segments at the pace of
+     * the consumer. A segment is deleted once it has been read and, if a
+     * checkpoint store is set, the checkpoint has been synced after that.
+     *
+     * When the segments use the maximum amount of disk space, no more data is
+     * read from the network until the consumer has freed a segment. At least
+     * two segments are always allowed.
+     *
+     * The spool is only an in-process buffer, not a durable log: the data in
+     * it is lost when the process stops. After a restart the stream resumes
+     * from the checkpoint store or the GTID given to connect() and MaxScale
+     * sends the rows again. For this reason the segment files left in the
+     * directory by an earlier process are deleted, not replayed, when the
+     * spool starts.
+     *
+     * Must be called before connect(). Each connection needs a directory of
+     * its own. The spool is removed when the connection is closed.
+     *
+     * @param directory    The directory where the segment files are created or
+     *                     an empty string to disable spooling
+     * @param segment_size The size of one segment file in bytes
+     * @param max_size     The maximum disk space used by the segment files in
+     *                     bytes or 0 for no limit
+     */
+    void setSpool(const std::string& directory,
+                  size_t segment_size = 64 * 1024 * 1024,
+                  size_t max_size = 0)
+    {
+        m_spool_dir = directory;
+        m_spool_segment_size = segment_size;
+        m_spool_max_size = max_size;
+    }
+
+    /**
+     * Capture the raw stream
+     *
+     * The bytes of the data stream, starting with the response to the data
+     * request, are written to the file descriptor exactly as they were
+     * received from MaxScale. Each received chunk is written with one write
+     * before it is split into rows. A failed write is reported as a read
+     * error.
+     *
+     * @param fd The file descriptor to write to or -1 to disable capturing.
+     *           The descriptor is not closed by the connection.
+     */
+    void setCapture(int fd)
+    {
+        m_capture_fd = fd;
+    }
+
+    /**
+     * Set the dictionary encoding limit of batches
+     *
+     * The STRING columns read by readBatch(Batch&) are dictionary encoded
+     * for as long as they have at most this many distinct values and at most
+     * one distinct value for every two rows. Columns like `event_type` and
+     * enumerations stay encoded, unique values are stored as plain strings
+     * after the first rows. The decision is made separately for each batch.
+     *
+     * @param limit The maximum number of distinct values of an encoded
+     *              column, 0 to disable dictionary encoding. The default
+     *              is 1024.
+     */
+    void setDictionaryLimit(size_t limit)
+    {
+        m_dictionary_limit = limit;
+    }
+
+    /**
+     * Explicitly close the connection
+     *
+     * The connection is closed in the destructor if it is still open when it is called
+     */
+    void close();
+
+    /**
+     * Get the JSON schema in string form
+     *
+     * @return A reference to the string form of theJSON schema
+     */
+    const std::string& schema() const
+    {
+        return m_schema;
+    }
+
+    /**
+     * Get the latest error
+     *
+     * @return The latest error or an empty string if no errors have occurred
+     */
+    const std::string& error() const
+    {
+        return m_error;
+    }
+
+    /**
+     * Get the types of the fields mapped by field name
+     *
+     * @return A map of field names mapped to the SQL type
+     */
+    ValueMap fields() const
+    {
+        ValueMap fields;
+
+        for (size_t i = 0; i < m_schema_info->keys.size(); i++)
+        {
+            fields[m_schema_info->keys[i]] = m_schema_info->types[i];
+        }
+
+        return fields;
+    }
+
+    /**
+     * Get the statistics of the connection
+     *
+     * The statistics accumulate over the lifetime of the connection object
+     * and are not reset by reconnecting.
+     *
+     * @return The statistics, safe to read from other threads
+     */
+    const Stats& stats() const
+    {
+        return m_stats;
+    }
+
+private:
+    int m_fd;
+    uint16_t m_port;
+    std::string m_address;
+    std::string m_user;
+    std::string m_password;
+    std::string m_error;
+    std::string m_schema;
+    SharedSchema m_schema_info;
+    std::vector<json_t*> m_event_values;
+    int m_timeout;
+    std::vector<char> m_buffer;
+    std::vector<char>::iterator m_buf_ptr;
+    Row m_first_row;
+    json_t* m_first_event;              // An event that was read ahead, parsed with the current schema
+    RowList m_trx_rows;                 // The rows of the transaction readTransaction() is reading
+    bool m_connected;
+    bool m_pair_updates;
+    CheckpointStore* m_checkpoint;
+    std::string m_last_gtid;
+    bool m_last_complete;
+    bool m_batch;                       // Whether the rows being read go to a batch
+    std::string m_batch_checkpoint;     // The latest transaction completed in the last batch
+    std::string m_batch_last_gtid;      // The transaction of the last row in the last batch
+    std::string m_spool_dir;
+    size_t m_spool_segment_size;
+    size_t m_spool_max_size;
+
+    struct Spool;
+    Spool* m_spool;
+    int m_capture_fd;
+    size_t m_dictionary_limit;
+    bool m_replay;
+    double m_pace_speed;
+    int64_t m_pace_timestamp;
+    int64_t m_pace_time;
+    int64_t m_receive_time;
+    bool m_nowait;
+    bool m_no_io;
+    Stats m_stats;
+
+    enum Handshake
+    {
+        HANDSHAKE_NONE,         // Not started or done
+        HANDSHAKE_CONNECTING,   // Waiting for the socket to connect
+        HANDSHAKE_AUTH,         // Waiting for the authentication response
+        HANDSHAKE_REGISTER      // Waiting for the registration response
+    };
+
+    Handshake m_handshake;
+    std::string m_request;
+    std::string m_response;
+    std::string m_pending_write;
+
+    bool do_auth();
+    bool do_registration();
+    std::string make_request(const std::string& table, const std::string& gtid);
+    bool read_response();
+    void reset_stream();
+    bool flush_pending();
+    void buffer_data(const char* data, size_t size);
+    bool read_row(std::string& dest);
+    void process_schema(json_t* json);
+    Row process_row(json_t*);
+    json_t* read_json(int64_t& start, int64_t& parsed);
+    Row read_event();
+    Row next_event();
+    Row next_row();
+    Row pair_update(Row before);
+    bool append_event(Batch& dest, json_t* js, int64_t& timestamp);
+    bool decode_event(Decoder& dest, json_t* js, int64_t& timestamp);
+    void finish_event(json_t* js, const EventInfo& info, int64_t start, int64_t parsed);
+    void pace(int64_t timestamp);
+    void measure_lag(int64_t timestamp, int64_t receive_time);
+    bool update_checkpoint(const std::string& gtid);
+    void defer_checkpoint(const std::string& gtid);
+    bool commit_batch();
+    bool is_error(const char* str);
+
+    friend class Coalescer;
+    friend class ReplaySource;
+
+    // Lower-level functions
+    bool start_spool();
+    void stop_spool();
+    static void* spool_writer(void* data);
+    int read_data(void *dest, size_t size);
+    int read_stream(void *dest, size_t size);
+    bool write_capture(const void *src, size_t size);
+    int wait_for_event(short events);
+    int nointr_read(void *dest, size_t size);
+    int nointr_write(const void *src, size_t size);
+};
+
+// Internal representation of a row, used via the Row type
+class InternalRow
+{
+public:
+
+    /**
+     * Get field count for the row
+     *
+     * @return Number of fields in row
+     */
+    size_t length() const
+    {
+        return m_values.size();
+    }
+
+    /**
+     * Get the value of a field by index
+     *
+     * @param i The field index
+     *
+     * @return A reference to the internal value
+     */
+    const std::string& value(size_t i) const
+    {
+        return m_values[i];
+    }
+
+    /**
+     * Get the value of a field by name
+     *
+     * @param i The field index to get
+     *
+     * @return A reference to the internal value
+     */
+    const std::string& value(const std::string& str) const
+    {
+        std::tr1::unordered_map<std::string, size_t>::const_iterator it = m_schema->index.find(str);
+        return m_values[it != m_schema->index.end() ? it->second : m_values.size()];
+    }
+
+    /**
+     * Get the GTID of this row
+     *
+     * @return The GTID of the row in `domain-server_id-sequence` format
+     */
+    const std::string gtid() const
+    {
+        std::string s;
+        s += value("domain");
+        s += "-";
+        s += value("server_id");
+        s +=  "-";
+        s += value("sequence");
+        return s;
+    }
+
+    /**
+     * Get field names by index
+     *
+     * @return Reference to field name
+     */
+    const std::string& key(size_t i) const
+    {
+        return m_schema->keys[i];
+    }
+
+    /**
+     * Get field types by index
+     *
+     * @return Reference to field type
+     */
+    const std::string& type(size_t i) const
+    {
+        return m_schema->types[i];
+    }
+
+    /**
+     * Check whether this row is a paired update
+     *
+     * @return True if the row combines an `update_before` and an `update_after` event
+     *
+     * @see Connection::setUpdatePairing
+     */
+    bool paired() const
+    {
+        return !m_before.empty();
+    }
+
+    /**
+     * Get the value of a field before the update
+     *
+     * Only valid for paired updates.
+     *
+     * @param i The field index
+     *
+     * @return A reference to the value in the before image
+     */
+    const std::string& before(size_t i) const
+    {
+        return m_before[i];
+    }
+
+    /**
+     * Check whether an update modified a field
+     *
+     * Only valid for paired updates. The event metadata fields (`domain`,
+     * `server_id`, `sequence`, `event_number`, `timestamp` and `event_type`)
+     * are never reported as changed.
+     *
+     * @param i The field index
+     *
+     * @return True if the before and after values of the field differ
+     */
+    bool changed(size_t i) const
+    {
+        return m_changed[i];
+    }
+
+    /**
+     * Get the changed field bitmap of a paired update
+     *
+     * @return A bitmap with one entry per field, set for fields that changed
+     */
+    const std::vector<bool>& changed() const
+    {
+        return m_changed;
+    }
+
+    /**
+     * Get the time when the event was written to the binary log
+     *
+     * @return The `timestamp` field as seconds since the epoch or -1 if the
+     *         row has no timestamp
+     */
+    int64_t timestamp() const
+    {
+        return m_timestamp;
+    }
+
+    /**
+     * Get the time when the row was received
+     *
+     * This is when the last byte of the row was read from the network or,
+     * if the connection uses a spool, from the spool.
+     *
+     * @return The receive time as milliseconds since the epoch
+     */
+    int64_t receiveTime() const
+    {
+        return m_receive_time;
+    }
+
+    ~InternalRow()
+    {
+    }
+
+private:
+    SharedSchema m_schema;
+    ValueList m_values;
+    ValueList m_before;
+    std::vector<bool> m_changed;
+    int64_t m_timestamp;
+    int64_t m_receive_time;
+
+    // Not intended to be copied
+    InternalRow(const InternalRow&);
+    InternalRow& operator=(const InternalRow&);
+    InternalRow();
+
+    // Only a Connection should construct an InternalRow
+    friend class Connection;
+
+    // Modifies the event type of coalesced changes
+    friend class Coalescer;
+
+    InternalRow(const SharedSchema& schema,
+                ValueList& values,
+                int64_t timestamp,
+                int64_t receive_time):
+        m_schema(schema),
+        m_timestamp(timestamp),
+        m_receive_time(receive_time)
+    {
+        m_values.swap(values);
+    }
+
+};
+
+// Internal representation of a transaction, used via the Transaction type
+class InternalTransaction
+{
+public:
+
+    /**
+     * Get row count for the transaction
+     *
+     * @return Number of rows in the transaction
+     */
+    size_t length() const
+    {
+        return m_rows.size();
+    }
+
+    /**
+     * Get a row by index
+     *
+     * @param i The row index
+     *
+     * @return A reference to the row
+     */
+    const Row& row(size_t i) const
+    {
+        return m_rows[i];
+    }
+
+    /**
+     * Get all rows of the transaction
+     *
+     * @return The rows in the order they were read
+     */
+    const RowList& rows() const
+    {
+        return m_rows;
+    }
+
+    /**
+     * Get the GTID of this transaction
+     *
+     * @return The GTID of the transaction in `domain-server_id-sequence` format
+     */
+    const std::string& gtid() const
+    {
+        return m_gtid;
+    }
+
+    ~InternalTransaction()
+    {
+    }
+
+private:
+    std::string m_gtid;
+    RowList m_rows;
+
+    // Not intended to be copied
+    InternalTransaction(const InternalTransaction&);
+    InternalTransaction& operator=(const InternalTransaction&);
+    InternalTransaction();
+
+    // Only a Connection should construct an InternalTransaction
+    friend class Connection;
+
+    InternalTransaction(const std::string& gtid, RowList& rows):
+        m_gtid(gtid)
+    {
+        m_rows.swap(rows);
+    }
+};
+
+// A Connection that reads a recorded stream from a file
+class ReplaySource : public Connection
+{
+public:
+    enum Timing
+    {
+        FAST,       // Return rows as fast as they can be read
+        ORIGINAL    // Return rows at the pace they were originally generated
+    };
+
+    /**
+     * Create a new replay source
+     *
+     * The file must contain a stream in the format sent by MaxScale: a JSON
+     * schema followed by JSON rows, one per line. Such a file can be recorded
+     * with Connection::setCapture(). The rows are processed exactly like the
+     * rows read from the network, and all of the Connection functionality is
+     * available for them.
+     *
+     * With ORIGINAL timing, the rows are delayed based on their `timestamp`
+     * field, relative to the first row. The timestamps have a resolution of
+     * one second.
+     *
+     * @param path   The file to read
+     * @param timing The pace at which rows are returned
+     * @param speed  With ORIGINAL timing, the speed of the replay relative to
+     *               the original pace
+     */
+    ReplaySource(const std::string& path, Timing timing = FAST, double speed = 1.0);
+    ~ReplaySource();
+
+    /**
+     * Open the recording
+     *
+     * This takes the place of Connection::connect(). When the whole recording
+     * has been read, the read functions return an empty result and the error
+     * is CDC::END_OF_STREAM.
+     *
+     * @return True if the file was opened and the first row was read
+     */
+    bool open();
+
+    /**
+     * Open the recording
+     *
+     * Overrides Connection::connect() so that a replay never connects to a
+     * server, also when it is used through a Connection reference. The table
+     * and the GTID are ignored, the recording decides the rows that are
+     * returned.
+     *
+     * @return True if the file was opened and the first row was read
+     */
+    bool connect(const std::string&, const std::string& = "")
+    {
+        return open();
+    }
+
+    /**
+     * A replay has no server to connect to asynchronously
+     *
+     * @return Always false, use connect() or open() instead
+     */
+    bool connectAsync(const std::string&, const std::string& = "");
+
+private:
+    std::string m_path;
+    Timing      m_timing;
+    double      m_speed;
+};
+
+// A durable store for the latest processed GTID
+class CheckpointStore
+{
+public:
+    /**
+     * Create a new checkpoint store
+     *
+     * The stored GTID is read from the file if it exists. Updates are written
+     * in groups: an update syncs the file if the previous sync was at least
+     * the interval ago or if the number of unsynced updates reaches the limit.
+     * An update that arrives sooner stays pending until a later update or
+     * flush() syncs it. The file is replaced atomically by writing a temporary
+     * file, syncing it and renaming it over the old one.
+     *
+     * @param path        The file where the checkpoint is stored
+     * @param interval    Time in milliseconds since the previous sync after
+     *                    which an update is synced immediately
+     * @param max_pending Maximum number of updates between syncs
+     */
+    CheckpointStore(const std::string& path, int interval = 1000, size_t max_pending = 1000);
+
+    /**
+     * Flushes the pending update
+     */
+    ~CheckpointStore();
+
+    /**
+     * Update the checkpoint
+     *
+     * @param gtid The GTID in `domain-server_id-sequence` format
+     *
+     * @return True if the update was accepted. False if the checkpoint had to
+     *         be synced and the sync failed.
+     */
+    bool update(const std::string& gtid);
+
+    /**
+     * Sync the latest update to disk
+     *
+     * @return True if the checkpoint was synced or there was nothing to sync
+     */
+    bool flush();
+
+    /**
+     * Get the latest checkpoint
+     *
+     * @return The latest GTID given to update() or read from the file, or an
+     *         empty string if no checkpoint exists
+     */
+    const std::string& gtid() const
+    {
+        return m_gtid;
+    }
+
+    /**
+     * Get the number of completed syncs
+     *
+     * @return The number of times the checkpoint has been synced to disk
+     */
+    uint64_t syncs() const
+    {
+        return m_syncs;
+    }
+
+    /**
+     * Get the latest error
+     *
+     * @return The latest error or an empty string if no errors have occurred
+     */
+    const std::string& error() const
+    {
+        return m_error;
+    }
+
+private:
+    std::string m_path;
+    int         m_interval;
+    size_t      m_max_pending;
+    std::string m_gtid;
+    size_t      m_pending;
+    int64_t     m_last_sync;
+    uint64_t    m_syncs;
+    std::string m_error;
+
+    // Not intended to be copied
+    CheckpointStore(const CheckpointStore&);
+    CheckpointStore& operator=(const CheckpointStore&);
+};
+
+// A class that coalesces the changes read from a Connection by key
+class Coalescer
+{
+public:
+    /**
+     * Create a new coalescing reader
+     *
+     * The changes are read from the connection in windows. Within a window only
+     * the net change for each key is kept: an insert followed by a delete
+     * cancels out, consecutive updates collapse into the last one, an insert
+     * followed by updates becomes an insert of the final values and a delete
+     * followed by an insert becomes an update. The net changes are returned in
+     * the order of the last event that contributed to them, which is the GTID
+     * order of the stream.
+     *
+     * Without update pairing the `update_before` events are discarded. With
+     * update pairing the coalesced update has the before image of the first
+     * update in the chain.
+     *
+     * @param conn     The connection to read the changes from
+     * @param key      The names of the columns that form the key of the row
+     * @param max_rows The maximum number of events in one window
+     * @param max_time The maximum length of one window in milliseconds. The
+     *                 window can be longer by up to the connection timeout if
+     *                 no events arrive.
+     */
+    Coalescer(Connection& conn,
+              const ValueList& key,
+              size_t max_rows = 1000,
+              int max_time = 1000);
+
+    ~Coalescer()
+    {
+    }
+
+    /**
+     * Read one net change
+     *
+     * @return A Row of data or an empty Row on error. The empty row evaluates
+     * to false. If no net changes remain when the connection times out, the
+     * string returned by getError is CDC::TIMEOUT.
+     */
+    Row read();
+
+    /**
+     * Get the latest error
+     *
+     * @return The latest error or an empty string if no errors have occurred
+     */
+    const std::string& error() const
+    {
+        return m_error;
+    }
+
+private:
+    enum Op
+    {
+        OP_INSERT,
+        OP_UPDATE,
+        OP_DELETE
+    };
+
+    struct Change
+    {
+        Row      row;
+        Row      first;     // The first row in an update chain
+        Op       op;
+        uint64_t seq;
+    };
+
+    typedef std::tr1::unordered_map<std::string, Change> ChangeMap;
+
+    Connection&         m_conn;
+    ValueList           m_key;
+    std::vector<size_t> m_key_idx;
+    size_t              m_max_rows;
+    int                 m_max_time;
+    ChangeMap           m_changes;
+    RowList             m_output;
+    size_t              m_output_pos;
+    uint64_t            m_seq;
+    std::string         m_error;
+    std::string         m_pending_error;
+
+    // Not intended to be copied
+    Coalescer(const Coalescer&);
+    Coalescer& operator=(const Coalescer&);
+
+    void fill();
+    bool make_key(const Row& row, std::string& dest);
+    void add_change(const Row& row);
+    Row finish_change(Change& change);
+    static bool change_order(const Change* a, const Change* b);
+};
+
+// An in-memory copy of a table, kept up to date from a Connection
+class MaterializedTable
+{
+public:
+    /**
+     * Create a new materialized table
+     *
+     * The rows are stored in shards, each protected by a read-write lock. This
+     * allows lookups from other threads while the changes are applied. Only the
+     * table columns are stored, the event metadata fields are not.
+     *
+     * @param conn   The connection to read the changes from
+     * @param key    The names of the columns that form the key of the row
+     * @param shards The number of shards the rows are divided into
+     */
+    MaterializedTable(Connection& conn, const ValueList& key, size_t shards = 16);
+    ~MaterializedTable();
+
+    /**
+     * Read one transaction and apply it to the table
+     *
+     * The changes of a transaction become visible atomically: a lookup sees
+     * either none or all of them. If a transaction that was read cannot be
+     * applied, for example because the key columns are missing from it, the
+     * table no longer matches the stream and all further calls fail with the
+     * same error.
+     *
+     * @return True if a transaction was applied. On error or on timeout false
+     *         is returned and the error is available via getError.
+     */
+    bool ingest();
+
+    /**
+     * Look up the current values of a row
+     *
+     * @param key  The values of the key columns
+     * @param dest Where the values of the row are stored, in columns() order
+     *
+     * @return True if the row was found
+     */
+    bool lookup(const ValueList& key, ValueList& dest) const;
+
+    /**
+     * Look up multiple rows from a consistent snapshot
+     *
+     * All the rows are read from the same point in the stream. No transaction
+     * is applied partially to the returned rows.
+     *
+     * @param keys The values of the key columns for each row
+     * @param dest Where the values of the rows are stored. Rows that are not
+     *             found are empty.
+     * @param gtid If not NULL, the GTID of the latest transaction applied to
+     *             the returned rows is stored here
+     *
+     * @return Number of rows found
+     */
+    size_t lookup(const std::vector<ValueList>& keys,
+                  std::vector<ValueList>& dest,
+                  std::string* gtid = NULL) const;
+
+    /**
+     * Get the number of rows in the table
+     *
+     * @return Number of rows
+     */
+    size_t size() const;
+
+    /**
+     * Get the names of the stored columns
+     *
+     * @return The column names in the order the values are returned
+     */
+    ValueList columns() const;
+
+    /**
+     * Get the GTID of the latest applied transaction
+     *
+     * @return The GTID in `domain-server_id-sequence` format or an empty string
+     */
+    std::string gtid() const;
+
+    /**
+     * Get the latest error
+     *
+     * @return The latest error or an empty string if no errors have occurred
+     */
+    const std::string& error() const
+    {
+        return m_error;
+    }
+
+private:
+    typedef std::tr1::unordered_map<std::string, std::string> RowMap;
+
+    struct Shard
+    {
+        mutable pthread_rwlock_t lock;
+        RowMap                   rows;
+        uint64_t                 trx;   // Number of the latest applied transaction
+        std::string              gtid;  // GTID of the latest applied transaction
+    };
+
+    struct Change
+    {
+        size_t      shard;
+        std::string key;
+        std::string row;    // Packed row, empty for deletions
+        bool        remove;
+    };
+
+    Connection&         m_conn;
+    ValueList           m_key;
+    Shard*              m_shards;
+    size_t              m_n_shards;
+    ValueList           m_row_keys;  // The field names of the change events
+    ValueList           m_columns;   // The names of the stored columns
+    std::vector<size_t> m_key_idx;
+    std::vector<size_t> m_data_idx;
+    uint64_t            m_trx;
+    std::string         m_gtid;
+    mutable pthread_mutex_t m_gtid_lock;
+    std::string         m_error;
+    std::string         m_fatal_error; // Set when a transaction could not be applied
+
+    // Not intended to be copied
+    MaterializedTable(const MaterializedTable&);
+    MaterializedTable& operator=(const MaterializedTable&);
+
+    bool same_layout(const Row& row) const;
+    bool change_layout(const Row& row, std::vector<Change>& pending);
+    void apply(std::vector<Change>& changes, const std::string& gtid);
+    size_t shard_of(const std::string& key) const;
+    static std::string make_key(const ValueList& key);
+    static void pack(const Row& row, const std::vector<size_t>& idx, std::string& dest);
+    static void unpack(const std::string& src, ValueList& dest);
+    static void repack(std::string& row, const std::vector<int>& mapping);
+};
+
+// The interface for processing the rows given out by a Dispatcher
+class RowHandler
+{
+public:
+    virtual ~RowHandler()
+    {
+    }
+
+    /**
+     * Process one row
+     *
+     * Called concurrently from all worker threads of the Dispatcher. The rows
+     * that have the same key are always given to the same worker in the order
+     * they were read.
+     *
+     * @param worker The index of the worker thread calling the function
+     * @param row    The row to process
+     */
+    virtual void process(size_t worker, const Row& row) = 0;
+};
+
+// A class that distributes the rows read from a Connection to worker threads
+class Dispatcher
+{
+public:
+    /**
+     * Create a new dispatcher and start the worker threads
+     *
+     * Each row is given to a worker based on a hash of its key. Each worker
+     * has a bounded lock-free queue: when a queue is full, dispatch() waits
+     * until the worker has made space in it.
+     *
+     * @param conn       The connection to read the rows from
+     * @param key        The names of the columns that form the key of the row
+     * @param handler    The handler that processes the rows
+     * @param workers    Number of worker threads
+     * @param queue_size Size of the queue of each worker, rounded up to a power of two
+     */
+    Dispatcher(Connection& conn,
+               const ValueList& key,
+               RowHandler& handler,
+               size_t workers = 4,
+               size_t queue_size = 1024);
+
+    /**
+     * Stops the workers after they have processed all queued rows
+     */
+    ~Dispatcher();
+
+    /**
+     * Read one row and queue it for processing
+     *
+     * @return True if a row was queued. On error or on timeout false is
+     *         returned and the error is available via getError.
+     */
+    bool dispatch();
+
+    /**
+     * Wait until all queued rows are processed and stop the workers
+     */
+    void stop();
+
+    /**
+     * Get the latest transaction that all workers have completely processed
+     *
+     * Resuming the stream from this GTID never skips a row. As the end of a
+     * transaction is only known when the next one starts, the latest read
+     * transaction is not reported until a row of the next transaction has been
+     * read.
+     *
+     * This must be called from the same thread that calls dispatch().
+     *
+     * @return The GTID in `domain-server_id-sequence` format or an empty
+     *         string if no transaction has been completely processed
+     */
+    const std::string& watermark();
+
+    /**
+     * Get the latest error
+     *
+     * @return The latest error or an empty string if no errors have occurred
+     */
+    const std::string& error() const
+    {
+        return m_error;
+    }
+
+private:
+    struct Worker;
+    typedef std::vector<std::pair<uint64_t, std::string> > TrxList;
+
+    Connection&          m_conn;
+    ValueList            m_key;
+    std::vector<size_t>  m_key_idx;
+    RowHandler&          m_handler;
+    std::vector<Worker*> m_workers;
+    uint64_t             m_seq;         // Sequence number of the latest dispatched row
+    std::string          m_gtid;        // GTID of the latest dispatched row
+    TrxList              m_trx;         // Last sequence number and GTID of read transactions
+    size_t               m_trx_pos;     // First transaction in m_trx not yet processed
+    std::string          m_watermark;
+    std::string          m_error;
+
+    // Not intended to be copied
+    Dispatcher(const Dispatcher&);
+    Dispatcher& operator=(const Dispatcher&);
+
+    static void* run_worker(void* data);
 };
 
 }
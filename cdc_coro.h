@@ -0,0 +1,771 @@
+/* Copyright (c) 2017, MariaDB Corporation. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301  USA
+ */
+
+/**
+ * C++20 coroutine interface for the CDC connector
+ *
+ * This header is optional and is only usable from code compiled as C++20, the
+ * library itself does not depend on it. A Stream wraps a Connection and
+ * suspends the calling coroutine until the socket is ready instead of
+ * blocking in poll(). The coroutines are run by an Executor that waits for
+ * all streams with one epoll instance and resumes them on a small pool of
+ * threads:
+ *
+ *     CDC::coro::Task<void> follow(CDC::coro::Executor& exec, std::string table)
+ *     {
+ *         CDC::Connection conn("127.0.0.1", 4001, "user", "pass");
+ *         CDC::coro::Stream stream(exec, conn);
+ *         CDC::RowList rows;
+ *
+ *         if (stream.connect(table))
+ *         {
+ *             while (co_await stream.nextBatch(rows))
+ *             {
+ *                 // process rows
+ *             }
+ *         }
+ *     }
+ *
+ *     CDC::coro::Executor exec(4);
+ *     exec.spawn(follow(exec, "test.t1"));
+ *     exec.wait();
+ *
+ * A coroutine only runs on one thread at a time but it can be resumed on a
+ * different thread after each suspension.
+ */
+
+#if __cplusplus < 202002L
+#error "cdc_coro.h requires C++20"
+#endif
+
+#include "cdc_connector.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <errno.h>
+#include <exception>
+#include <mutex>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace CDC
+{
+
+namespace coro
+{
+
+template<class T> class Task;
+
+namespace detail
+{
+
+// Resumes the awaiting coroutine once a Task completes
+struct FinalAwaiter
+{
+    bool await_ready() noexcept
+    {
+        return false;
+    }
+
+    template<class P>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept
+    {
+        std::coroutine_handle<> next = handle.promise().m_continuation;
+        return next ? next : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept
+    {
+    }
+};
+
+struct PromiseBase
+{
+    std::coroutine_handle<> m_continuation;
+
+    std::suspend_always initial_suspend() noexcept
+    {
+        return {};
+    }
+
+    FinalAwaiter final_suspend() noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception()
+    {
+        // The connector does not use exceptions
+        std::terminate();
+    }
+};
+
+template<class T>
+struct Promise: public PromiseBase
+{
+    T m_value;
+
+    Task<T> get_return_object();
+
+    void return_value(T value)
+    {
+        m_value = std::move(value);
+    }
+
+    T result()
+    {
+        return std::move(m_value);
+    }
+};
+
+template<>
+struct Promise<void>: public PromiseBase
+{
+    Task<void> get_return_object();
+
+    void return_void()
+    {
+    }
+
+    void result()
+    {
+    }
+};
+
+}
+
+/**
+ * A lazily started coroutine
+ *
+ * The coroutine starts when the Task is awaited or when it is given to
+ * Executor::spawn(). Awaiting a Task returns the value of its co_return.
+ */
+template<class T>
+class Task
+{
+public:
+    typedef detail::Promise<T> promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    explicit Task(Handle handle = Handle()):
+        m_handle(handle)
+    {
+    }
+
+    Task(Task&& other) noexcept:
+        m_handle(std::exchange(other.m_handle, Handle()))
+    {
+    }
+
+    Task& operator=(Task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (m_handle)
+            {
+                m_handle.destroy();
+            }
+
+            m_handle = std::exchange(other.m_handle, Handle());
+        }
+
+        return *this;
+    }
+
+    ~Task()
+    {
+        if (m_handle)
+        {
+            m_handle.destroy();
+        }
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        m_handle.promise().m_continuation = awaiting;
+        return m_handle;
+    }
+
+    T await_resume()
+    {
+        return m_handle.promise().result();
+    }
+
+private:
+    Handle m_handle;
+
+    // Not intended to be copied
+    Task(const Task&);
+    Task& operator=(const Task&);
+};
+
+namespace detail
+{
+
+template<class T>
+Task<T> Promise<T>::get_return_object()
+{
+    return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> Promise<void>::get_return_object()
+{
+    return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+// A coroutine that nobody awaits, it frees itself when it completes
+struct Detached
+{
+    struct promise_type
+    {
+        Detached get_return_object() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void()
+        {
+        }
+
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+};
+
+}
+
+/**
+ * Runs coroutines on a pool of threads
+ *
+ * All threads wait on one epoll instance. A coroutine that waits for a file
+ * descriptor is registered with the descriptor as a one-shot event and the
+ * thread that receives the event resumes it, so the cost of an idle stream
+ * is its coroutine frame and an epoll registration.
+ */
+class Executor
+{
+public:
+
+    /**
+     * Create an executor and start its threads
+     *
+     * @param threads The number of threads that run the coroutines
+     */
+    explicit Executor(size_t threads = 1):
+        m_epoll(epoll_create1(EPOLL_CLOEXEC)),
+        m_event(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+        m_stop(false),
+        m_handoff(0),
+        m_tasks(0)
+    {
+        if (m_epoll == -1 || m_event == -1)
+        {
+            set_error("Failed to create executor: ", errno);
+            return;
+        }
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+
+        if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_event, &ev) == -1)
+        {
+            set_error("Failed to create executor: ", errno);
+            return;
+        }
+
+        for (size_t i = 0; i < threads; i++)
+        {
+            m_threads.emplace_back(&Executor::run, this);
+        }
+    }
+
+    /**
+     * Stop the threads
+     *
+     * Call wait() first, coroutines that have not completed are not resumed
+     * and their frames are not freed.
+     */
+    ~Executor()
+    {
+        m_stop = true;
+        wakeup();
+
+        for (std::thread& t : m_threads)
+        {
+            t.join();
+        }
+
+        if (m_event != -1)
+        {
+            ::close(m_event);
+        }
+
+        if (m_epoll != -1)
+        {
+            ::close(m_epoll);
+        }
+    }
+
+    /**
+     * Start running a coroutine on the executor
+     *
+     * Can be called from any thread, including from coroutines run by this
+     * executor.
+     *
+     * @param task The coroutine to run
+     */
+    void spawn(Task<void> task)
+    {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_tasks++;
+        }
+
+        run_detached(this, std::move(task));
+    }
+
+    /**
+     * Wait until all spawned coroutines have completed
+     */
+    void wait()
+    {
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_done.wait(guard, [this]()
+        {
+            return m_tasks == 0;
+        });
+    }
+
+    /**
+     * Get the latest error
+     *
+     * @return The latest error or an empty string if the executor was created
+     */
+    const std::string& error() const
+    {
+        return m_error;
+    }
+
+    // Suspends until a file descriptor is ready
+    class Ready
+    {
+    public:
+        Ready(Executor* exec, int fd, uint32_t events):
+            m_exec(exec),
+            m_fd(fd),
+            m_events(events),
+            m_errno(0)
+        {
+        }
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> handle) noexcept
+        {
+            // The coroutine can be resumed by another thread as soon as the
+            // descriptor is armed so the awaiter is not touched after that
+            int epfd = m_exec->m_epoll;
+            int fd = m_fd;
+            struct epoll_event ev = {};
+            ev.events = m_events | EPOLLONESHOT;
+            ev.data.ptr = handle.address();
+            m_exec->m_handoff.fetch_add(1, std::memory_order_acq_rel);
+
+            if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0 ||
+                (errno == ENOENT && epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0))
+            {
+                return true;
+            }
+
+            m_errno = errno;
+            return false;
+        }
+
+        /**
+         * @return 0 if the descriptor is ready, otherwise the errno of the
+         *         failed registration
+         */
+        int await_resume() const noexcept
+        {
+            return m_errno;
+        }
+
+    private:
+        Executor* m_exec;
+        int       m_fd;
+        uint32_t  m_events;
+        int       m_errno;
+    };
+
+    /**
+     * Wait for a file descriptor to become ready
+     *
+     * @param fd     The file descriptor
+     * @param events EPOLLIN, EPOLLOUT or both
+     *
+     * @return An awaitable that returns 0 once the descriptor is ready or the
+     *         errno if waiting failed
+     */
+    Ready ready(int fd, uint32_t events)
+    {
+        return Ready(this, fd, events);
+    }
+
+    /**
+     * Stop waiting for a file descriptor
+     *
+     * Must be called before a descriptor that has been waited for is closed
+     * or reused. No coroutine may be waiting for it.
+     *
+     * @param fd The file descriptor
+     */
+    void forget(int fd)
+    {
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, fd, NULL);
+    }
+
+private:
+    int                                 m_epoll;
+    int                                 m_event;    // Wakes up a thread to run m_ready
+    std::atomic<bool>                   m_stop;
+    std::atomic<uint64_t>               m_handoff;  // Orders a coroutine before and after it moves
+                                                    // between threads through epoll
+    std::mutex                          m_lock;
+    std::condition_variable             m_done;
+    std::deque<std::coroutine_handle<>> m_ready;    // Coroutines waiting for a thread
+    size_t                              m_tasks;    // Spawned coroutines that have not completed
+    std::vector<std::thread>            m_threads;
+    std::string                         m_error;
+
+    // Not intended to be copied
+    Executor(const Executor&);
+    Executor& operator=(const Executor&);
+
+    // Moves the coroutine to a thread of the executor
+    struct Schedule
+    {
+        Executor* exec;
+
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            {
+                std::lock_guard<std::mutex> guard(exec->m_lock);
+                exec->m_ready.push_back(handle);
+            }
+
+            exec->wakeup();
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+
+    static detail::Detached run_detached(Executor* exec, Task<void> task)
+    {
+        co_await Schedule{exec};
+
+        {
+            // Freed before wait() can return
+            Task<void> t = std::move(task);
+            co_await t;
+        }
+
+        exec->task_done();
+    }
+
+    void task_done()
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+
+        if (--m_tasks == 0)
+        {
+            m_done.notify_all();
+        }
+    }
+
+    void wakeup()
+    {
+        // A failed write means that a wakeup is already pending
+        uint64_t one = 1;
+        ssize_t rc = write(m_event, &one, sizeof(one));
+        (void)rc;
+    }
+
+    void set_error(const char* msg, int err)
+    {
+        char buf[512];
+        m_error = msg;
+        m_error += strerror_r(err, buf, sizeof(buf));
+    }
+
+    void run()
+    {
+        const int max_events = 64;
+        struct epoll_event events[max_events];
+
+        while (!m_stop)
+        {
+            int n = epoll_wait(m_epoll, events, max_events, -1);
+
+            for (int i = 0; i < n && !m_stop; i++)
+            {
+                if (events[i].data.ptr)
+                {
+                    m_handoff.fetch_add(1, std::memory_order_acq_rel);
+                    std::coroutine_handle<>::from_address(events[i].data.ptr).resume();
+                }
+                else
+                {
+                    run_ready();
+                }
+            }
+        }
+
+        // The stop may have been consumed by this thread, pass it on
+        wakeup();
+    }
+
+    void run_ready()
+    {
+        uint64_t count;
+
+        if (read(m_event, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        {
+            return;
+        }
+
+        while (!m_stop)
+        {
+            std::coroutine_handle<> handle;
+
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+
+                if (m_ready.empty())
+                {
+                    break;
+                }
+
+                handle = m_ready.front();
+                m_ready.pop_front();
+            }
+
+            handle.resume();
+        }
+    }
+};
+
+/**
+ * A Connection read from coroutines
+ *
+ * The connection is driven with the non-blocking API of Connection, the
+ * coroutine is suspended while the socket is not ready. Only one coroutine
+ * may use a stream at a time. The Connection must outlive the Stream and it
+ * must not be closed while the Stream exists.
+ */
+class Stream
+{
+public:
+    Stream(Executor& exec, Connection& conn):
+        m_exec(exec),
+        m_conn(conn),
+        m_fd(-1)
+    {
+    }
+
+    ~Stream()
+    {
+        if (m_fd != -1)
+        {
+            m_exec.forget(m_fd);
+        }
+    }
+
+    /**
+     * Start connecting
+     *
+     * Starts the connection with Connection::connectAsync(). The handshake is
+     * done by the first call to next() or nextBatch(). A connection started
+     * earlier by the stream is closed first.
+     *
+     * @param table The table to stream in `database.table` format
+     * @param gtid  The optional starting GTID position
+     *
+     * @return True if connecting was started
+     */
+    bool connect(const std::string& table, const std::string& gtid = "")
+    {
+        if (m_fd != -1)
+        {
+            // The previous connection is closed only after epoll has let go of it
+            m_exec.forget(m_fd);
+            m_conn.close();
+            m_fd = -1;
+        }
+
+        m_error.clear();
+
+        if (!m_conn.connectAsync(table, gtid))
+        {
+            return false;
+        }
+
+        m_fd = m_conn.fd();
+        return true;
+    }
+
+    /**
+     * Read one change event
+     *
+     * @return A Row or an empty Row on error
+     */
+    Task<Row> next()
+    {
+        Row row;
+
+        while (!(row = m_conn.readBuffered()) && m_conn.error().empty())
+        {
+            // Not part of the condition, GCC 12 miscompiles co_await in an && operand
+            if (!co_await wait())
+            {
+                break;
+            }
+        }
+
+        co_return row;
+    }
+
+    /**
+     * Read a batch of change events
+     *
+     * Waits for the first event and returns the events that have already
+     * arrived.
+     *
+     * @param dest Where the rows are stored, any previous contents are removed
+     * @param max  The maximum number of rows to read
+     *
+     * @return The number of rows read, 0 on error
+     */
+    Task<size_t> nextBatch(RowList& dest, size_t max = 1000)
+    {
+        dest.clear();
+
+        while (true)
+        {
+            Row row;
+
+            while (dest.size() < max && (row = m_conn.readBuffered()))
+            {
+                dest.push_back(row);
+            }
+
+            if (!dest.empty() || !m_conn.error().empty())
+            {
+                break;
+            }
+            else if (!co_await wait())
+            {
+                break;
+            }
+        }
+
+        co_return dest.size();
+    }
+
+    /**
+     * Get the latest error
+     *
+     * @return The error of the stream or of the connection, an empty string
+     *         if no errors have occurred
+     */
+    const std::string& error() const
+    {
+        return m_error.empty() ? m_conn.error() : m_error;
+    }
+
+private:
+    Executor&   m_exec;
+    Connection& m_conn;
+    int         m_fd;
+    std::string m_error;
+
+    // Not intended to be copied
+    Stream(const Stream&);
+    Stream& operator=(const Stream&);
+
+    // Waits for the socket and does the I/O the connection needs
+    Task<bool> wait()
+    {
+        if (m_fd == -1)
+        {
+            m_error = "Stream is not connected";
+            co_return false;
+        }
+
+        bool writing = m_conn.wantsWrite();
+        int err = co_await m_exec.ready(m_fd, writing ? EPOLLOUT : EPOLLIN);
+
+        if (err)
+        {
+            char buf[512];
+            m_error = "Failed to wait for the connection: ";
+            m_error += strerror_r(err, buf, sizeof(buf));
+            co_return false;
+        }
+
+        co_return writing ? m_conn.onWritable() : m_conn.onReadable();
+    }
+};
+
+}
+
+}
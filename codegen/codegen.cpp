@@ -0,0 +1,586 @@
+/* Copyright (c) 2017, MariaDB Corporation. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301  USA
+ */
+
+/**
+ * Generates a typed row struct and a decoder for the CDC schema of a table
+ *
+ * The schema is read from a file or from a live stream. The generated header
+ * contains a struct with one member per field and a CDC::Decoder subclass.
+ * When the stream has exactly the generated schema, the decoder reads the
+ * events from their text in the fixed field order with CDC::Scanner. When
+ * the schema is different or an event is not in the expected layout, it
+ * falls back to decoding the parsed JSON by field name.
+ */
+
+#include "../cdc_connector.h"
+
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <stdlib.h>
+
+static struct option long_options[] =
+{
+    {"name",   required_argument, 0, 'n'},
+    {"output", required_argument, 0, 'o'},
+    {"help",   no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+};
+
+static void usage()
+{
+    std::cout << "Usage: cdc_codegen [OPTIONS] SCHEMA_FILE" << std::endl;
+    std::cout << "       cdc_codegen [OPTIONS] HOST PORT USER PASSWORD DATABASE.TABLE" << std::endl;
+    std::cout << std::endl;
+    std::cout << "  --name=NAME       Prefix of the generated class names (default: the table" << std::endl;
+    std::cout << "                    name, or Table with a schema file)" << std::endl;
+    std::cout << "  --output=FILE     Write the header to FILE instead of the standard output" << std::endl;
+    std::cout << std::endl;
+    std::cout << "The schema file contains the JSON schema of a table as returned by" << std::endl;
+    std::cout << "Connection::schema()." << std::endl;
+    std::cout << std::endl;
+}
+
+enum Kind
+{
+    INTEGER,
+    BOOLEAN,    // An integer that is one or zero, like in CDC::Column
+    NUMBER,
+    STRING
+};
+
+struct Field
+{
+    std::string name;       // The field name in the schema
+    std::string member;     // The member in the generated struct
+    Kind        kind;
+    bool        nullable;
+};
+
+static const char* cpp_type(Kind kind)
+{
+    switch (kind)
+    {
+    case INTEGER:
+    case BOOLEAN:
+        return "int64_t";
+
+    case NUMBER:
+        return "double";
+
+    default:
+        return "std::string";
+    }
+}
+
+static const char* scan_function(Kind kind)
+{
+    switch (kind)
+    {
+    case INTEGER:
+        return "integer";
+
+    case BOOLEAN:
+        return "boolean";
+
+    case NUMBER:
+        return "number";
+
+    default:
+        return "string";
+    }
+}
+
+// The kind of an Avro field type, nullable fields are unions with "null"
+static Kind avro_kind(json_t* type, bool& nullable)
+{
+    if (json_is_array(type))
+    {
+        Kind kind = STRING;
+        size_t i;
+        json_t* v;
+
+        json_array_foreach(type, i, v)
+        {
+            if (json_is_string(v) && strcmp(json_string_value(v), "null") == 0)
+            {
+                nullable = true;
+            }
+            else
+            {
+                bool ignored;
+                kind = avro_kind(v, ignored);
+            }
+        }
+
+        return kind;
+    }
+
+    const char* name = json_string_value(type);
+
+    if (name && (strcmp(name, "int") == 0 || strcmp(name, "long") == 0))
+    {
+        return INTEGER;
+    }
+    else if (name && strcmp(name, "boolean") == 0)
+    {
+        return BOOLEAN;
+    }
+    else if (name && (strcmp(name, "float") == 0 || strcmp(name, "double") == 0))
+    {
+        return NUMBER;
+    }
+
+    // Strings, enums and everything else
+    return STRING;
+}
+
+static bool is_keyword(const std::string& str)
+{
+    static const char* keywords[] =
+    {
+        "alignas", "alignof", "and", "asm", "auto", "bool", "break", "case", "catch", "char",
+        "class", "const", "continue", "default", "delete", "do", "double", "else", "enum",
+        "explicit", "export", "extern", "false", "float", "for", "friend", "goto", "if",
+        "inline", "int", "long", "mutable", "namespace", "new", "noexcept", "not", "nullptr",
+        "operator", "or", "private", "protected", "public", "register", "return", "short",
+        "signed", "sizeof", "static", "struct", "switch", "template", "this", "throw", "true",
+        "try", "typedef", "typeid", "typename", "union", "unsigned", "using", "virtual", "void",
+        "volatile", "while", "xor"
+    };
+
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++)
+    {
+        if (str == keywords[i])
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Converts a name into a valid and unique C++ identifier
+static std::string identifier(const std::string& name, std::set<std::string>& used)
+{
+    std::string rval;
+
+    for (std::string::const_iterator it = name.begin(); it != name.end(); it++)
+    {
+        rval += isalnum((unsigned char)*it) ? *it : '_';
+    }
+
+    if (rval.empty() || isdigit((unsigned char)rval[0]))
+    {
+        rval = "_" + rval;
+    }
+
+    if (is_keyword(rval))
+    {
+        rval += "_";
+    }
+
+    std::string base = rval;
+
+    for (int i = 2; used.count(rval) || used.count(rval + "_null"); i++)
+    {
+        std::stringstream ss;
+        ss << base << "_" << i;
+        rval = ss.str();
+    }
+
+    used.insert(rval);
+    used.insert(rval + "_null");
+    return rval;
+}
+
+// Quotes a string as a C++ string literal
+static std::string literal(const std::string& str)
+{
+    std::string rval = "\"";
+
+    for (std::string::const_iterator it = str.begin(); it != str.end(); it++)
+    {
+        if (*it == '"' || *it == '\\')
+        {
+            rval += '\\';
+        }
+
+        rval += *it;
+    }
+
+    return rval + "\"";
+}
+
+static bool parse_schema(const std::string& schema, std::vector<Field>& fields, std::string& error)
+{
+    json_error_t err;
+    json_t* js = json_loads(schema.c_str(), 0, &err);
+
+    if (!js)
+    {
+        error = "Failed to parse schema: ";
+        error += err.text;
+        return false;
+    }
+
+    json_t* arr = json_object_get(js, "fields");
+    std::set<std::string> used;
+    size_t i;
+    json_t* v;
+
+    json_array_foreach(arr, i, v)
+    {
+        json_t* name = json_object_get(v, "name");
+
+        if (!json_is_string(name))
+        {
+            error = "Schema field without a name";
+            break;
+        }
+
+        Field field;
+        field.name = json_string_value(name);
+        field.nullable = false;
+        field.kind = avro_kind(json_object_get(v, "type"), field.nullable);
+        field.member = identifier(field.name, used);
+        fields.push_back(field);
+    }
+
+    if (error.empty() && fields.empty())
+    {
+        error = "Schema has no fields";
+    }
+
+    json_decref(js);
+    return error.empty();
+}
+
+static const Field* find_field(const std::vector<Field>& fields, const char* name, Kind kind)
+{
+    for (std::vector<Field>::const_iterator it = fields.begin(); it != fields.end(); it++)
+    {
+        if (it->name == name && it->kind == kind)
+        {
+            return &*it;
+        }
+    }
+
+    return NULL;
+}
+
+static void generate(std::ostream& out, const std::string& name, const std::string& source,
+                     const std::vector<Field>& fields)
+{
+    std::string row = name + "Row";
+    std::string decoder = name + "Decoder";
+    std::string guard = "CDC_GENERATED_" + name + "_H";
+
+    for (std::string::iterator it = guard.begin(); it != guard.end(); it++)
+    {
+        *it = toupper((unsigned char)*it);
+    }
+
+    out << "/**" << std::endl;
+    out << " * Generated by cdc_codegen from " << source << ", do not edit" << std::endl;
+    out << " *" << std::endl;
+    out << " * Include cdc_connector.h before this header." << std::endl;
+    out << " */" << std::endl;
+    out << std::endl;
+    out << "#ifndef " << guard << std::endl;
+    out << "#define " << guard << std::endl;
+    out << std::endl;
+
+    // The row struct
+    out << "struct " << row << std::endl;
+    out << "{" << std::endl;
+    out << "    " << row << "()";
+    const char* sep = ":\n";
+
+    for (std::vector<Field>::const_iterator it = fields.begin(); it != fields.end(); it++)
+    {
+        if (it->kind != STRING)
+        {
+            out << sep << "        " << it->member << "(0)";
+            sep = ",\n";
+        }
+
+        if (it->nullable)
+        {
+            out << sep << "        " << it->member << "_null(true)";
+            sep = ",\n";
+        }
+    }
+
+    out << std::endl;
+    out << "    {" << std::endl;
+    out << "    }" << std::endl;
+    out << std::endl;
+
+    for (std::vector<Field>::const_iterator it = fields.begin(); it != fields.end(); it++)
+    {
+        out << "    " << cpp_type(it->kind) << " " << it->member << ";" << std::endl;
+
+        if (it->nullable)
+        {
+            out << "    bool " << it->member << "_null;" << std::endl;
+        }
+    }
+
+    out << "};" << std::endl;
+    out << std::endl;
+
+    // The decoder
+    out << "class " << decoder << ": public CDC::Decoder" << std::endl;
+    out << "{" << std::endl;
+    out << "public:" << std::endl;
+    out << "    " << decoder << "():" << std::endl;
+    out << "        m_exact(false)" << std::endl;
+    out << "    {" << std::endl;
+    out << "    }" << std::endl;
+    out << std::endl;
+    out << "    const " << row << "& value() const" << std::endl;
+    out << "    {" << std::endl;
+    out << "        return m_row;" << std::endl;
+    out << "    }" << std::endl;
+    out << std::endl;
+
+    out << "    void setSchema(const CDC::ValueList& keys, const CDC::ValueList&)" << std::endl;
+    out << "    {" << std::endl;
+    out << "        static const char* names[] =" << std::endl;
+    out << "        {" << std::endl;
+
+    for (std::vector<Field>::const_iterator it = fields.begin(); it != fields.end(); it++)
+    {
+        out << "            " << literal(it->name) << "," << std::endl;
+    }
+
+    out << "        };" << std::endl;
+    out << std::endl;
+    out << "        const size_t n = sizeof(names) / sizeof(names[0]);" << std::endl;
+    out << "        m_row = " << row << "();" << std::endl;
+    out << "        m_fields.assign(keys.size(), -1);" << std::endl;
+    out << "        m_exact = keys.size() == n;" << std::endl;
+    out << std::endl;
+    out << "        for (size_t i = 0; i < keys.size(); i++)" << std::endl;
+    out << "        {" << std::endl;
+    out << "            for (size_t j = 0; j < n && m_fields[i] == -1; j++)" << std::endl;
+    out << "            {" << std::endl;
+    out << "                if (keys[i] == names[j])" << std::endl;
+    out << "                {" << std::endl;
+    out << "                    m_fields[i] = j;" << std::endl;
+    out << "                }" << std::endl;
+    out << "            }" << std::endl;
+    out << std::endl;
+    out << "            m_exact = m_exact && m_fields[i] == (int)i;" << std::endl;
+    out << "        }" << std::endl;
+    out << "    }" << std::endl;
+    out << std::endl;
+
+    out << "    void decode(size_t field, json_t* value)" << std::endl;
+    out << "    {" << std::endl;
+    out << "        switch (field < m_fields.size() ? m_fields[field] : -1)" << std::endl;
+    out << "        {" << std::endl;
+
+    for (size_t i = 0; i < fields.size(); i++)
+    {
+        const Field& f = fields[i];
+        out << "        case " << i << ":" << std::endl;
+
+        if (f.nullable)
+        {
+            out << "            m_row." << f.member << "_null = json_is_null(value);" << std::endl;
+        }
+
+        out << "            CDC::decode_value(m_row." << f.member << ", value);" << std::endl;
+        out << "            break;" << std::endl;
+        out << std::endl;
+    }
+
+    out << "        default:" << std::endl;
+    out << "            break;" << std::endl;
+    out << "        }" << std::endl;
+    out << "    }" << std::endl;
+    out << std::endl;
+
+    out << "    bool decodeLine(const std::string& line, CDC::EventInfo& info)" << std::endl;
+    out << "    {" << std::endl;
+    out << "        CDC::Scanner s(line);" << std::endl;
+    out << std::endl;
+    out << "        if (!m_exact || !s.start()";
+
+    for (size_t i = 0; i < fields.size(); i++)
+    {
+        const Field& f = fields[i];
+        out << " ||" << std::endl;
+        out << "            " << (i > 0 ? "!s.next() || " : "") << "!s.key(" << literal(f.name) << ") || "
+            << "!s." << scan_function(f.kind) << "(m_row." << f.member;
+
+        if (f.nullable)
+        {
+            out << ", m_row." << f.member << "_null";
+        }
+
+        out << ")";
+    }
+
+    out << " ||" << std::endl;
+    out << "            !s.end())" << std::endl;
+    out << "        {" << std::endl;
+    out << "            return false;" << std::endl;
+    out << "        }" << std::endl;
+    out << std::endl;
+
+    // The event metadata, only if the schema has it in the expected form
+    const char* meta[] = {"domain", "server_id", "sequence", "timestamp"};
+
+    for (size_t i = 0; i < sizeof(meta) / sizeof(meta[0]); i++)
+    {
+        if (const Field* f = find_field(fields, meta[i], INTEGER))
+        {
+            out << "        info." << meta[i] << " = m_row." << f->member << ";" << std::endl;
+        }
+    }
+
+    if (const Field* f = find_field(fields, "event_type", STRING))
+    {
+        out << "        info.event_type = m_row." << f->member << ".c_str();" << std::endl;
+    }
+
+    out << "        return true;" << std::endl;
+    out << "    }" << std::endl;
+    out << std::endl;
+
+    out << "private:" << std::endl;
+    out << "    " << row << " m_row;" << std::endl;
+    out << "    std::vector<int> m_fields; // The generated field of each schema position, -1 if none" << std::endl;
+    out << "    bool m_exact;              // Whether the schema is the generated one" << std::endl;
+    out << "};" << std::endl;
+    out << std::endl;
+    out << "#endif" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    std::string name;
+    std::string output;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            name = optarg;
+            break;
+
+        case 'o':
+            output = optarg;
+            break;
+
+        default:
+            usage();
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    int args = argc - optind;
+    std::string schema;
+    std::string source;
+
+    if (args == 1)
+    {
+        std::ifstream file(argv[optind]);
+        std::stringstream ss;
+
+        if (!file || !(ss << file.rdbuf()))
+        {
+            std::cerr << "Failed to read schema file: " << argv[optind] << std::endl;
+            return 1;
+        }
+
+        schema = ss.str();
+        source = argv[optind];
+
+        if (name.empty())
+        {
+            name = "Table";
+        }
+    }
+    else if (args == 5)
+    {
+        CDC::Connection conn(argv[optind], atoi(argv[optind + 1]), argv[optind + 2], argv[optind + 3]);
+        std::string table = argv[optind + 4];
+
+        if (!conn.connect(table))
+        {
+            std::cerr << conn.error() << std::endl;
+            return 1;
+        }
+
+        schema = conn.schema();
+        source = "the schema of " + table;
+
+        if (name.empty())
+        {
+            std::string::size_type dot = table.find('.');
+            name = table.substr(dot == std::string::npos ? 0 : dot + 1);
+
+            if (!name.empty())
+            {
+                name[0] = toupper((unsigned char)name[0]);
+            }
+        }
+    }
+    else
+    {
+        usage();
+        return 1;
+    }
+
+    std::set<std::string> used;
+    name = identifier(name, used);
+    std::vector<Field> fields;
+    std::string error;
+
+    if (!parse_schema(schema, fields, error))
+    {
+        std::cerr << error << std::endl;
+        return 1;
+    }
+
+    if (output.empty())
+    {
+        generate(std::cout, name, source, fields);
+    }
+    else
+    {
+        std::ofstream file(output.c_str());
+        generate(file, name, source, fields);
+
+        if (!file.flush())
+        {
+            std::cerr << "Failed to write header: " << output << std::endl;
+            return 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,198 @@
+/* Copyright (c) 2017, MariaDB Corporation. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301  USA
+ */
+
+/**
+ * A mock MaxScale CDC server for testing and benchmarking the connector
+ * without a real MaxScale.
+ */
+
+#include "mock_server.h"
+
+#include <algorithm>
+#include <getopt.h>
+#include <iostream>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+
+static struct option long_options[] =
+{
+    {"port",                required_argument, 0, 'P'},
+    {"user",                required_argument, 0, 'u'},
+    {"password",            required_argument, 0, 'p'},
+    {"file",                required_argument, 0, 'f'},
+    {"rows",                required_argument, 0, 'n'},
+    {"rate",                required_argument, 0, 'r'},
+    {"rows-per-trx",        required_argument, 0, 't'},
+    {"int-columns",         required_argument, 0, 'i'},
+    {"string-columns",      required_argument, 0, 's'},
+    {"string-size",         required_argument, 0, 'S'},
+    {"drip-delay",          required_argument, 0, 'd'},
+    {"huge-every",          required_argument, 0, 'H'},
+    {"huge-size",           required_argument, 0, 'Z'},
+    {"disconnect-after",    required_argument, 0, 'D'},
+    {"schema-change-every", required_argument, 0, 'c'},
+    {"update-every",        required_argument, 0, 'U'},
+    {"delete-every",        required_argument, 0, 'X'},
+    {"pause-every",         required_argument, 0, 'w'},
+    {"pause-time",          required_argument, 0, 'W'},
+    {"help",                no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+};
+
+static void usage()
+{
+    std::cout << "Usage: cdc_mock_server [OPTIONS]" << std::endl;
+    std::cout << std::endl;
+    std::cout << "  --port=PORT                 Port to listen on, 0 for any free port (default: 4001)" << std::endl;
+    std::cout << "  --user=USER                 Accepted user (default: cdcuser)" << std::endl;
+    std::cout << "  --password=PASSWORD         Accepted password (default: cdc)" << std::endl;
+    std::cout << "  --file=FILE                 Send a recorded stream instead of generated rows" << std::endl;
+    std::cout << "  --rows=N                    Rows per stream, 0 for no limit (default: 0)" << std::endl;
+    std::cout << "  --rate=N                    Rows per second, 0 for no limit (default: 0)" << std::endl;
+    std::cout << "  --rows-per-trx=N            Rows in each transaction (default: 1)" << std::endl;
+    std::cout << "  --int-columns=N             Number of integer columns (default: 4)" << std::endl;
+    std::cout << "  --string-columns=N          Number of string columns (default: 4)" << std::endl;
+    std::cout << "  --string-size=N             Length of string values (default: 16)" << std::endl;
+    std::cout << "  --drip-delay=USEC           Send one byte at a time with this delay" << std::endl;
+    std::cout << "  --huge-every=N              Every Nth row has a huge string value" << std::endl;
+    std::cout << "  --huge-size=N               Length of the huge string values (default: 16777216)" << std::endl;
+    std::cout << "  --disconnect-after=N        Disconnect in the middle of the row after N rows" << std::endl;
+    std::cout << "  --schema-change-every=N     Add a column to the schema after every N rows" << std::endl;
+    std::cout << "  --update-every=N            Every Nth row updates the latest inserted row" << std::endl;
+    std::cout << "  --delete-every=N            Every Nth row deletes the latest inserted row" << std::endl;
+    std::cout << "  --pause-every=N             Stop sending for the pause time after every N rows" << std::endl;
+    std::cout << "  --pause-time=USEC           Length of the pauses (default: 0)" << std::endl;
+    std::cout << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    CDC::MockConfig config;
+    config.port = 4001;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+        case 'P':
+            config.port = atoi(optarg);
+            break;
+
+        case 'u':
+            config.user = optarg;
+            break;
+
+        case 'p':
+            config.password = optarg;
+            break;
+
+        case 'f':
+            config.file = optarg;
+            break;
+
+        case 'n':
+            config.rows = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'r':
+            config.rate = strtoull(optarg, NULL, 10);
+            break;
+
+        case 't':
+            config.rows_per_trx = std::max(strtoull(optarg, NULL, 10), 1ULL);
+            break;
+
+        case 'i':
+            config.int_columns = atoi(optarg);
+            break;
+
+        case 's':
+            config.string_columns = atoi(optarg);
+            break;
+
+        case 'S':
+            config.string_size = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'd':
+            config.drip_delay = atoi(optarg);
+            break;
+
+        case 'H':
+            config.huge_every = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'Z':
+            config.huge_size = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'D':
+            config.disconnect_after = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'c':
+            config.schema_change_every = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'U':
+            config.update_every = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'X':
+            config.delete_every = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'w':
+            config.pause_every = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'W':
+            config.pause_time = strtoll(optarg, NULL, 10);
+            break;
+
+        default:
+            usage();
+            return c == 'h' ? 0 : 1;
+        }
+    }
+
+    sigset_t sigset;
+    sigemptyset(&sigset);
+    sigaddset(&sigset, SIGINT);
+    sigaddset(&sigset, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+    CDC::MockServer server(config);
+
+    if (!server.start())
+    {
+        std::cout << server.error() << std::endl;
+        return 1;
+    }
+
+    std::cout << "Listening on 127.0.0.1:" << server.port() << std::endl;
+
+    // Serve clients until interrupted
+    int sig;
+    sigwait(&sigset, &sig);
+    server.stop();
+
+    return 0;
+}
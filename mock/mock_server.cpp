@@ -0,0 +1,616 @@
+/* Copyright (c) 2017, MariaDB Corporation. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301  USA
+ */
+
+#include "mock_server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fstream>
+#include <netinet/in.h>
+#include <openssl/sha.h>
+#include <poll.h>
+#include <sstream>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ERRBUF_SIZE 512
+#define READBUF_SIZE 32 * 1024
+#define SENDBUF_SIZE 64 * 1024
+
+static const char OK_RESPONSE[] = "OK\n";
+static const char AUTH_ERROR[] = "ERR Authentication failed\n";
+static const char REGISTER_ERROR[] = "ERR Registration failed\n";
+static const char REQUEST_ERROR[] = "ERR Invalid request\n";
+static const char REGISTER_MSG[] = "REGISTER ";
+static const char REQUEST_MSG[] = "REQUEST-DATA ";
+static const char CLOSE_MSG[] = "CLOSE";
+
+namespace
+{
+
+std::string bin2hex(const uint8_t *data, size_t len)
+{
+    std::string result;
+    static const char hexconvtab[] = "0123456789abcdef";
+
+    for (size_t i = 0; i < len; i++)
+    {
+        result += hexconvtab[data[i] >> 4];
+        result += hexconvtab[data[i] & 0x0f];
+    }
+
+    return result;
+}
+
+// The authentication string a client sends, see generateAuthString in the connector
+std::string expected_auth(const std::string& user, const std::string& password)
+{
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const uint8_t*> (password.c_str()), password.length(), digest);
+    std::string auth_str = user + ":";
+    return bin2hex((const uint8_t*)auth_str.c_str(), auth_str.length()) + bin2hex(digest, sizeof(digest));
+}
+
+int64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void sleep_us(int64_t us)
+{
+    struct timespec ts;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    {
+        ;
+    }
+}
+
+// Generates the schema and the rows of a stream
+class Generator
+{
+public:
+    Generator(const CDC::MockConfig& config, uint64_t sequence):
+        m_config(config),
+        m_rows(0),
+        m_inserts(0),
+        m_version(0),
+        m_live(false),
+        m_sequence(sequence),
+        m_trx_rows(0),
+        m_event_number(0),
+        m_extra_columns(0)
+    {
+        static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz";
+
+        for (size_t i = 0; i < config.string_size + 26; i++)
+        {
+            m_letters += alphabet[i % 26];
+        }
+    }
+
+    // Whether the schema changes before the next row
+    bool schema_changes() const
+    {
+        return m_config.schema_change_every && m_rows && m_rows % m_config.schema_change_every == 0;
+    }
+
+    void schema(std::string& dest)
+    {
+        std::stringstream ss;
+        ss << "{\"namespace\": \"MaxScaleChangeDataSchema.avro\", \"type\": \"record\", "
+           << "\"name\": \"ChangeRecord\", \"fields\": ["
+           << "{\"name\": \"domain\", \"type\": \"int\"}, "
+           << "{\"name\": \"server_id\", \"type\": \"int\"}, "
+           << "{\"name\": \"sequence\", \"type\": \"int\"}, "
+           << "{\"name\": \"event_number\", \"type\": \"int\"}, "
+           << "{\"name\": \"timestamp\", \"type\": \"int\"}, "
+           << "{\"name\": \"event_type\", \"type\": {\"type\": \"enum\", \"name\": \"EVENT_TYPES\", "
+           << "\"symbols\": [\"insert\", \"update_before\", \"update_after\", \"delete\"]}}";
+
+        for (int i = 0; i < m_config.int_columns; i++)
+        {
+            ss << ", {\"name\": \"i" << i << "\", \"type\": [\"null\", \"long\"], "
+               << "\"real_type\": \"bigint\", \"length\": 20}";
+        }
+
+        for (int i = 0; i < m_config.string_columns; i++)
+        {
+            ss << ", {\"name\": \"s" << i << "\", \"type\": [\"null\", \"string\"], "
+               << "\"real_type\": \"varchar\", \"length\": " << m_config.string_size << "}";
+        }
+
+        for (int i = 0; i < m_extra_columns; i++)
+        {
+            ss << ", {\"name\": \"x" << i << "\", \"type\": [\"null\", \"long\"], "
+               << "\"real_type\": \"bigint\", \"length\": 20}";
+        }
+
+        ss << "]}\n";
+        dest += ss.str();
+    }
+
+    // Generates the next row, preceded by a new schema if the schema changes.
+    // Returns the offset where the row starts.
+    size_t row(std::string& dest)
+    {
+        if (schema_changes())
+        {
+            m_extra_columns++;
+            schema(dest);
+        }
+
+        size_t start = dest.length();
+
+        if (m_trx_rows == m_config.rows_per_trx || m_trx_rows == 0)
+        {
+            m_sequence++;
+            m_trx_rows = 0;
+            m_event_number = 0;
+        }
+
+        m_trx_rows++;
+        uint64_t n = m_rows + 1;
+
+        // Updates and deletes modify the latest inserted row
+        if (m_live && m_config.delete_every && n % m_config.delete_every == 0)
+        {
+            event(dest, "delete", m_inserts - 1);
+            m_live = false;
+        }
+        else if (m_live && m_config.update_every && n % m_config.update_every == 0)
+        {
+            event(dest, "update_before", m_inserts - 1);
+            m_version++;
+            event(dest, "update_after", m_inserts - 1);
+        }
+        else
+        {
+            m_version = 0;
+            m_live = true;
+            event(dest, "insert", m_inserts++);
+        }
+
+        m_rows++;
+        return start;
+    }
+
+private:
+    // Generates one event for the row with the given id
+    void event(std::string& dest, const char* type, uint64_t id)
+    {
+        m_event_number++;
+
+        char buf[128];
+        snprintf(buf, sizeof(buf), "{\"domain\": 0, \"server_id\": 3000, \"sequence\": %lu, "
+                 "\"event_number\": %lu, \"timestamp\": %ld, \"event_type\": \"%s\"",
+                 (unsigned long)m_sequence, (unsigned long)m_event_number, (long)time(NULL), type);
+        dest += buf;
+
+        for (int i = 0; i < m_config.int_columns; i++)
+        {
+            snprintf(buf, sizeof(buf), ", \"i%d\": %ld", i, (long)(id * (i + 1)));
+            dest += buf;
+        }
+
+        bool huge = m_config.huge_every && (m_rows + 1) % m_config.huge_every == 0;
+
+        for (int i = 0; i < m_config.string_columns; i++)
+        {
+            snprintf(buf, sizeof(buf), ", \"s%d\": \"", i);
+            dest += buf;
+
+            if (huge && i == 0)
+            {
+                dest.append(m_config.huge_size, 'h');
+            }
+            else
+            {
+                dest.append(m_letters, (id + i + m_version) % 26, m_config.string_size);
+            }
+
+            dest += '"';
+        }
+
+        for (int i = 0; i < m_extra_columns; i++)
+        {
+            snprintf(buf, sizeof(buf), ", \"x%d\": %d", i, i);
+            dest += buf;
+        }
+
+        dest += "}\n";
+    }
+
+    const CDC::MockConfig& m_config;
+    std::string            m_letters;
+    uint64_t               m_rows;
+    uint64_t               m_inserts;       // Number of inserted rows, the id of the next one
+    uint64_t               m_version;       // Number of updates to the latest inserted row
+    bool                   m_live;          // Whether the latest inserted row exists
+    uint64_t               m_sequence;
+    uint64_t               m_trx_rows;
+    uint64_t               m_event_number;
+    int                    m_extra_columns;
+};
+
+// Sends data to a client, returns false if the client is gone
+bool send_data(int fd, const char* data, size_t len, int drip_delay)
+{
+    while (len > 0)
+    {
+        ssize_t rc = send(fd, data, drip_delay ? 1 : len, MSG_NOSIGNAL);
+
+        if (rc == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            return false;
+        }
+
+        data += rc;
+        len -= rc;
+
+        if (drip_delay)
+        {
+            sleep_us(drip_delay);
+        }
+    }
+
+    return true;
+}
+
+bool send_data(int fd, const std::string& data, int drip_delay)
+{
+    return send_data(fd, data.c_str(), data.length(), drip_delay);
+}
+
+// Reads one protocol message, returns false if the client is gone
+bool read_message(int fd, std::string& dest)
+{
+    char buf[READBUF_SIZE];
+    ssize_t rc;
+
+    while ((rc = recv(fd, buf, sizeof(buf), 0)) == -1 && errno == EINTR)
+    {
+        ;
+    }
+
+    if (rc <= 0)
+    {
+        return false;
+    }
+
+    dest.assign(buf, rc);
+    return true;
+}
+
+}
+
+namespace CDC
+{
+
+MockServer::MockServer(const MockConfig& config):
+    m_config(config),
+    m_fd(-1),
+    m_port(0),
+    m_running(false)
+{
+    pthread_mutex_init(&m_lock, NULL);
+}
+
+MockServer::~MockServer()
+{
+    stop();
+    pthread_mutex_destroy(&m_lock);
+}
+
+bool MockServer::start()
+{
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(m_config.port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    int one = 1;
+
+    if ((m_fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1 ||
+        setsockopt(m_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+        bind(m_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 ||
+        listen(m_fd, SOMAXCONN) == -1 ||
+        getsockname(m_fd, (struct sockaddr*)&addr, &len) == -1)
+    {
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to listen: ";
+        m_error += strerror_r(errno, err, sizeof(err));
+    }
+    else
+    {
+        m_port = ntohs(addr.sin_port);
+        m_running = true;
+        int rc = pthread_create(&m_thread, NULL, run_accept, this);
+
+        if (rc == 0)
+        {
+            return true;
+        }
+
+        char err[ERRBUF_SIZE];
+        m_error = "Failed to create thread: ";
+        m_error += strerror_r(rc, err, sizeof(err));
+        m_running = false;
+    }
+
+    if (m_fd != -1)
+    {
+        close(m_fd);
+        m_fd = -1;
+    }
+
+    return false;
+}
+
+void MockServer::stop()
+{
+    if (!m_running)
+    {
+        return;
+    }
+
+    m_running = false;
+    shutdown(m_fd, SHUT_RDWR);
+    pthread_join(m_thread, NULL);
+    close(m_fd);
+    m_fd = -1;
+
+    pthread_mutex_lock(&m_lock);
+
+    for (std::vector<Client*>::iterator it = m_clients.begin(); it != m_clients.end(); it++)
+    {
+        if ((*it)->fd != -1)
+        {
+            shutdown((*it)->fd, SHUT_RDWR);
+        }
+    }
+
+    pthread_mutex_unlock(&m_lock);
+
+    for (std::vector<Client*>::iterator it = m_clients.begin(); it != m_clients.end(); it++)
+    {
+        pthread_join((*it)->thread, NULL);
+        delete *it;
+    }
+
+    m_clients.clear();
+}
+
+void* MockServer::run_accept(void* data)
+{
+    MockServer* server = static_cast<MockServer*>(data);
+    int fd;
+
+    while ((fd = accept(server->m_fd, NULL, NULL)) != -1 || errno == EINTR || errno == ECONNABORTED)
+    {
+        if (fd == -1)
+        {
+            continue;
+        }
+
+        Client* client = new Client;
+        client->server = server;
+        client->fd = fd;
+
+        pthread_mutex_lock(&server->m_lock);
+
+        if (pthread_create(&client->thread, NULL, run_client, client) == 0)
+        {
+            server->m_clients.push_back(client);
+        }
+        else
+        {
+            close(fd);
+            delete client;
+        }
+
+        pthread_mutex_unlock(&server->m_lock);
+    }
+
+    return NULL;
+}
+
+void* MockServer::run_client(void* data)
+{
+    Client* client = static_cast<Client*>(data);
+    client->server->serve(client->fd);
+
+    pthread_mutex_lock(&client->server->m_lock);
+    close(client->fd);
+    client->fd = -1;
+    pthread_mutex_unlock(&client->server->m_lock);
+
+    return NULL;
+}
+
+void MockServer::serve(int fd)
+{
+    const MockConfig& cnf = m_config;
+    std::string msg;
+
+    if (!read_message(fd, msg))
+    {
+        return;
+    }
+    else if (msg != expected_auth(cnf.user, cnf.password))
+    {
+        send_data(fd, AUTH_ERROR, sizeof(AUTH_ERROR) - 1, 0);
+        return;
+    }
+    else if (!send_data(fd, OK_RESPONSE, sizeof(OK_RESPONSE) - 1, 0) || !read_message(fd, msg))
+    {
+        return;
+    }
+    else if (msg.compare(0, sizeof(REGISTER_MSG) - 1, REGISTER_MSG) != 0)
+    {
+        send_data(fd, REGISTER_ERROR, sizeof(REGISTER_ERROR) - 1, 0);
+        return;
+    }
+    else if (!send_data(fd, OK_RESPONSE, sizeof(OK_RESPONSE) - 1, 0) || !read_message(fd, msg))
+    {
+        return;
+    }
+    else if (msg.compare(0, sizeof(REQUEST_MSG) - 1, REQUEST_MSG) != 0)
+    {
+        send_data(fd, REQUEST_ERROR, sizeof(REQUEST_ERROR) - 1, 0);
+        return;
+    }
+
+    // The optional GTID is the last word of the request
+    std::string table;
+    std::string gtid;
+    std::stringstream request(msg.substr(sizeof(REQUEST_MSG) - 1));
+    request >> table >> gtid;
+    uint64_t sequence = 0;
+    size_t pos = gtid.find_last_of('-');
+
+    if (pos != std::string::npos)
+    {
+        // Start from the requested transaction
+        sequence = strtoull(gtid.c_str() + pos + 1, NULL, 10);
+        sequence = sequence ? sequence - 1 : 0;
+    }
+
+    std::string out;
+    std::ifstream file;
+    Generator gen(cnf, sequence);
+    int64_t start = now_us();
+    uint64_t rows = 0;
+    bool ok = true;
+
+    if (cnf.file.empty())
+    {
+        gen.schema(out);
+    }
+    else
+    {
+        file.open(cnf.file.c_str());
+    }
+
+    while (ok && m_running && (cnf.rows == 0 || rows < cnf.rows))
+    {
+        size_t row_start = out.length();
+
+        if (!cnf.file.empty())
+        {
+            std::string line;
+
+            if (!std::getline(file, line))
+            {
+                break;
+            }
+
+            out += line;
+            out += '\n';
+        }
+        else
+        {
+            row_start = gen.row(out);
+        }
+
+        if (cnf.disconnect_after && rows == cnf.disconnect_after)
+        {
+            // Cut the connection in the middle of the row
+            out.resize(row_start + (out.length() - row_start) / 2);
+            send_data(fd, out, cnf.drip_delay);
+            return;
+        }
+
+        rows++;
+
+        if (cnf.rate)
+        {
+            int64_t due = start + rows * 1000000 / cnf.rate;
+            int64_t now = now_us();
+
+            if (due > now)
+            {
+                ok = send_data(fd, out, cnf.drip_delay);
+                out.clear();
+                sleep_us(due - now);
+            }
+        }
+
+        if (cnf.pause_every && rows % cnf.pause_every == 0)
+        {
+            ok = send_data(fd, out, cnf.drip_delay);
+            out.clear();
+            sleep_us(cnf.pause_time);
+        }
+
+        if (out.length() >= SENDBUF_SIZE)
+        {
+            ok = send_data(fd, out, cnf.drip_delay);
+            out.clear();
+        }
+    }
+
+    if (ok && !send_data(fd, out, cnf.drip_delay))
+    {
+        return;
+    }
+
+    // Like MaxScale, keep the connection open until the client closes it
+    while (m_running)
+    {
+        struct pollfd pfd;
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+
+        if (poll(&pfd, 1, 100) > 0)
+        {
+            if (!read_message(fd, msg) || msg.compare(0, sizeof(CLOSE_MSG) - 1, CLOSE_MSG) == 0)
+            {
+                break;
+            }
+        }
+    }
+}
+
+std::string MockServer::generate(const MockConfig& config)
+{
+    std::string rval;
+    Generator gen(config, 0);
+    gen.schema(rval);
+
+    for (uint64_t i = 0; i < config.rows; i++)
+    {
+        gen.row(rval);
+    }
+
+    return rval;
+}
+
+}
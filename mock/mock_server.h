@@ -0,0 +1,158 @@
+/* Copyright (c) 2017, MariaDB Corporation. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301  USA
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+namespace CDC
+{
+
+// The configuration of a MockServer
+struct MockConfig
+{
+    MockConfig():
+        port(0),
+        user("cdcuser"),
+        password("cdc"),
+        rows(0),
+        rate(0),
+        rows_per_trx(1),
+        int_columns(4),
+        string_columns(4),
+        string_size(16),
+        drip_delay(0),
+        huge_every(0),
+        huge_size(16 * 1024 * 1024),
+        disconnect_after(0),
+        schema_change_every(0),
+        update_every(0),
+        delete_every(0),
+        pause_every(0),
+        pause_time(0)
+    {
+    }
+
+    uint16_t    port;                   // Port to listen on, 0 for any free port
+    std::string user;                   // Accepted user
+    std::string password;               // Accepted password
+    std::string file;                   // A recorded stream to send instead of generated rows
+    uint64_t    rows;                   // Rows to send per stream, 0 for no limit. An update is one row.
+    uint64_t    rate;                   // Rows per second, 0 for no limit
+    uint64_t    rows_per_trx;           // Rows in each transaction, an update is one row
+    int         int_columns;            // Number of integer columns
+    int         string_columns;         // Number of string columns
+    size_t      string_size;            // Length of string values
+    int         drip_delay;             // If set, bytes are sent one at a time with this delay in microseconds
+    uint64_t    huge_every;             // If set, every Nth row has a huge string value
+    size_t      huge_size;              // Length of the huge string values
+    uint64_t    disconnect_after;       // If set, disconnect in the middle of the row after this many rows
+    uint64_t    schema_change_every;    // If set, add a column to the schema after every N rows
+    uint64_t    update_every;           // If set, every Nth row updates the latest inserted row
+    uint64_t    delete_every;           // If set, every Nth row deletes the latest inserted row
+    uint64_t    pause_every;            // If set, stop sending for pause_time after every N rows
+    int64_t     pause_time;             // Length of the pauses in microseconds
+};
+
+// A local server that implements the MaxScale CDC protocol
+class MockServer
+{
+public:
+    MockServer(const MockConfig& config);
+    ~MockServer();
+
+    /**
+     * Start listening on localhost and serving clients
+     *
+     * Each client is served by its own thread. A client authenticates,
+     * registers and then requests a table. The stream consists of a schema
+     * and rows generated from the configuration, or of the contents of the
+     * configured file. The integer columns of a generated row are multiples
+     * of its insertion order and identify it, an update changes only the
+     * string columns.
+     *
+     * @return True if the server was started
+     */
+    bool start();
+
+    /**
+     * Stop the server and disconnect all clients
+     */
+    void stop();
+
+    /**
+     * Get the port the server listens on
+     *
+     * @return The port number
+     */
+    uint16_t port() const
+    {
+        return m_port;
+    }
+
+    /**
+     * Get the latest error
+     *
+     * @return The latest error or an empty string if no errors have occurred
+     */
+    const std::string& error() const
+    {
+        return m_error;
+    }
+
+    /**
+     * Build the stream that would be sent for a table
+     *
+     * This is the generated stream without pacing or faults, useful for
+     * measuring the parts of the client that do not involve the network.
+     *
+     * @param config The configuration to generate the stream from
+     *
+     * @return The schema and the rows, one JSON object per line
+     */
+    static std::string generate(const MockConfig& config);
+
+private:
+    struct Client
+    {
+        MockServer* server;
+        int         fd;
+        pthread_t   thread;
+    };
+
+    MockConfig           m_config;
+    int                  m_fd;
+    uint16_t             m_port;
+    pthread_t            m_thread;
+    std::atomic<bool>    m_running;
+    pthread_mutex_t      m_lock;
+    std::vector<Client*> m_clients;
+    std::string          m_error;
+
+    // Not intended to be copied
+    MockServer(const MockServer&);
+    MockServer& operator=(const MockServer&);
+
+    static void* run_accept(void* data);
+    static void* run_client(void* data);
+    void serve(int fd);
+};
+
+}
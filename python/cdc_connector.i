@@ -6,4 +6,557 @@
 #include "../cdc_connector.h"
 %}
 
+// Wrapped by read_batch, read_columns and read_available below
+%ignore CDC::Connection::readBatch;
+%ignore CDC::Connection::readAvailable;
+
+// Exposed as bytes below
+%ignore CDC::Column::ints;
+%ignore CDC::Column::doubles;
+%ignore CDC::Column::offsets;
+%ignore CDC::Column::data;
+%ignore CDC::Column::validity;
+%ignore CDC::Column::codes;
+%ignore CDC::Column::decimals;
+
+// Exported to pyarrow by batch_to_arrow below
+%ignore ArrowSchema;
+%ignore ArrowArray;
+%ignore CDC::Batch::exportArrow;
+
+// Typed decoding is for C++ consumers
+%ignore CDC::Decoder;
+%ignore CDC::EventInfo;
+%ignore CDC::Scanner;
+%ignore CDC::Connection::read(CDC::Decoder&);
+%ignore CDC::decode_value;
+%ignore CDC::decode_number;
+%ignore CDC::parse_datetime;
+%ignore CDC::parse_decimal;
+
+// Shared by the connections and rows, not part of the interface
+%ignore CDC::SchemaInfo;
+
 %include "../cdc_connector.h"
+
+%{
+// Converts a row into a tuple of values or into a dict keyed by the field names
+static PyObject* cdc_row_to_python(const CDC::Row& row, PyObject* keys)
+{
+    size_t n = row->length();
+    PyObject* rval = keys ? PyDict_New() : PyTuple_New(n);
+
+    for (size_t i = 0; rval && i < n; i++)
+    {
+        const std::string& value = row->value(i);
+        PyObject* obj = PyUnicode_DecodeUTF8(value.c_str(), value.length(), "replace");
+
+        if (!obj)
+        {
+            Py_CLEAR(rval);
+        }
+        else if (keys)
+        {
+            PyDict_SetItem(rval, PyTuple_GET_ITEM(keys, i), obj);
+            Py_DECREF(obj);
+        }
+        else
+        {
+            PyTuple_SET_ITEM(rval, i, obj);
+        }
+    }
+
+    return rval;
+}
+
+// Builds the field names of a row, shared by all rows of the same schema
+static PyObject* cdc_row_keys(const CDC::Row& row)
+{
+    PyObject* keys = PyTuple_New(row->length());
+
+    for (size_t i = 0; keys && i < row->length(); i++)
+    {
+        PyObject* key = PyUnicode_FromStringAndSize(row->key(i).c_str(), row->key(i).length());
+
+        if (!key)
+        {
+            Py_CLEAR(keys);
+            break;
+        }
+
+        PyUnicode_InternInPlace(&key);
+        PyTuple_SET_ITEM(keys, i, key);
+    }
+
+    return keys;
+}
+
+static bool cdc_same_keys(const CDC::Row& a, const CDC::Row& b)
+{
+    if (a->length() != b->length())
+    {
+        return false;
+    }
+
+    for (size_t i = 0; i < a->length(); i++)
+    {
+        if (a->key(i) != b->key(i))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Converts rows into a list of tuples or dicts
+static PyObject* cdc_rows_to_list(const CDC::RowList& rows, bool as_dict)
+{
+    PyObject* list = PyList_New(rows.size());
+    PyObject* keys = NULL;
+    CDC::Row keys_row;
+
+    for (size_t i = 0; list && i < rows.size(); i++)
+    {
+        if (as_dict && (!keys_row || !cdc_same_keys(keys_row, rows[i])))
+        {
+            Py_XDECREF(keys);
+            keys_row = rows[i];
+
+            if (!(keys = cdc_row_keys(keys_row)))
+            {
+                Py_CLEAR(list);
+                break;
+            }
+        }
+
+        PyObject* obj = cdc_row_to_python(rows[i], keys);
+
+        if (!obj)
+        {
+            Py_CLEAR(list);
+            break;
+        }
+
+        PyList_SET_ITEM(list, i, obj);
+    }
+
+    Py_XDECREF(keys);
+    return list;
+}
+%}
+
+%extend CDC::Connection {
+%feature("docstring", "read_batch(max_rows=1000, as_dict=False) -> list
+
+Read up to max_rows change events with one call. The network is read and the
+rows are parsed without holding the GIL. Waits for the first event like read()
+and then returns the events that have already arrived. Each event is a tuple
+of the values in field order or, with as_dict, a dict keyed by field name.
+An empty list means that the read timed out or failed, see error().") read_batch;
+
+    PyObject* read_batch(size_t max_rows = 1000, bool as_dict = false)
+    {
+        CDC::RowList rows;
+
+        Py_BEGIN_ALLOW_THREADS
+        $self->readBatch(rows, max_rows);
+        Py_END_ALLOW_THREADS
+
+        return cdc_rows_to_list(rows, as_dict);
+    }
+
+%feature("docstring", "read_available(max_rows=1000, as_dict=False) -> list
+
+Read the change events that are available without waiting, in the same
+format as read_batch(). Never blocks. An empty list with an empty error()
+means that no complete events were available, wait for fd() to become
+readable before calling this again.") read_available;
+
+    PyObject* read_available(size_t max_rows = 1000, bool as_dict = false)
+    {
+        CDC::RowList rows;
+
+        Py_BEGIN_ALLOW_THREADS
+        $self->readAvailable(rows, max_rows);
+        Py_END_ALLOW_THREADS
+
+        return cdc_rows_to_list(rows, as_dict);
+    }
+}
+
+%{
+static PyObject* cdc_buffer_to_bytes(const void* data, size_t size)
+{
+    return PyBytes_FromStringAndSize(size ? static_cast<const char*>(data) : "", size);
+}
+
+// Formats a scaled DECIMAL value as a string
+static PyObject* cdc_decimal_to_python(CDC::Int128 value, int scale)
+{
+    char buf[64];
+    char* ptr = buf + sizeof(buf);
+    bool negative = value < 0;
+    unsigned __int128 v = negative ? -(unsigned __int128)value : value;
+    int digits = 0;
+
+    do
+    {
+        *--ptr = '0' + (int)(v % 10);
+        v /= 10;
+
+        if (++digits == scale)
+        {
+            *--ptr = '.';
+        }
+    }
+    while (v || digits <= scale);
+
+    if (negative)
+    {
+        *--ptr = '-';
+    }
+
+    return PyUnicode_FromStringAndSize(ptr, buf + sizeof(buf) - ptr);
+}
+%}
+
+%extend CDC::Column {
+%feature("docstring", "values_buffer() -> bytes
+
+The values of an INT64, DATETIME or DOUBLE column as native 64-bit integers or
+doubles, suitable for numpy.frombuffer. The values of a DECIMAL column as
+native 128-bit integers. Empty for STRING columns.
+
+This and the other buffer functions return a copy. A view of the column
+memory would not stay valid: read_columns() refills the same Batch, which
+changes the values and frees the memory. Use batch_to_arrow() to hand the
+buffers over without copying.") values_buffer;
+
+    PyObject* values_buffer() const
+    {
+        if ($self->type() == CDC::Column::INT64 || $self->type() == CDC::Column::DATETIME)
+        {
+            return cdc_buffer_to_bytes($self->ints().data(), $self->ints().size() * sizeof(int64_t));
+        }
+        else if ($self->type() == CDC::Column::DOUBLE)
+        {
+            return cdc_buffer_to_bytes($self->doubles().data(), $self->doubles().size() * sizeof(double));
+        }
+        else if ($self->type() == CDC::Column::DECIMAL)
+        {
+            return cdc_buffer_to_bytes($self->decimals().data(), $self->decimals().size() * sizeof(CDC::Int128));
+        }
+
+        return cdc_buffer_to_bytes(NULL, 0);
+    }
+
+%feature("docstring", "codes_buffer() -> bytes
+
+The dictionary codes of a dictionary encoded STRING column as native 32-bit
+integers. Empty for other columns.") codes_buffer;
+
+    PyObject* codes_buffer() const
+    {
+        return cdc_buffer_to_bytes($self->codes().data(), $self->codes().size() * sizeof(int32_t));
+    }
+
+%feature("docstring", "dictionary_to_list() -> list
+
+The distinct values of a dictionary encoded STRING column as str objects.") dictionary_to_list;
+
+    PyObject* dictionary_to_list() const
+    {
+        size_t n = $self->isDictionary() ? $self->offsets().size() - 1 : 0;
+        PyObject* list = PyList_New(n);
+        const std::vector<int32_t>& offsets = $self->offsets();
+
+        for (size_t i = 0; list && i < n; i++)
+        {
+            PyObject* obj = PyUnicode_DecodeUTF8($self->data().data() + offsets[i],
+                                                 offsets[i + 1] - offsets[i], "replace");
+
+            if (!obj)
+            {
+                Py_CLEAR(list);
+                break;
+            }
+
+            PyList_SET_ITEM(list, i, obj);
+        }
+
+        return list;
+    }
+
+%feature("docstring", "offsets_buffer() -> bytes
+
+The string offsets of a STRING column as native 32-bit integers. For a
+dictionary encoded column, the offsets of the dictionary values.") offsets_buffer;
+
+    PyObject* offsets_buffer() const
+    {
+        return cdc_buffer_to_bytes($self->offsets().data(), $self->offsets().size() * sizeof(int32_t));
+    }
+
+%feature("docstring", "data_buffer() -> bytes
+
+The concatenated values of a STRING column.") data_buffer;
+
+    PyObject* data_buffer() const
+    {
+        return cdc_buffer_to_bytes($self->data().data(), $self->data().size());
+    }
+
+%feature("docstring", "validity_buffer() -> bytes
+
+The validity bitmap, one bit per value in little-endian bit order, set for
+values that are not null.") validity_buffer;
+
+    PyObject* validity_buffer() const
+    {
+        return cdc_buffer_to_bytes($self->validity().data(), $self->validity().size());
+    }
+
+%feature("docstring", "to_list() -> list
+
+The values of the column as int, float or str objects, None for nulls.
+DATETIME values are microseconds since the epoch and DECIMAL values are
+strings.") to_list;
+
+    PyObject* to_list() const
+    {
+        PyObject* list = PyList_New($self->length());
+        const std::vector<int32_t>& offsets = $self->offsets();
+
+        for (size_t i = 0; list && i < $self->length(); i++)
+        {
+            PyObject* obj;
+
+            if ($self->isNull(i))
+            {
+                Py_INCREF(Py_None);
+                obj = Py_None;
+            }
+            else if ($self->type() == CDC::Column::INT64 || $self->type() == CDC::Column::DATETIME)
+            {
+                obj = PyLong_FromLongLong($self->ints()[i]);
+            }
+            else if ($self->type() == CDC::Column::DECIMAL)
+            {
+                obj = cdc_decimal_to_python($self->decimals()[i], $self->scale());
+            }
+            else if ($self->type() == CDC::Column::DOUBLE)
+            {
+                obj = PyFloat_FromDouble($self->doubles()[i]);
+            }
+            else
+            {
+                size_t j = $self->isDictionary() ? $self->codes()[i] : i;
+                obj = PyUnicode_DecodeUTF8($self->data().data() + offsets[j],
+                                           offsets[j + 1] - offsets[j], "replace");
+            }
+
+            if (!obj)
+            {
+                Py_CLEAR(list);
+                break;
+            }
+
+            PyList_SET_ITEM(list, i, obj);
+        }
+
+        return list;
+    }
+}
+
+%extend CDC::Connection {
+%feature("docstring", "read_columns(batch, max_rows=100000) -> int
+
+Read change events into a Batch of typed columns without holding the GIL.
+Reads like read_batch() and returns the number of rows, 0 if the read timed
+out or failed. A schema change ends the batch.") read_columns;
+
+    size_t read_columns(CDC::Batch& batch, size_t max_rows = 100000)
+    {
+        size_t rval;
+
+        Py_BEGIN_ALLOW_THREADS
+        rval = $self->readBatch(batch, max_rows);
+        Py_END_ALLOW_THREADS
+
+        return rval;
+    }
+}
+
+%extend CDC::Connection {
+    // Whether the connection was closed or a replay reached the end of its recording
+    bool _finished() const
+    {
+        return $self->fd() == -1 || $self->error() == CDC::END_OF_STREAM;
+    }
+}
+
+%extend CDC::Batch {
+    void _export_arrow(uintptr_t schema, uintptr_t array)
+    {
+        $self->exportArrow(reinterpret_cast<ArrowSchema*>(schema), reinterpret_cast<ArrowArray*>(array));
+    }
+}
+
+%pythoncode %{
+def column_to_numpy(column):
+    """Convert a Column into a (values, mask) pair of NumPy arrays
+
+    INT64, DOUBLE and DATETIME columns become read-only int64, float64 and
+    datetime64[us] arrays backed by a copy of the column buffer, DECIMAL
+    columns become object arrays of decimal.Decimal and STRING columns object
+    arrays of str. The mask is a boolean array that is True for null values.
+
+    The buffers are copied once on purpose, the arrays must stay valid after
+    the batch is read into again, see Column.values_buffer(). DECIMAL values
+    are converted through their string form, which decimal.Decimal parses
+    exactly. Use batch_to_arrow() to convert a batch without copying.
+    """
+    import decimal
+    import numpy
+
+    n = column.length()
+
+    if column.type() == Column_INT64:
+        values = numpy.frombuffer(column.values_buffer(), dtype=numpy.int64)
+    elif column.type() == Column_DOUBLE:
+        values = numpy.frombuffer(column.values_buffer(), dtype=numpy.float64)
+    elif column.type() == Column_DATETIME:
+        values = numpy.frombuffer(column.values_buffer(), dtype=numpy.int64).view("datetime64[us]")
+    elif column.type() == Column_DECIMAL:
+        values = numpy.array([None if v is None else decimal.Decimal(v) for v in column.to_list()],
+                             dtype=object)
+    else:
+        values = numpy.array(column.to_list(), dtype=object)
+
+    validity = numpy.frombuffer(column.validity_buffer(), dtype=numpy.uint8)
+    mask = numpy.unpackbits(validity, bitorder="little")[:n] == 0
+    return values, mask
+
+
+def batch_to_dataframe(batch):
+    """Convert a Batch into a pandas DataFrame
+
+    Integer columns with nulls use the nullable Int64 type, double columns
+    use NaN and DATETIME columns NaT for nulls. Dictionary encoded columns
+    become categoricals.
+    """
+    import numpy
+    import pandas
+
+    data = {}
+
+    for i in range(batch.columns()):
+        column = batch.column(i)
+
+        if column.isDictionary():
+            codes = numpy.frombuffer(column.codes_buffer(), dtype=numpy.int32).copy()
+            validity = numpy.frombuffer(column.validity_buffer(), dtype=numpy.uint8)
+            codes[numpy.unpackbits(validity, bitorder="little")[:len(codes)] == 0] = -1
+            data[column.name()] = pandas.Categorical.from_codes(codes, column.dictionary_to_list())
+            continue
+
+        values, mask = column_to_numpy(column)
+
+        if mask.any() and column.type() == Column_INT64:
+            values = pandas.arrays.IntegerArray(values.copy(), mask)
+        elif mask.any() and column.type() == Column_DOUBLE:
+            values = numpy.where(mask, numpy.nan, values)
+        elif mask.any() and column.type() == Column_DATETIME:
+            values = numpy.where(mask, numpy.datetime64("NaT"), values)
+
+        data[column.name()] = values
+
+    return pandas.DataFrame(data)
+
+
+def batch_to_arrow(batch):
+    """Convert a Batch into a pyarrow RecordBatch without copying the values
+
+    The column buffers are moved to Arrow, the batch is empty afterwards.
+    """
+    import pyarrow
+    from pyarrow.cffi import ffi
+
+    c_schema = ffi.new("struct ArrowSchema*")
+    c_array = ffi.new("struct ArrowArray*")
+    schema_ptr = int(ffi.cast("uintptr_t", c_schema))
+    array_ptr = int(ffi.cast("uintptr_t", c_array))
+    batch._export_arrow(schema_ptr, array_ptr)
+    return pyarrow.RecordBatch._import_from_c(array_ptr, schema_ptr)
+
+
+class AsyncConnection(object):
+    """asyncio wrapper of a connected Connection
+
+    The rows are read when the socket of the connection becomes readable, so
+    one event loop can follow many streams without threads. The connection
+    must be connected with connect() before it is wrapped and it must not use
+    a spool.
+    """
+
+    def __init__(self, connection, max_rows=1000, as_dict=False):
+        self.connection = connection
+        self.max_rows = max_rows
+        self.as_dict = as_dict
+        self._rows = []
+
+    async def read_batch(self):
+        """Wait for change events and return the ones that have arrived
+
+        Returns a list in the same format as Connection.read_batch(). Raises
+        an IOError if the stream fails.
+        """
+        import asyncio
+
+        while True:
+            rows = self.connection.read_available(self.max_rows, self.as_dict)
+
+            if rows:
+                return rows
+            elif self.connection.error():
+                raise IOError(self.connection.error())
+
+            fd = self.connection.fd()
+
+            if fd == -1:
+                raise IOError("Connection is not open")
+
+            loop = asyncio.get_running_loop()
+            readable = loop.create_future()
+            loop.add_reader(fd, lambda: readable.done() or readable.set_result(None))
+
+            try:
+                await readable
+            finally:
+                loop.remove_reader(fd)
+
+    async def read(self):
+        """Wait for the next change event and return it"""
+        if not self._rows:
+            self._rows = await self.read_batch()
+            self._rows.reverse()
+
+        return self._rows.pop()
+
+    def __aiter__(self):
+        return self
+
+    async def __anext__(self):
+        """Wait for the next change event, the iteration stops when the
+        connection is closed or a replay reaches its end"""
+        if not self._rows and self.connection._finished():
+            raise StopAsyncIteration
+
+        try:
+            return await self.read()
+        except IOError:
+            if self.connection._finished():
+                raise StopAsyncIteration
+            raise
+%}
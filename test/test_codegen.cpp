@@ -0,0 +1,170 @@
+/* Copyright (c) 2017, MariaDB Corporation. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301  USA
+ */
+
+/**
+ * Tests for a decoder generated by cdc_codegen from test/codegen.avsc, run
+ * against the mock server. The path of the schema file is the only argument.
+ */
+
+#include "../cdc_connector.h"
+#include "../mock/mock_server.h"
+#include "codegen_table.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#define CHECK(expr) \
+    do \
+    { \
+        if (!(expr)) \
+        { \
+            std::cout << __FILE__ << ":" << __LINE__ << ": " << #expr << std::endl; \
+            return false; \
+        } \
+    } \
+    while (false)
+
+static const char TABLE[] = "test.t1";
+static const char STREAM_FILE[] = "test_codegen_stream.json";
+
+namespace
+{
+
+// Counts the events that were read from their text
+class CountingDecoder: public TableDecoder
+{
+public:
+    CountingDecoder():
+        fast(0)
+    {
+    }
+
+    bool decodeLine(const std::string& line, CDC::EventInfo& info)
+    {
+        bool rval = TableDecoder::decodeLine(line, info);
+        fast += rval;
+        return rval;
+    }
+
+    int fast;
+};
+
+struct Expected
+{
+    bool        fast;   // Whether the event can be read from its text
+    int64_t     id;
+    const char* name;   // NULL for a null value
+    double      price;
+    int         flag;   // -1 for a null value
+};
+
+bool test_decoder(uint16_t port)
+{
+    static const Expected expected[] =
+    {
+        {false, 1, "a", 1.5, 1},            // Read ahead and parsed by connect()
+        {true, 2, NULL, -2, 0},
+        {true, 3, "c", 0.25, -1},
+        {false, 4, "d \"quoted\"", 4, 1},   // Escaped strings need the parser
+        {false, 5, "e", 5, 0},              // So do fields that are out of order
+        {true, 6, "f", 6, 1},
+    };
+
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CHECK(conn.connect(TABLE));
+    CountingDecoder decoder;
+    int fast = 0;
+
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++)
+    {
+        const Expected& e = expected[i];
+        CHECK(conn.read(decoder));
+        fast += e.fast;
+        CHECK(decoder.fast == fast);
+
+        const TableRow& row = decoder.value();
+        CHECK(row.sequence == (int64_t)i + 1);
+        CHECK(row.event_type == "insert");
+        CHECK(row.id == e.id);
+        CHECK(row.name_null == (e.name == NULL));
+        CHECK(row.name == (e.name ? e.name : ""));
+        CHECK(row.price == e.price);
+        CHECK(row.flag_null == (e.flag == -1));
+        CHECK(row.flag == (e.flag == 1));
+    }
+
+    CHECK(conn.error().empty());
+    return true;
+}
+
+std::string event(int sequence, const std::string& values)
+{
+    std::stringstream ss;
+    ss << "{\"domain\": 0, \"server_id\": 3000, \"sequence\": " << sequence << ", \"event_number\": 1, "
+       << "\"timestamp\": 1500000000, \"event_type\": \"insert\", " << values << "}\n";
+    return ss.str();
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    std::ifstream schema(argc > 1 ? argv[1] : "");
+    std::string line;
+
+    if (!std::getline(schema, line))
+    {
+        std::cout << "Usage: test_codegen SCHEMA_FILE" << std::endl;
+        return 1;
+    }
+
+    std::ofstream file(STREAM_FILE);
+    file << line << "\n"
+         << event(1, "\"id\": 1, \"name\": \"a\", \"price\": 1.5, \"flag\": true")
+         << event(2, "\"id\": 2, \"name\": null, \"price\": -2, \"flag\": false")
+         << event(3, "\"id\": 3, \"name\": \"c\", \"price\": 0.25, \"flag\": null")
+         << event(4, "\"id\": 4, \"name\": \"d \\\"quoted\\\"\", \"price\": 4, \"flag\": true")
+         << event(5, "\"id\": 5, \"name\": \"e\", \"flag\": false, \"price\": 5")
+         << event(6, "\"id\": 6, \"name\": \"f\", \"price\": 6.0, \"flag\": true");
+    file.close();
+
+    if (!file)
+    {
+        std::cout << "Failed to write " << STREAM_FILE << std::endl;
+        return 1;
+    }
+
+    CDC::MockConfig config;
+    config.file = STREAM_FILE;
+    CDC::MockServer server(config);
+    bool ok = server.start();
+
+    if (!ok)
+    {
+        std::cout << server.error() << std::endl;
+    }
+    else
+    {
+        ok = test_decoder(server.port());
+    }
+
+    std::cout << "generated decoder: " << (ok ? "OK" : "FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
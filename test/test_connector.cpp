@@ -0,0 +1,1923 @@
+/* Copyright (c) 2017, MariaDB Corporation. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301  USA
+ */
+
+/**
+ * Tests for the connector, run against the mock server
+ */
+
+#include "../cdc_connector.h"
+#include "../mock/mock_server.h"
+
+#include <algorithm>
+#include <ctype.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <poll.h>
+#include <pthread.h>
+#include <set>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#define CHECK(expr) \
+    do \
+    { \
+        if (!(expr)) \
+        { \
+            std::cout << __FILE__ << ":" << __LINE__ << ": " << #expr << std::endl; \
+            return false; \
+        } \
+    } \
+    while (false)
+
+static const char TABLE[] = "test.t1";
+static const char CHECKPOINT_FILE[] = "test_connector.checkpoint";
+static const char STREAM_FILE[] = "test_connector.stream";
+static const char CAPTURE_SOURCE[] = "test_connector.source";
+static const char SPOOL_DIR[] = "test_connector.spool";
+
+namespace
+{
+
+std::string gtid(uint64_t sequence)
+{
+    std::stringstream ss;
+    ss << "0-3000-" << sequence;
+    return ss.str();
+}
+
+std::string to_string(uint64_t value)
+{
+    std::stringstream ss;
+    ss << value;
+    return ss.str();
+}
+
+// The value of a string column of a generated row, see the mock server
+std::string string_value(const CDC::MockConfig& config, uint64_t id, int column, uint64_t version)
+{
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz";
+    std::string rval;
+
+    for (size_t i = 0; i < config.string_size; i++)
+    {
+        rval += alphabet[(id + column + version + i) % 26];
+    }
+
+    return rval;
+}
+
+// The rows that exist at the end of a generated stream, mapped to their number of updates
+std::map<uint64_t, uint64_t> final_rows(const CDC::MockConfig& config)
+{
+    std::map<uint64_t, uint64_t> rows;
+    uint64_t inserts = 0;
+    bool live = false;
+
+    for (uint64_t n = 1; n <= config.rows; n++)
+    {
+        if (live && config.delete_every && n % config.delete_every == 0)
+        {
+            rows.erase(inserts - 1);
+            live = false;
+        }
+        else if (live && config.update_every && n % config.update_every == 0)
+        {
+            rows[inserts - 1]++;
+        }
+        else
+        {
+            rows[inserts++] = 0;
+            live = true;
+        }
+    }
+
+    return rows;
+}
+
+int column_index(const CDC::Batch& batch, const std::string& name)
+{
+    for (size_t i = 0; i < batch.columns(); i++)
+    {
+        if (batch.column(i).name() == name)
+        {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+std::string to_string(CDC::Int128 value)
+{
+    unsigned __int128 u = value < 0 ? -(unsigned __int128)value : value;
+    std::string rval;
+
+    do
+    {
+        rval.insert(rval.begin(), '0' + (int)(u % 10));
+        u /= 10;
+    }
+    while (u);
+
+    return value < 0 ? "-" + rval : rval;
+}
+
+// The metadata fields of a schema, see the mock server
+std::string schema_line(const std::string& fields)
+{
+    return "{\"namespace\": \"MaxScaleChangeDataSchema.avro\", \"type\": \"record\", "
+           "\"name\": \"ChangeRecord\", \"fields\": ["
+           "{\"name\": \"domain\", \"type\": \"int\"}, "
+           "{\"name\": \"server_id\", \"type\": \"int\"}, "
+           "{\"name\": \"sequence\", \"type\": \"int\"}, "
+           "{\"name\": \"event_number\", \"type\": \"int\"}, "
+           "{\"name\": \"timestamp\", \"type\": \"int\"}, "
+           "{\"name\": \"event_type\", \"type\": {\"type\": \"enum\", \"name\": \"EVENT_TYPES\", "
+           "\"symbols\": [\"insert\", \"update_before\", \"update_after\", \"delete\"]}}, " + fields + "]}\n";
+}
+
+// An insert event with the given values
+std::string event_line(uint64_t sequence, const std::string& values, uint64_t timestamp = 1500000000)
+{
+    return "{\"domain\": 0, \"server_id\": 3000, \"sequence\": " + to_string(sequence) +
+           ", \"event_number\": 1, \"timestamp\": " + to_string(timestamp) + ", \"event_type\": \"insert\", " +
+           values + "}\n";
+}
+
+bool write_file(const char* path, const std::string& contents)
+{
+    std::ofstream file(path);
+    file << contents;
+    return file.good();
+}
+
+struct DecimalCase
+{
+    const char* str;
+    int         precision;
+    int         scale;
+    const char* expected;   // The unscaled value, NULL if the value is rejected
+};
+
+bool test_parse_decimal()
+{
+    static const DecimalCase cases[] =
+    {
+        {"0", 10, 2, "0"},
+        {"1.005", 10, 2, "101"},
+        {"-1.005", 10, 2, "-101"},
+        {"1.004", 10, 2, "100"},
+        {"-0.5", 10, 0, "-1"},
+        {"0.49", 10, 0, "0"},
+        {"+12", 10, 2, "1200"},
+        {"12.", 10, 2, "1200"},
+        {".25", 10, 2, "25"},
+        {"-.25", 10, 2, "-25"},
+        {"00001.5", 5, 2, "150"},
+        {"0.00005", 10, 4, "1"},
+        {"999.99", 5, 2, "99999"},
+        {"-999.99", 5, 2, "-99999"},
+        {"999.994", 5, 2, "99999"},
+        {"1000", 5, 2, NULL},
+        {"-1000", 5, 2, NULL},
+        {"999.995", 5, 2, NULL},
+        {"-999.995", 5, 2, NULL},
+        {"0.12345", 5, 5, "12345"},
+        {"0.999995", 5, 5, NULL},
+        {"1", 5, 5, NULL},
+        {"99999999999999999999999999999999999999", 38, 0, "99999999999999999999999999999999999999"},
+        {"-99999999999999999999999999999999999999", 38, 0, "-99999999999999999999999999999999999999"},
+        {"100000000000000000000000000000000000000", 38, 0, NULL},
+        {"9999999999999999999999999999999999999.95", 38, 1, NULL},
+        {"1234567890123456789012345678.1234567891", 38, 10, "12345678901234567890123456781234567891"},
+        {"1e5", 10, 2, NULL},
+        {"1.5E2", 10, 2, NULL},
+        {"", 10, 2, NULL},
+        {".", 10, 2, NULL},
+        {"-", 10, 2, NULL},
+        {"1.2.3", 10, 2, NULL},
+        {"12a", 10, 2, NULL},
+        {" 12", 10, 2, NULL},
+        {"abc", 10, 2, NULL},
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        const DecimalCase& c = cases[i];
+        CDC::Int128 value = 0;
+        bool ok = CDC::parse_decimal(c.str, strlen(c.str), c.precision, c.scale, value);
+
+        if (ok != (c.expected != NULL) || (ok && to_string(value) != c.expected))
+        {
+            std::cout << "parse_decimal(\"" << c.str << "\", " << c.precision << ", " << c.scale << "): "
+                      << (ok ? to_string(value) : "rejected") << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+struct DatetimeCase
+{
+    const char* str;
+    bool        ok;
+    int64_t     expected;   // Microseconds since the epoch
+};
+
+bool test_parse_datetime()
+{
+    static const DatetimeCase cases[] =
+    {
+        {"1970-01-01", true, 0},
+        {"1970-01-01 00:00:01.5", true, 1500000},
+        {"1970-01-01 00:00:00.000001", true, 1},
+        {"1969-12-31 23:59:59.999999", true, -1},
+        {"2017-07-14 02:40:00", true, 1500000000000000LL},
+        {"2017-07-14T02:40:00", true, 1500000000000000LL},
+        {"2017-07-14 02:40:00.123", true, 1500000000123000LL},
+        {"2000-02-29", true, 951782400000000LL},
+        {"9999-12-31 23:59:59.999999", true, 253402300799999999LL},
+        {"0001-01-01", true, -62135596800000000LL},
+        {"0000-00-00", false, 0},
+        {"0000-00-00 00:00:00", false, 0},
+        {"2017-00-10", false, 0},
+        {"2017-07-00", false, 0},
+        {"1900-02-29", false, 0},
+        {"2001-02-29", false, 0},
+        {"2017-04-31", false, 0},
+        {"2017-13-01", false, 0},
+        {"2017-07-14 24:00:00", false, 0},
+        {"2017-07-14 23:60:00", false, 0},
+        {"2017-07-14 23:59:60", false, 0},
+        {"2017-07-14 02:40", false, 0},
+        {"2017-07-14 02:40:00.", false, 0},
+        {"2017-07-14 02:40:00.1234567", false, 0},
+        {"2017-07-14 02:40:00.12a", false, 0},
+        {"2017-07-14X02:40:00", false, 0},
+        {"2017/07/14", false, 0},
+        {"17-07-14", false, 0},
+        {"", false, 0},
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        const DatetimeCase& c = cases[i];
+        int64_t value = 0;
+        bool ok = CDC::parse_datetime(c.str, strlen(c.str), value);
+
+        if (ok != c.ok || (ok && value != c.expected))
+        {
+            std::cout << "parse_datetime(\"" << c.str << "\"): " << (ok ? to_string((uint64_t)value) : "rejected")
+                      << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// DECIMAL and DATETIME values stored into the columns of a batch
+bool test_typed_columns(uint16_t port, const CDC::MockConfig&)
+{
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CHECK(conn.connect(TABLE));
+
+    CDC::Batch batch;
+    CHECK(conn.readBatch(batch, 10) == 6);
+
+    int d = column_index(batch, "d");
+    int r = column_index(batch, "r");
+    int dt = column_index(batch, "dt");
+    CHECK(d != -1 && r != -1 && dt != -1);
+
+    const CDC::Column& dc = batch.column(d);
+    CHECK(dc.type() == CDC::Column::DECIMAL);
+    CHECK(dc.precision() == 10 && dc.scale() == 4);
+
+    // String values are parsed exactly, values that do not fit are null
+    static const char* decimals[] = {"-1234567891", "1", NULL, NULL, "0", "100000000"};
+
+    for (size_t i = 0; i < batch.length(); i++)
+    {
+        CHECK(dc.isNull(i) == (decimals[i] == NULL));
+        CHECK(dc.isNull(i) || to_string(dc.decimals()[i]) == decimals[i]);
+    }
+
+    // Numbers, with or without an exponent, are rounded to the scale
+    const CDC::Column& rc = batch.column(r);
+    CHECK(rc.type() == CDC::Column::DECIMAL);
+    CHECK(rc.precision() == 8 && rc.scale() == 2);
+    static const char* reals[] = {"12345", "-1", NULL, "150", NULL, "-99999999"};
+
+    for (size_t i = 0; i < batch.length(); i++)
+    {
+        CHECK(rc.isNull(i) == (reals[i] == NULL));
+        CHECK(rc.isNull(i) || to_string(rc.decimals()[i]) == reals[i]);
+    }
+
+    // Zero dates and invalid dates are null
+    const CDC::Column& tc = batch.column(dt);
+    CHECK(tc.type() == CDC::Column::DATETIME);
+    static const int64_t datetimes[] = {1500000000500000LL, -1, 0, 0, 951782400000000LL, 1};
+    static const bool null_datetimes[] = {false, false, true, true, false, false};
+
+    for (size_t i = 0; i < batch.length(); i++)
+    {
+        CHECK(tc.isNull(i) == null_datetimes[i]);
+        CHECK(tc.isNull(i) || tc.ints()[i] == datetimes[i]);
+    }
+
+    return true;
+}
+
+bool test_read_transaction(uint16_t port, const CDC::MockConfig& config)
+{
+    remove(CHECKPOINT_FILE);
+    CDC::CheckpointStore store(CHECKPOINT_FILE);
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    conn.setCheckpointStore(&store);
+    CHECK(conn.connect(TABLE));
+
+    uint64_t n_trx = 0;
+    uint64_t n_rows = 0;
+    int timeouts = 0;
+    uint64_t complete = config.rows / config.rows_per_trx - 1;
+    CDC::Transaction trx;
+
+    while (n_trx < complete)
+    {
+        if (!(trx = conn.readTransaction()))
+        {
+            // The stream pauses in the middle of transactions, only the
+            // returned ones are checkpointed
+            CHECK(conn.error() == CDC::TIMEOUT);
+            CHECK(++timeouts < 10);
+            CHECK(store.gtid() == (n_trx > 0 ? gtid(n_trx) : ""));
+            continue;
+        }
+
+        n_trx++;
+        CHECK(trx->gtid() == gtid(n_trx));
+        CHECK(trx->length() == config.rows_per_trx);
+
+        for (size_t i = 0; i < trx->length(); i++)
+        {
+            CHECK(trx->row(i)->gtid() == trx->gtid());
+            CHECK(trx->row(i)->value("i0") == to_string(n_rows++));
+        }
+    }
+
+    CHECK(timeouts >= 2);
+
+    // The last transaction is not known to be complete
+    CHECK(!conn.readTransaction());
+    CHECK(conn.error() == CDC::TIMEOUT);
+    CHECK(store.gtid() == gtid(complete));
+
+    remove(CHECKPOINT_FILE);
+    return true;
+}
+
+bool test_update_pairing(uint16_t port, const CDC::MockConfig& config)
+{
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    conn.setUpdatePairing(true);
+    CHECK(conn.connect(TABLE));
+
+    uint64_t inserts = 0;
+    uint64_t updates = 0;
+    CDC::Row row;
+
+    while ((row = conn.read()))
+    {
+        const std::string& type = row->value("event_type");
+
+        if (type == "insert")
+        {
+            CHECK(!row->paired());
+            CHECK(row->value("i0") == to_string(inserts++));
+            continue;
+        }
+
+        CHECK(type == "update");
+        CHECK(row->paired());
+        updates++;
+
+        for (size_t i = 0; i < row->length(); i++)
+        {
+            // The generated columns are named i0, i1, ... and s0, s1, ...
+            const std::string& key = row->key(i);
+
+            if (!isdigit(key[1]))
+            {
+                continue;
+            }
+            else if (key[0] == 'i')
+            {
+                CHECK(!row->changed(i));
+                CHECK(row->before(i) == row->value(i));
+            }
+            else if (key[0] == 's')
+            {
+                int column = key[1] - '0';
+                CHECK(row->changed(i));
+                CHECK(row->before(i) == string_value(config, inserts - 1, column, 0));
+                CHECK(row->value(i) == string_value(config, inserts - 1, column, 1));
+            }
+        }
+    }
+
+    CHECK(conn.error() == CDC::TIMEOUT);
+    CHECK(inserts == 20);
+    CHECK(updates == 10);
+    return true;
+}
+
+// Waits up to a second for a connection started with connectAsync() and does
+// the I/O it needs. At most max rows are read into rows.
+bool poll_async(CDC::Connection& conn, CDC::RowList& rows, size_t max, bool& idle)
+{
+    struct pollfd pfd = {conn.fd(), POLLIN, 0};
+
+    if (conn.wantsWrite())
+    {
+        pfd.events |= POLLOUT;
+    }
+
+    int rc = poll(&pfd, 1, 1000);
+    idle = rc == 0;
+
+    if (rc == -1 ||
+        ((pfd.revents & POLLOUT) && !conn.onWritable()) ||
+        ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) && !conn.onReadable()))
+    {
+        std::cout << conn.error() << std::endl;
+        return false;
+    }
+
+    CDC::Row row;
+
+    while (rows.size() < max && (row = conn.readBuffered()))
+    {
+        rows.push_back(row);
+    }
+
+    if (!conn.error().empty())
+    {
+        std::cout << conn.error() << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+// Reads from a connection started with connectAsync() until the stream is idle
+bool read_async(CDC::Connection& conn, CDC::RowList& rows)
+{
+    bool idle = false;
+
+    while (!idle)
+    {
+        if (!poll_async(conn, rows, SIZE_MAX, idle))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool test_async_reconnect(uint16_t port, const CDC::MockConfig& config)
+{
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CHECK(conn.connectAsync(TABLE));
+    CHECK(conn.wantsWrite());
+
+    // Read one row, the rest of what has arrived stays buffered
+    CDC::RowList rows;
+    bool idle = false;
+
+    while (rows.empty())
+    {
+        CHECK(poll_async(conn, rows, 1, idle));
+        CHECK(!idle);
+    }
+
+    CHECK(rows[0]->value("i0") == "0");
+
+    // The new connection starts from the beginning of the stream
+    int old_fd = conn.fd();
+    CHECK(conn.connectAsync(TABLE));
+    CHECK(conn.fd() == old_fd || fcntl(old_fd, F_GETFD) == -1);
+
+    rows.clear();
+    CHECK(read_async(conn, rows));
+    CHECK(rows.size() == config.rows);
+
+    for (size_t i = 0; i < rows.size(); i++)
+    {
+        CHECK(rows[i]->value("i0") == to_string(i));
+    }
+
+    return true;
+}
+
+bool test_buffered_pairing(uint16_t port, const CDC::MockConfig& config)
+{
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    conn.setUpdatePairing(true);
+    CHECK(conn.connectAsync(TABLE));
+
+    CDC::RowList rows;
+    CHECK(read_async(conn, rows));
+
+    uint64_t inserts = 0;
+    uint64_t updates = 0;
+
+    for (CDC::RowList::iterator it = rows.begin(); it != rows.end(); it++)
+    {
+        CDC::Row row = *it;
+
+        if (row->value("event_type") == "insert")
+        {
+            CHECK(row->value("i0") == to_string(inserts++));
+        }
+        else
+        {
+            CHECK(row->value("event_type") == "update");
+            CHECK(row->paired());
+            CHECK(row->value("s0") == string_value(config, inserts - 1, 0, 1));
+            updates++;
+        }
+    }
+
+    CHECK(inserts == 20);
+    CHECK(updates == 10);
+    CHECK(conn.stats().rows() == 40);
+    return true;
+}
+
+// A stream that starts with a before image that has no after image
+bool test_buffered_unpaired(uint16_t port, const CDC::MockConfig&)
+{
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    conn.setUpdatePairing(true);
+    CHECK(conn.connectAsync(TABLE));
+
+    CDC::RowList rows;
+    CHECK(read_async(conn, rows));
+    CHECK(rows.size() == 3);
+    CHECK(rows[0]->value("event_type") == "update_before");
+    CHECK(!rows[0]->paired());
+    CHECK(rows[1]->value("event_type") == "insert");
+    CHECK(rows[2]->value("event_type") == "insert");
+
+    // Each row is delivered once
+    CHECK(conn.stats().lagTime().count() == 3);
+    return true;
+}
+
+bool test_coalescer(uint16_t port, const CDC::MockConfig& config)
+{
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CHECK(conn.connect(TABLE));
+
+    CDC::Coalescer coalescer(conn, CDC::ValueList(1, "i0"), 1000, 10000);
+    std::map<uint64_t, uint64_t> expected = final_rows(config);
+    std::map<uint64_t, uint64_t> found;
+    CDC::Row row;
+
+    while ((row = coalescer.read()))
+    {
+        // Every row is inserted inside the window, only the final values remain
+        uint64_t id = strtoull(row->value("i0").c_str(), NULL, 10);
+        CHECK(row->value("event_type") == "insert");
+        CHECK(expected.count(id) == 1);
+        CHECK(found.count(id) == 0);
+        CHECK(row->value("s0") == string_value(config, id, 0, expected[id]));
+        found[id] = expected[id];
+    }
+
+    CHECK(coalescer.error() == CDC::TIMEOUT);
+    CHECK(found == expected);
+    return true;
+}
+
+bool test_materialized_table(uint16_t port, const CDC::MockConfig& config)
+{
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CHECK(conn.connect(TABLE));
+
+    CDC::MaterializedTable table(conn, CDC::ValueList(1, "i0"), 4);
+    uint64_t n_trx = 0;
+
+    while (table.ingest())
+    {
+        n_trx++;
+        CHECK(table.gtid() == gtid(n_trx));
+    }
+
+    // The last transaction is not known to be complete
+    CHECK(table.error() == CDC::TIMEOUT);
+    CHECK(n_trx == config.rows / config.rows_per_trx - 1);
+
+    CDC::MockConfig applied = config;
+    applied.rows = n_trx * config.rows_per_trx;
+    std::map<uint64_t, uint64_t> expected = final_rows(applied);
+    CHECK(table.size() == expected.size());
+
+    CDC::ValueList columns = table.columns();
+    size_t s0 = std::find(columns.begin(), columns.end(), "s0") - columns.begin();
+    CHECK(s0 < columns.size());
+    CHECK(std::find(columns.begin(), columns.end(), "x0") != columns.end());
+
+    std::vector<CDC::ValueList> keys;
+    CDC::ValueList values;
+
+    for (uint64_t id = 0; id <= expected.rbegin()->first; id++)
+    {
+        bool found = table.lookup(CDC::ValueList(1, to_string(id)), values);
+        CHECK(found == (expected.count(id) == 1));
+
+        if (found)
+        {
+            CHECK(values.size() == columns.size());
+            CHECK(values[s0] == string_value(config, id, 0, expected[id]));
+        }
+
+        keys.push_back(CDC::ValueList(1, to_string(id)));
+    }
+
+    // A snapshot of all rows sees the same values
+    std::vector<CDC::ValueList> rows;
+    std::string snapshot_gtid;
+    CHECK(table.lookup(keys, rows, &snapshot_gtid) == expected.size());
+    CHECK(snapshot_gtid == gtid(n_trx));
+
+    for (size_t i = 0; i < rows.size(); i++)
+    {
+        CHECK(rows[i].empty() == (expected.count(i) == 0));
+    }
+
+    return true;
+}
+
+bool test_materialized_table_error(uint16_t port, const CDC::MockConfig&)
+{
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CHECK(conn.connect(TABLE));
+
+    // A transaction without the key cannot be applied, the error is permanent
+    CDC::MaterializedTable table(conn, CDC::ValueList(1, "no_such_column"));
+    CHECK(!table.ingest());
+    std::string error = table.error();
+    CHECK(error.find("no_such_column") != std::string::npos);
+    CHECK(!table.ingest());
+    CHECK(table.error() == error);
+    CHECK(table.size() == 0);
+    CHECK(table.gtid().empty());
+
+    // The second call did not read from the connection
+    CDC::Transaction trx = conn.readTransaction();
+    CHECK(trx);
+    CHECK(trx->gtid() == gtid(2));
+    return true;
+}
+
+bool test_batch(uint16_t port, const CDC::MockConfig& config)
+{
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CHECK(conn.connect(TABLE));
+
+    CDC::Batch batch;
+    uint64_t n_rows = 0;
+    size_t n;
+
+    while ((n = conn.readBatch(batch, 64)))
+    {
+        CHECK(batch.length() == n);
+        int i0 = column_index(batch, "i0");
+        int s0 = column_index(batch, "s0");
+        CHECK(i0 != -1 && s0 != -1);
+        CHECK(batch.column(i0).type() == CDC::Column::INT64);
+        CHECK(batch.column(s0).type() == CDC::Column::STRING);
+
+        for (size_t i = 0; i < n; i++)
+        {
+            CHECK(batch.column(i0).ints()[i] == (int64_t)n_rows);
+            CHECK(batch.column(s0).stringValue(i) == string_value(config, n_rows, 0, 0));
+            n_rows++;
+        }
+    }
+
+    CHECK(conn.error() == CDC::TIMEOUT);
+    CHECK(n_rows == config.rows);
+
+    // The same stream read as rows
+    CHECK(conn.connect(TABLE));
+    CDC::RowList rows;
+    n_rows = 0;
+
+    while ((n = conn.readBatch(rows, 64)))
+    {
+        CHECK(rows.size() == n);
+
+        for (size_t i = 0; i < n; i++)
+        {
+            CHECK(rows[i]->value("i0") == to_string(n_rows++));
+        }
+    }
+
+    CHECK(conn.error() == CDC::TIMEOUT);
+    CHECK(n_rows == config.rows);
+    return true;
+}
+
+bool test_checkpoint(uint16_t port)
+{
+    remove(CHECKPOINT_FILE);
+    CDC::CheckpointStore store(CHECKPOINT_FILE);
+
+    {
+        CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+        conn.setCheckpointStore(&store);
+        CHECK(conn.connect(TABLE));
+
+        while (conn.read())
+        {
+            ;
+        }
+
+        CHECK(conn.error() == CDC::TIMEOUT);
+    }
+
+    // The last transaction is not known to be complete until the next one starts
+    CHECK(store.gtid() == gtid(9));
+
+    std::ifstream file(CHECKPOINT_FILE);
+    std::string stored;
+    std::getline(file, stored);
+    CHECK(stored == gtid(9));
+
+    // Without a GTID, the stream resumes from the checkpoint
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    conn.setCheckpointStore(&store);
+    CHECK(conn.connect(TABLE));
+    CDC::Row row = conn.read();
+    CHECK(row);
+    CHECK(row->gtid() == gtid(9));
+
+    remove(CHECKPOINT_FILE);
+    return true;
+}
+
+bool test_batch_checkpoint(uint16_t port, const CDC::MockConfig& config)
+{
+    remove(CHECKPOINT_FILE);
+    CDC::CheckpointStore store(CHECKPOINT_FILE);
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    conn.setCheckpointStore(&store);
+    CHECK(conn.connect(TABLE));
+
+    CDC::Batch batch;
+    uint64_t n_rows = 0;
+    std::string expected;
+
+    while (conn.readBatch(batch, 5))
+    {
+        // The rows of the previous batch were processed when this one was read
+        CHECK(store.gtid() == expected);
+        n_rows += batch.length();
+
+        // The transaction of the last row can continue in the next batch
+        uint64_t last = (n_rows - 1) / config.rows_per_trx + 1;
+        expected = last > 1 ? gtid(last - 1) : "";
+    }
+
+    CHECK(conn.error() == CDC::TIMEOUT);
+    CHECK(store.gtid() == expected);
+    CHECK(n_rows == config.rows);
+
+    remove(CHECKPOINT_FILE);
+    return true;
+}
+
+// The capture holds the stream exactly as it was sent
+bool test_capture(uint16_t port, const CDC::MockConfig& config)
+{
+    std::ifstream sent(config.file.c_str());
+    std::string expected;
+    std::string line;
+    uint64_t n_events = 0;
+
+    while (std::getline(sent, line))
+    {
+        expected += line + "\n";
+        n_events += line.compare(0, 10, "{\"domain\":") == 0;
+    }
+
+    int fd = open(STREAM_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd != -1);
+
+    {
+        CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+        conn.setCapture(fd);
+        CHECK(conn.connect(TABLE));
+        uint64_t n_rows = 0;
+
+        while (conn.read())
+        {
+            n_rows++;
+        }
+
+        CHECK(conn.error() == CDC::TIMEOUT);
+        CHECK(n_rows == n_events);
+    }
+
+    close(fd);
+    std::ifstream captured(STREAM_FILE);
+    std::stringstream ss;
+    ss << captured.rdbuf();
+    CHECK(ss.str() == expected);
+
+    // A capture that cannot be written is a read error
+    fd = open(STREAM_FILE, O_RDONLY);
+    CHECK(fd != -1);
+
+    {
+        CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+        conn.setCapture(fd);
+        CHECK(!conn.connect(TABLE) || !conn.read());
+        CHECK(conn.error().find("Failed to write captured data") != std::string::npos);
+    }
+
+    close(fd);
+    remove(STREAM_FILE);
+    return true;
+}
+
+// The statistics count what was read
+bool test_stats(uint16_t port, const CDC::MockConfig& config)
+{
+    std::string stream = CDC::MockServer::generate(config);
+    uint64_t n_schemas = 0;
+
+    for (size_t pos = 0; (pos = stream.find("{\"namespace\"", pos)) != std::string::npos; pos++)
+    {
+        n_schemas++;
+    }
+
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    const CDC::Stats& stats = conn.stats();
+    CHECK(stats.rows() == 0);
+    CHECK(stats.sinceLastRow() == -1);
+    CHECK(conn.connect(TABLE));
+
+    for (uint64_t i = 0; i < config.rows; i++)
+    {
+        CHECK(conn.read());
+    }
+
+    CHECK(stats.rows() == config.rows);
+    CHECK(stats.schemaChanges() == n_schemas);
+    CHECK(stats.parseTime().count() == config.rows);
+    CHECK(stats.buildTime().count() == config.rows);
+    CHECK(stats.bufferHighWater() > 0);
+    CHECK(stats.sinceLastRow() >= 0 && stats.sinceLastRow() < 1000);
+
+    // The stream has ended, the next read times out
+    CHECK(!conn.read());
+    CHECK(conn.error() == CDC::TIMEOUT);
+    CHECK(stats.rows() == config.rows);
+    CHECK(stats.sinceLastRow() >= 500);
+
+    // The stream and the small responses of the handshake. The timestamps of
+    // the generated stream have the same length every time.
+    CHECK(stats.bytes() > stream.size() && stats.bytes() < stream.size() + 100);
+    CHECK(stats.pollWakeups() > 0);
+    CHECK(stats.syscalls() > stats.pollWakeups());
+    return true;
+}
+
+// The lag is measured from the event timestamps, see main() for the stream
+bool test_lag(uint16_t port, const CDC::MockConfig&)
+{
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    const CDC::Stats& stats = conn.stats();
+    CHECK(conn.connect(TABLE));
+
+    // The first events were written a minute ago
+    CHECK(conn.read());
+    CHECK(stats.lag() >= 59000 && stats.lag() < 63000);
+    CHECK(stats.lagTime().count() == 1);
+
+    // The rest of the stream has already been received, the time it waits
+    // is counted in both lags
+    int64_t lag = stats.lag();
+    usleep(300000);
+    CHECK(conn.read());
+    CHECK(stats.receiveLag() >= 300);
+    CHECK(stats.lag() >= lag + 300);
+
+    CDC::Batch batch;
+    CHECK(conn.readBatch(batch, 1) == 1);
+    CHECK(stats.lag() >= 59000 && stats.lag() < 63000);
+
+    // An event from the future has a negative lag, counted as zero in the histogram
+    CHECK(conn.read());
+    CHECK(stats.lag() < -3000000);
+    CHECK(stats.lagTime().count() == 4);
+    CHECK(stats.lagTime().bucket(0) == 1);
+    return true;
+}
+
+// The value of the first key in Arrow metadata
+std::string arrow_metadata_value(const char* metadata, const std::string& key)
+{
+    int32_t n;
+    int32_t len;
+    memcpy(&n, metadata, sizeof(n));
+    metadata += sizeof(n);
+    memcpy(&len, metadata, sizeof(len));
+    metadata += sizeof(len);
+
+    if (n < 1 || std::string(metadata, len) != key)
+    {
+        return "";
+    }
+
+    metadata += len;
+    memcpy(&len, metadata, sizeof(len));
+    return std::string(metadata + sizeof(len), len);
+}
+
+bool arrow_valid(const ArrowArray* array, int64_t i)
+{
+    const uint8_t* validity = static_cast<const uint8_t*>(array->buffers[0]);
+    return !validity || (validity[i / 8] & (1 << (i % 8)));
+}
+
+std::string arrow_string(const ArrowArray* array, int64_t i)
+{
+    const int32_t* offsets = static_cast<const int32_t*>(array->buffers[1]);
+    const char* data = static_cast<const char*>(array->buffers[2]);
+    return std::string(data + offsets[i], offsets[i + 1] - offsets[i]);
+}
+
+// A batch exported through the Arrow C Data Interface, see main() for the stream
+bool test_arrow(uint16_t port, const CDC::MockConfig&)
+{
+    static const size_t ROWS = 100;
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CHECK(conn.connect(TABLE));
+
+    CDC::Batch batch;
+    CHECK(conn.readBatch(batch, ROWS) == ROWS);
+    size_t n_columns = batch.columns();
+
+    ArrowSchema schema;
+    ArrowArray array;
+    batch.exportArrow(&schema, &array);
+    CHECK(batch.length() == 0 && batch.columns() == 0);
+
+    CHECK(std::string(schema.format) == "+s");
+    CHECK(schema.n_children == (int64_t)n_columns);
+    CHECK(array.length == (int64_t)ROWS);
+    CHECK(array.n_children == (int64_t)n_columns);
+    CHECK(array.null_count == 0);
+
+    std::map<std::string, int64_t> fields;
+
+    for (int64_t i = 0; i < schema.n_children; i++)
+    {
+        fields[schema.children[i]->name] = i;
+        CHECK(array.children[i]->length == (int64_t)ROWS);
+        CHECK(array.children[i]->offset == 0);
+    }
+
+    CHECK(fields.count("id") && fields.count("price") && fields.count("name") && fields.count("kind") &&
+          fields.count("d") && fields.count("dt") && fields.count("event_type"));
+
+    // INT64 as int64, with the SQL type in the metadata
+    const ArrowSchema* f = schema.children[fields["id"]];
+    const ArrowArray* a = array.children[fields["id"]];
+    CHECK(std::string(f->format) == "l");
+    CHECK(f->flags & ARROW_FLAG_NULLABLE);
+    CHECK(arrow_metadata_value(f->metadata, "real_type") == "bigint(20)");
+    CHECK(a->n_buffers == 2 && a->null_count == 0 && a->buffers[0] == NULL);
+
+    for (size_t i = 0; i < ROWS; i++)
+    {
+        CHECK(static_cast<const int64_t*>(a->buffers[1])[i] == (int64_t)i);
+    }
+
+    // DOUBLE as float64 with every third value null
+    f = schema.children[fields["price"]];
+    a = array.children[fields["price"]];
+    CHECK(std::string(f->format) == "g");
+    CHECK(a->null_count == (int64_t)(ROWS + 2) / 3);
+
+    for (size_t i = 0; i < ROWS; i++)
+    {
+        CHECK(arrow_valid(a, i) == (i % 3 != 0));
+        CHECK(i % 3 == 0 || static_cast<const double*>(a->buffers[1])[i] == i * 0.5);
+    }
+
+    // Unique strings as utf8
+    f = schema.children[fields["name"]];
+    a = array.children[fields["name"]];
+    CHECK(std::string(f->format) == "u");
+    CHECK(f->dictionary == NULL && a->dictionary == NULL);
+    CHECK(a->n_buffers == 3);
+
+    for (size_t i = 0; i < ROWS; i++)
+    {
+        CHECK(arrow_string(a, i) == "name" + to_string(i));
+    }
+
+    // Repeated strings as int32 indices into a utf8 dictionary
+    f = schema.children[fields["kind"]];
+    a = array.children[fields["kind"]];
+    CHECK(std::string(f->format) == "i");
+    CHECK(f->dictionary && std::string(f->dictionary->format) == "u");
+    CHECK(a->dictionary && a->dictionary->length == 2 && a->dictionary->null_count == 0);
+    CHECK(a->n_buffers == 2);
+
+    for (size_t i = 0; i < ROWS; i++)
+    {
+        int32_t code = static_cast<const int32_t*>(a->buffers[1])[i];
+        CHECK(arrow_string(a->dictionary, code) == (i % 2 ? "odd" : "even"));
+    }
+
+    // DECIMAL as decimal128
+    f = schema.children[fields["d"]];
+    a = array.children[fields["d"]];
+    CHECK(std::string(f->format) == "d:12,3");
+    CHECK(arrow_metadata_value(f->metadata, "real_type") == "decimal(12,3)");
+
+    for (size_t i = 0; i < ROWS; i++)
+    {
+        CDC::Int128 value;
+        memcpy(&value, static_cast<const char*>(a->buffers[1]) + i * sizeof(value), sizeof(value));
+        CHECK(value == -(CDC::Int128)(i * 1001));
+    }
+
+    // DATETIME as microsecond timestamps
+    f = schema.children[fields["dt"]];
+    a = array.children[fields["dt"]];
+    CHECK(std::string(f->format) == "tsu:");
+
+    for (size_t i = 0; i < ROWS; i++)
+    {
+        CHECK(static_cast<const int64_t*>(a->buffers[1])[i] == 1500000000000000LL + (int64_t)i * 1000000);
+    }
+
+    // A child can be moved out and released after its parent
+    ArrowArray child = *array.children[fields["name"]];
+    array.children[fields["name"]]->release = NULL;
+    array.release(&array);
+    CHECK(array.release == NULL);
+    CHECK(arrow_string(&child, ROWS - 1) == "name" + to_string(ROWS - 1));
+    child.release(&child);
+    CHECK(child.release == NULL);
+
+    // The schema stays valid until it is released
+    CHECK(std::string(schema.children[fields["kind"]]->name) == "kind");
+    schema.release(&schema);
+    CHECK(schema.release == NULL);
+    return true;
+}
+
+struct BoundEvent
+{
+    BoundEvent():
+        sequence(0),
+        i0(0),
+        i1(0),
+        i2(0),
+        x1(-1),
+        missing(-1)
+    {
+    }
+
+    int64_t     sequence;
+    int         i0;
+    int16_t     i1;
+    double      i2;
+    std::string i0_text;
+    std::string s0;
+    std::string event_type;
+    int64_t     x1;
+    int64_t     missing;
+};
+
+// Counts the calls made to a decoder
+class CountingDecoder: public CDC::Decoder
+{
+public:
+    CountingDecoder():
+        schemas(0),
+        fields(0),
+        values(0),
+        typed(true)
+    {
+    }
+
+    void setSchema(const CDC::ValueList& keys, const CDC::ValueList& types)
+    {
+        schemas++;
+        fields = keys.size();
+        typed = typed && keys.size() == types.size();
+    }
+
+    void decode(size_t field, json_t*)
+    {
+        values += field < fields;
+    }
+
+    uint64_t schemas;
+    size_t   fields;
+    size_t   values;
+    bool     typed;   // Whether every schema had a type for each field
+};
+
+// Events decoded into a struct by field name across schema changes
+bool test_binding(uint16_t port, const CDC::MockConfig& config)
+{
+    CDC::Binding<BoundEvent> binding;
+    binding.bind("sequence", &BoundEvent::sequence)
+    .bind("i0", &BoundEvent::i0)
+    .bind("i1", &BoundEvent::i1)
+    .bind("i2", &BoundEvent::i2)
+    .bind("i0", &BoundEvent::i0_text)
+    .bind("s0", &BoundEvent::s0)
+    .bind("event_type", &BoundEvent::event_type)
+    .bind("x1", &BoundEvent::x1)
+    .bind("missing", &BoundEvent::missing);
+
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CHECK(conn.connect(TABLE));
+
+    // Every update is an update_before and an update_after event
+    uint64_t n_events = config.rows + config.rows / config.update_every;
+    uint64_t inserts = 0;
+    int64_t sequence = 1;
+
+    for (uint64_t i = 0; i < n_events; i++)
+    {
+        CHECK(conn.read(binding));
+        const BoundEvent& e = binding.value();
+        uint64_t id = e.event_type == "insert" ? inserts++ : inserts - 1;
+
+        CHECK(e.sequence == sequence || e.sequence == sequence + 1);
+        sequence = e.sequence;
+
+        // Numbers are converted to the type of the member, one field can have many members
+        CHECK(e.i0 == (int)id);
+        CHECK(e.i1 == (int16_t)(id * 2));
+        CHECK(e.i2 == id * 3.0);
+        CHECK(e.i0_text == to_string(id));
+        CHECK(e.s0 == string_value(config, id, 0, e.event_type == "update_after"));
+
+        // Members of fields that are not in the schema keep their default value
+        CHECK(e.x1 == (conn.fields().count("x1") ? 1 : -1));
+        CHECK(e.missing == -1);
+    }
+
+    CHECK(inserts == config.rows - config.rows / config.update_every);
+    CHECK(binding.value().x1 == 1);
+
+    // A decoder gets each schema once and every value of every event
+    CDC::Connection counted("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CHECK(counted.connect(TABLE));
+    CountingDecoder decoder;
+    size_t n_values = 0;
+
+    for (uint64_t i = 0; i < n_events; i++)
+    {
+        CHECK(counted.read(decoder));
+        n_values += decoder.fields;
+    }
+
+    CHECK(decoder.schemas == counted.stats().schemaChanges());
+    CHECK(decoder.schemas > 1);
+    CHECK(decoder.typed);
+    CHECK(decoder.values == n_values);
+    CHECK(!counted.read(decoder));
+    CHECK(counted.error() == CDC::TIMEOUT);
+    return true;
+}
+
+struct SchemaReader
+{
+    uint16_t           port;
+    uint64_t           rows;
+    const std::string* keys; // The first field name of the first schema, shared by all rows
+    bool               ok;
+};
+
+void* read_schemas(void* data)
+{
+    SchemaReader* reader = static_cast<SchemaReader*>(data);
+    CDC::Connection conn("127.0.0.1", reader->port, "cdcuser", "cdc", 1);
+    reader->ok = conn.connect(TABLE);
+
+    for (uint64_t i = 0; reader->ok && i < reader->rows; i++)
+    {
+        CDC::Row row = conn.read();
+        reader->ok = row;
+
+        if (row && i == 0)
+        {
+            reader->keys = &row->key(0);
+        }
+    }
+
+    return NULL;
+}
+
+// Connections that read the same schema share one parsed copy of it
+bool test_schema_cache(uint16_t port, const CDC::MockConfig& config)
+{
+    // The field names of a row are stored in its schema
+    CDC::Connection a("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CDC::Connection b("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CHECK(a.connect(TABLE));
+    CHECK(b.connect(TABLE));
+
+    CDC::Row first_a = a.read();
+    CDC::Row first_b = b.read();
+    CHECK(first_a && first_b);
+    CHECK(&first_a->key(0) == &first_b->key(0));
+
+    // A new schema is parsed once for both and the old one stays with its rows
+    CDC::Row changed_a;
+    CDC::Row changed_b;
+
+    for (uint64_t i = 1; i < config.schema_change_every + 1; i++)
+    {
+        changed_a = a.read();
+        changed_b = b.read();
+        CHECK(changed_a && changed_b);
+    }
+
+    CHECK(changed_a->length() == first_a->length() + 1);
+    CHECK(&changed_a->key(0) == &changed_b->key(0));
+    CHECK(&changed_a->key(0) != &first_a->key(0));
+
+    a.close();
+    b.close();
+    CHECK(first_a->key(first_a->length() - 1) == "s3");
+    CHECK(changed_b->key(changed_b->length() - 1) == "x0");
+
+    // A different schema is not shared
+    CDC::MockConfig other_config;
+    other_config.int_columns = 2;
+    CDC::MockServer other(other_config);
+    CHECK(other.start());
+    CDC::Connection c("127.0.0.1", other.port(), "cdcuser", "cdc", 1);
+    CHECK(c.connect(TABLE));
+    CDC::Row other_row = c.read();
+    CHECK(other_row);
+    CHECK(&other_row->key(0) != &first_a->key(0));
+    CHECK(other_row->length() == first_a->length() - 2);
+
+    // Threads that connect at the same time share the schema that is still in use
+    static const int THREADS = 8;
+    SchemaReader readers[THREADS];
+    pthread_t threads[THREADS];
+
+    for (int i = 0; i < THREADS; i++)
+    {
+        readers[i].port = port;
+        readers[i].rows = config.schema_change_every / 2;
+        readers[i].keys = NULL;
+        readers[i].ok = false;
+        CHECK(pthread_create(&threads[i], NULL, read_schemas, &readers[i]) == 0);
+    }
+
+    for (int i = 0; i < THREADS; i++)
+    {
+        pthread_join(threads[i], NULL);
+        CHECK(readers[i].ok);
+        CHECK(readers[i].keys == &first_a->key(0));
+    }
+
+    return true;
+}
+
+// Checks the string values of a batch read from the start of a generated stream
+bool check_strings(const CDC::Batch& batch, const CDC::MockConfig& config, uint64_t first)
+{
+    int s0 = column_index(batch, "s0");
+    int type = column_index(batch, "event_type");
+    CHECK(s0 != -1 && type != -1);
+
+    for (size_t i = 0; i < batch.length(); i++)
+    {
+        CHECK(batch.column(s0).stringValue(i) == string_value(config, first + i, 0, 0));
+        CHECK(batch.column(type).stringValue(i) == "insert");
+    }
+
+    return true;
+}
+
+// STRING columns are encoded up to the dictionary limit and plain strings after it
+bool test_dictionary(uint16_t port, const CDC::MockConfig& config)
+{
+    // The s0 column has 26 distinct values, event_type has one
+    static const size_t ROWS = 100;
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CHECK(conn.connect(TABLE));
+
+    CDC::Batch batch;
+    CHECK(conn.readBatch(batch, ROWS) == ROWS);
+    CHECK(check_strings(batch, config, 0));
+    const CDC::Column* s0 = &batch.column(column_index(batch, "s0"));
+    CHECK(s0->isDictionary());
+    CHECK(s0->offsets().size() == 27 && s0->codes().size() == ROWS);
+
+    // At most the limit of distinct values are encoded
+    conn.setDictionaryLimit(26);
+    CHECK(conn.readBatch(batch, ROWS) == ROWS);
+    CHECK(check_strings(batch, config, ROWS));
+    CHECK(batch.column(column_index(batch, "s0")).isDictionary());
+
+    // A column with more values falls back to plain strings, the others stay encoded
+    conn.setDictionaryLimit(25);
+    CHECK(conn.readBatch(batch, ROWS) == ROWS);
+    CHECK(check_strings(batch, config, 2 * ROWS));
+    s0 = &batch.column(column_index(batch, "s0"));
+    CHECK(!s0->isDictionary());
+    CHECK(s0->codes().empty() && s0->offsets().size() == ROWS + 1);
+    CHECK(s0->data().size() == ROWS * config.string_size);
+    CHECK(batch.column(column_index(batch, "event_type")).isDictionary());
+
+    // The decision is made again for each batch
+    conn.setDictionaryLimit(1024);
+    CHECK(conn.readBatch(batch, ROWS) == ROWS);
+    CHECK(check_strings(batch, config, 3 * ROWS));
+    CHECK(batch.column(column_index(batch, "s0")).isDictionary());
+
+    // A limit of zero disables the encoding
+    conn.setDictionaryLimit(0);
+    CHECK(conn.readBatch(batch, ROWS) == ROWS);
+    CHECK(check_strings(batch, config, 4 * ROWS));
+
+    for (size_t i = 0; i < batch.columns(); i++)
+    {
+        CHECK(!batch.column(i).isDictionary());
+    }
+
+    return true;
+}
+
+// All values of a row, separated by tabs
+std::string row_values(const CDC::Row& row)
+{
+    std::string rval;
+
+    for (size_t i = 0; i < row->length(); i++)
+    {
+        rval += row->value(i) + "\t";
+    }
+
+    return rval;
+}
+
+// A captured stream replays the same rows, also through a Connection reference
+bool test_replay(uint16_t port, const CDC::MockConfig& config)
+{
+    int fd = open(STREAM_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    CHECK(fd != -1);
+
+    std::vector<std::string> rows;
+
+    {
+        CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+        conn.setCapture(fd);
+        CHECK(conn.connect(TABLE));
+
+        while (CDC::Row row = conn.read())
+        {
+            rows.push_back(row_values(row));
+        }
+
+        CHECK(conn.error() == CDC::TIMEOUT);
+    }
+
+    close(fd);
+    // Every update is an update_before and an update_after row
+    CHECK(rows.size() == config.rows + config.rows / config.update_every);
+
+    CDC::ReplaySource replay(STREAM_FILE);
+    CDC::Connection& conn = replay;
+
+    // Connecting asynchronously is refused instead of connecting to a server
+    CHECK(!conn.connectAsync(TABLE));
+    CHECK(!conn.error().empty());
+
+    // Connecting twice starts the replay over
+    for (int i = 0; i < 2; i++)
+    {
+        CHECK(conn.connect(TABLE));
+        size_t n = 0;
+
+        while (CDC::Row row = conn.read())
+        {
+            CHECK(n < rows.size());
+            CHECK(row_values(row) == rows[n++]);
+        }
+
+        CHECK(conn.error() == CDC::END_OF_STREAM);
+        CHECK(n == rows.size());
+    }
+
+    remove(STREAM_FILE);
+    return true;
+}
+
+// Records which worker processed the events of each row and when
+class RecordingHandler: public CDC::RowHandler
+{
+public:
+    RecordingHandler()
+    {
+        pthread_mutex_init(&m_lock, NULL);
+    }
+
+    ~RecordingHandler()
+    {
+        pthread_mutex_destroy(&m_lock);
+    }
+
+    void process(size_t worker, const CDC::Row& row)
+    {
+        if (atoi(row->value("i0").c_str()) % 5 == 0)
+        {
+            // Keep some of the workers behind the others
+            usleep(100);
+        }
+
+        pthread_mutex_lock(&m_lock);
+        workers[row->value("i0")].insert(worker);
+        events[row->value("i0")].push_back(row->value("event_type"));
+        size_t sequence = atoi(row->value("sequence").c_str());
+
+        if (trx_events.size() <= sequence)
+        {
+            trx_events.resize(sequence + 1);
+        }
+
+        trx_events[sequence]++;
+        pthread_mutex_unlock(&m_lock);
+    }
+
+    // The number of processed events of each transaction, indexed by sequence
+    std::vector<int> processed()
+    {
+        pthread_mutex_lock(&m_lock);
+        std::vector<int> rval = trx_events;
+        pthread_mutex_unlock(&m_lock);
+        return rval;
+    }
+
+    std::map<std::string, std::set<size_t> >          workers;
+    std::map<std::string, std::vector<std::string> > events;
+    std::vector<int>                                  trx_events;
+
+private:
+    pthread_mutex_t m_lock;
+};
+
+bool test_dispatcher(uint16_t port, const CDC::MockConfig& config)
+{
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CHECK(conn.connect(TABLE));
+
+    RecordingHandler handler;
+    CDC::ValueList key;
+    key.push_back("i0");
+
+    // The watermarks seen while dispatching and what was processed at the time
+    std::vector<std::pair<size_t, std::vector<int> > > watermarks;
+
+    {
+        // Small queues so that dispatch() also waits for the workers
+        CDC::Dispatcher dispatcher(conn, key, handler, 3, 8);
+        size_t last = 0;
+
+        while (dispatcher.dispatch())
+        {
+            const std::string& watermark = dispatcher.watermark();
+
+            if (!watermark.empty())
+            {
+                size_t sequence = atoi(watermark.substr(watermark.rfind('-') + 1).c_str());
+                CHECK(watermark == gtid(sequence));
+                CHECK(sequence >= last);
+
+                if (sequence > last)
+                {
+                    watermarks.push_back(std::make_pair(sequence, handler.processed()));
+                    last = sequence;
+                }
+            }
+        }
+
+        CHECK(dispatcher.error() == CDC::TIMEOUT);
+        dispatcher.stop();
+
+        // The last transaction is not known to be complete
+        uint64_t n_trx = config.rows / config.rows_per_trx;
+        CHECK(dispatcher.watermark() == gtid(n_trx - 1));
+    }
+
+    CHECK(!watermarks.empty());
+
+    // All events of the transactions up to a watermark were processed when it was reported
+    for (size_t i = 0; i < watermarks.size(); i++)
+    {
+        for (size_t j = 1; j <= watermarks[i].first; j++)
+        {
+            CHECK(j < watermarks[i].second.size());
+            CHECK(watermarks[i].second[j] == handler.trx_events[j]);
+        }
+    }
+
+    // The events of a row are processed by one worker in the order they were read
+    CHECK(handler.events.size() == config.rows - config.rows / config.update_every);
+
+    for (std::map<std::string, std::vector<std::string> >::iterator it = handler.events.begin();
+         it != handler.events.end(); it++)
+    {
+        CHECK(handler.workers[it->first].size() == 1);
+        CHECK(it->second[0] == "insert");
+        CHECK(it->second.size() % 2 == 1);
+
+        for (size_t i = 1; i < it->second.size(); i += 2)
+        {
+            CHECK(it->second[i] == "update_before");
+            CHECK(it->second[i + 1] == "update_after");
+        }
+    }
+
+    return true;
+}
+
+// The number of spool segment files in a directory
+int spool_segments(const char* dir)
+{
+    int rval = 0;
+
+    if (DIR* d = opendir(dir))
+    {
+        while (struct dirent* ent = readdir(d))
+        {
+            rval += strncmp(ent->d_name, "cdc_spool.", 10) == 0;
+        }
+
+        closedir(d);
+    }
+
+    return rval;
+}
+
+// The stream is read through a spool that stays within its disk limit
+bool test_spool(uint16_t port, const CDC::MockConfig& config)
+{
+    static const size_t SEGMENT = 16384;
+    static const int MAX_SEGMENTS = 3;
+    std::string leftover = std::string(SPOOL_DIR) + "/cdc_spool.1000";
+    std::string other = std::string(SPOOL_DIR) + "/other";
+    mkdir(SPOOL_DIR, 0755);
+    CHECK(write_file(leftover.c_str(), "{\"leftover\": true}\n"));
+    CHECK(write_file(other.c_str(), "not a segment"));
+
+    {
+        CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+        conn.setSpool(SPOOL_DIR, SEGMENT, SEGMENT * MAX_SEGMENTS);
+        CHECK(conn.connect(TABLE));
+
+        // Segments of an earlier spool are removed, other files are not
+        CHECK(access(leftover.c_str(), F_OK) == -1);
+        CHECK(access(other.c_str(), F_OK) == 0);
+
+        CDC::Row row = conn.read();
+        CHECK(row && row->value("i0") == "0");
+
+        // While the rows are not read, the writer stops at the limit
+        usleep(500000);
+        CHECK(spool_segments(SPOOL_DIR) == MAX_SEGMENTS);
+        size_t size = CDC::MockServer::generate(config).size();
+        CHECK(conn.stats().bytes() < size / 2);
+
+        for (uint64_t i = 1; i < config.rows; i++)
+        {
+            row = conn.read();
+            CHECK(row);
+            CHECK(row->value("i0") == to_string(i));
+            CHECK(spool_segments(SPOOL_DIR) <= MAX_SEGMENTS);
+        }
+
+        CHECK(!conn.read());
+        CHECK(conn.error() == CDC::TIMEOUT);
+        CHECK(conn.stats().bytes() > size);
+    }
+
+    // Closing the connection removes the spool
+    CHECK(spool_segments(SPOOL_DIR) == 0);
+    remove(other.c_str());
+    rmdir(SPOOL_DIR);
+    return true;
+}
+
+// Writes a generated stream to STREAM_FILE with its first event replaced
+bool write_stream(const CDC::MockConfig& config, const std::string& first_type)
+{
+    static const char TYPE[] = "\"event_type\": \"insert\"";
+    std::string stream = CDC::MockServer::generate(config);
+    size_t pos = stream.find(TYPE);
+
+    if (pos != std::string::npos)
+    {
+        stream.replace(pos, sizeof(TYPE) - 1, "\"event_type\": \"" + first_type + "\"");
+    }
+
+    return write_file(STREAM_FILE, stream);
+}
+
+// Starts a mock server and runs a test against it
+template <class Test>
+bool run(const char* name, const CDC::MockConfig& config, Test test)
+{
+    CDC::MockServer server(config);
+    bool ok = server.start();
+
+    if (!ok)
+    {
+        std::cout << server.error() << std::endl;
+    }
+    else
+    {
+        ok = test(server.port(), config);
+    }
+
+    std::cout << name << ": " << (ok ? "OK" : "FAILED") << std::endl;
+    return ok;
+}
+
+bool checkpoint(uint16_t port, const CDC::MockConfig&)
+{
+    return test_checkpoint(port);
+}
+
+}
+
+int main()
+{
+    int failures = 0;
+
+    bool ok = test_parse_decimal();
+    std::cout << "parse_decimal: " << (ok ? "OK" : "FAILED") << std::endl;
+    failures += !ok;
+
+    ok = test_parse_datetime();
+    std::cout << "parse_datetime: " << (ok ? "OK" : "FAILED") << std::endl;
+    failures += !ok;
+
+    CDC::MockConfig typed;
+    std::string fields =
+        "{\"name\": \"d\", \"type\": [\"null\", \"string\"], \"real_type\": \"decimal(10,4)\", \"length\": -1}, "
+        "{\"name\": \"r\", \"type\": [\"null\", \"double\"], \"real_type\": \"decimal\", \"precision\": 8, "
+        "\"scale\": 2, \"length\": 8}, "
+        "{\"name\": \"dt\", \"type\": [\"null\", \"string\"], \"real_type\": \"datetime\", \"length\": -1}";
+
+    if (write_file(STREAM_FILE, schema_line(fields) +
+                   event_line(1, "\"d\": \"-123456.7891\", \"r\": 1.2345e2, \"dt\": \"2017-07-14 02:40:00.5\"") +
+                   event_line(2, "\"d\": \"0.00005\", \"r\": -0.005, \"dt\": \"1969-12-31 23:59:59.999999\"") +
+                   event_line(3, "\"d\": \"1234567.0000\", \"r\": 1e8, \"dt\": \"0000-00-00 00:00:00\"") +
+                   event_line(4, "\"d\": null, \"r\": 1.5, \"dt\": \"2017-02-29 00:00:00\"") +
+                   event_line(5, "\"d\": \"-0.00004\", \"r\": null, \"dt\": \"2000-02-29\"") +
+                   event_line(6, "\"d\": \"9999.99995\", \"r\": -999999.99, \"dt\": \"1970-01-01 00:00:00.000001\"")))
+    {
+        typed.file = STREAM_FILE;
+        failures += !run("DECIMAL and DATETIME columns", typed, test_typed_columns);
+    }
+    else
+    {
+        std::cout << "Failed to write " << STREAM_FILE << std::endl;
+        failures++;
+    }
+
+    CDC::MockConfig trx;
+    trx.rows = 15;
+    trx.rows_per_trx = 3;
+    trx.drip_delay = 10;
+    trx.pause_every = 5;
+    trx.pause_time = 1500000;
+    failures += !run("readTransaction", trx, test_read_transaction);
+
+    CDC::MockConfig updates;
+    updates.rows = 30;
+    updates.update_every = 3;
+    failures += !run("update pairing", updates, test_update_pairing);
+    failures += !run("readBuffered pairing", updates, test_buffered_pairing);
+
+    CDC::MockConfig reconnect;
+    reconnect.rows = 2000;
+    failures += !run("connectAsync reconnect", reconnect, test_async_reconnect);
+
+    CDC::MockConfig unpaired;
+    unpaired.rows = 3;
+
+    if (write_stream(unpaired, "update_before"))
+    {
+        unpaired.file = STREAM_FILE;
+        unpaired.rows = 0;
+        failures += !run("readBuffered unpaired", unpaired, test_buffered_unpaired);
+    }
+    else
+    {
+        std::cout << "Failed to write " << STREAM_FILE << std::endl;
+        failures++;
+    }
+
+    remove(STREAM_FILE);
+
+    CDC::MockConfig changes;
+    changes.rows = 200;
+    changes.update_every = 3;
+    changes.delete_every = 7;
+    failures += !run("Coalescer", changes, test_coalescer);
+
+    CDC::MockConfig table;
+    table.rows = 400;
+    table.rows_per_trx = 4;
+    table.update_every = 3;
+    table.delete_every = 7;
+    table.schema_change_every = 150;
+    failures += !run("MaterializedTable", table, test_materialized_table);
+    failures += !run("MaterializedTable error", table, test_materialized_table_error);
+
+    CDC::MockConfig batch;
+    batch.rows = 500;
+    failures += !run("readBatch", batch, test_batch);
+
+    CDC::MockConfig checkpoints;
+    checkpoints.rows = 20;
+    checkpoints.rows_per_trx = 2;
+    failures += !run("checkpoints", checkpoints, checkpoint);
+    failures += !run("batch checkpoints", checkpoints, test_batch_checkpoint);
+
+    CDC::MockConfig capture;
+    capture.rows = 100;
+    capture.rows_per_trx = 3;
+    capture.update_every = 5;
+    capture.schema_change_every = 40;
+    failures += !run("capture and replay", capture, test_replay);
+
+    CDC::MockConfig stats;
+    stats.rows = 500;
+    stats.schema_change_every = 120;
+    failures += !run("Stats", stats, test_stats);
+
+    uint64_t now = time(NULL);
+    CDC::MockConfig lag;
+    lag.file = STREAM_FILE;
+
+    if (write_file(STREAM_FILE, schema_line("{\"name\": \"i0\", \"type\": \"long\"}") +
+                   event_line(1, "\"i0\": 1", now - 60) +
+                   event_line(2, "\"i0\": 2", now - 60) +
+                   event_line(3, "\"i0\": 3", now - 60) +
+                   event_line(4, "\"i0\": 4", now + 3600)))
+    {
+        failures += !run("lag", lag, test_lag);
+    }
+    else
+    {
+        std::cout << "Failed to write " << STREAM_FILE << std::endl;
+        failures++;
+    }
+
+    std::string arrow_stream = schema_line(
+        "{\"name\": \"id\", \"type\": \"long\", \"real_type\": \"bigint\", \"length\": 20}, "
+        "{\"name\": \"price\", \"type\": [\"null\", \"double\"], \"real_type\": \"double\", \"length\": -1}, "
+        "{\"name\": \"name\", \"type\": \"string\", \"real_type\": \"varchar\", \"length\": 20}, "
+        "{\"name\": \"kind\", \"type\": \"string\", \"real_type\": \"varchar\", \"length\": 20}, "
+        "{\"name\": \"d\", \"type\": \"string\", \"real_type\": \"decimal(12,3)\", \"length\": -1}, "
+        "{\"name\": \"dt\", \"type\": \"string\", \"real_type\": \"datetime\", \"length\": -1}");
+
+    // Enough rows for the unique strings to be stored as plain strings
+    for (uint64_t i = 0; i < 100; i++)
+    {
+        std::stringstream ss;
+        ss << "\"id\": " << i << ", \"price\": ";
+
+        if (i % 3)
+        {
+            ss << i * 0.5;
+        }
+        else
+        {
+            ss << "null";
+        }
+
+        ss << ", \"name\": \"name" << i << "\", \"kind\": \"" << (i % 2 ? "odd" : "even")
+           << "\", \"d\": \"-" << i << "." << std::setw(3) << std::setfill('0') << i
+           << "\", \"dt\": \"2017-07-14 02:" << 40 + i / 60 << ":" << std::setw(2) << i % 60 << "\"";
+        arrow_stream += event_line(i + 1, ss.str());
+    }
+
+    CDC::MockConfig arrow;
+    arrow.file = STREAM_FILE;
+
+    if (write_file(STREAM_FILE, arrow_stream))
+    {
+        failures += !run("Arrow export", arrow, test_arrow);
+    }
+    else
+    {
+        std::cout << "Failed to write " << STREAM_FILE << std::endl;
+        failures++;
+    }
+
+    CDC::MockConfig binding;
+    binding.rows = 300;
+    binding.int_columns = 3;
+    binding.rows_per_trx = 3;
+    binding.update_every = 4;
+    binding.schema_change_every = 100;
+    failures += !run("Binding and Decoder", binding, test_binding);
+
+    CDC::MockConfig schemas;
+    schemas.rows = 200;
+    schemas.schema_change_every = 50;
+    failures += !run("shared schemas", schemas, test_schema_cache);
+
+    CDC::MockConfig dictionary;
+    dictionary.rows = 500;
+    dictionary.string_columns = 1;
+    failures += !run("dictionary limit", dictionary, test_dictionary);
+
+    // The capture is compared to a recorded stream, the generated one has the current time in it
+    CDC::MockConfig captured;
+    captured.rows = 300;
+    captured.string_size = 50;
+    captured.schema_change_every = 100;
+
+    if (write_file(CAPTURE_SOURCE, CDC::MockServer::generate(captured)))
+    {
+        captured.rows = 0;
+        captured.file = CAPTURE_SOURCE;
+        failures += !run("capture", captured, test_capture);
+    }
+    else
+    {
+        std::cout << "Failed to write " << CAPTURE_SOURCE << std::endl;
+        failures++;
+    }
+
+    remove(CAPTURE_SOURCE);
+
+    CDC::MockConfig dispatch;
+    dispatch.rows = 600;
+    dispatch.rows_per_trx = 4;
+    dispatch.update_every = 3;
+    failures += !run("Dispatcher", dispatch, test_dispatcher);
+
+    CDC::MockConfig spool;
+    spool.rows = 2000;
+    spool.string_size = 100;
+    failures += !run("spool", spool, test_spool);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,163 @@
+/* Copyright (c) 2017, MariaDB Corporation. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301  USA
+ */
+
+/**
+ * Tests for the coroutine interface, run against the mock server. Built only
+ * when the compiler supports C++20.
+ */
+
+#include "../cdc_coro.h"
+#include "../mock/mock_server.h"
+
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+// Like CHECK in test_connector.cpp but for coroutines
+#define CHECK(expr) \
+    do \
+    { \
+        if (!(expr)) \
+        { \
+            std::cout << __FILE__ << ":" << __LINE__ << ": " << #expr << std::endl; \
+            failures++; \
+            co_return; \
+        } \
+    } \
+    while (false)
+
+static const char TABLE[] = "test.t1";
+static const size_t STREAMS = 8;
+
+namespace
+{
+
+std::string to_string(uint64_t value)
+{
+    std::stringstream ss;
+    ss << value;
+    return ss.str();
+}
+
+// Reads the whole generated stream in batches, twice over the same connection
+CDC::coro::Task<void> read_batches(CDC::coro::Executor& exec, uint16_t port, const CDC::MockConfig& config,
+                                   std::atomic<int>& failures)
+{
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CDC::coro::Stream stream(exec, conn);
+
+    for (int i = 0; i < 2; i++)
+    {
+        // The second connect replaces the first one
+        CHECK(stream.connect(TABLE));
+        CDC::RowList rows;
+        uint64_t n_rows = 0;
+
+        while (n_rows < config.rows)
+        {
+            size_t n = co_await stream.nextBatch(rows, 64);
+            CHECK(n > 0);
+            CHECK(rows.size() == n);
+
+            for (size_t j = 0; j < n; j++)
+            {
+                CHECK(rows[j]->value("i0") == to_string(n_rows++));
+            }
+        }
+
+        CHECK(n_rows == config.rows);
+        CHECK(stream.error().empty());
+    }
+}
+
+// Reads the whole generated stream one row at a time
+CDC::coro::Task<void> read_rows(CDC::coro::Executor& exec, uint16_t port, const CDC::MockConfig& config,
+                                std::atomic<int>& failures)
+{
+    CDC::Connection conn("127.0.0.1", port, "cdcuser", "cdc", 1);
+    CDC::coro::Stream stream(exec, conn);
+    CHECK(stream.connect(TABLE));
+
+    for (uint64_t n_rows = 0; n_rows < config.rows; n_rows++)
+    {
+        CDC::Row row = co_await stream.next();
+        CHECK(row);
+        CHECK(row->value("i0") == to_string(n_rows));
+    }
+}
+
+// A connection that is refused reports the error instead of waiting
+CDC::coro::Task<void> read_refused(CDC::coro::Executor& exec, std::atomic<int>& failures)
+{
+    CDC::Connection conn("127.0.0.1", 1, "cdcuser", "cdc", 1);
+    CDC::coro::Stream stream(exec, conn);
+    CHECK(stream.connect(TABLE));
+
+    CDC::Row row = co_await stream.next();
+    CHECK(!row);
+    CHECK(!stream.error().empty());
+}
+
+}
+
+int main()
+{
+    CDC::MockConfig config;
+    config.rows = 2000;
+    config.rows_per_trx = 4;
+    config.rate = 20000;
+    CDC::MockServer server(config);
+
+    if (!server.start())
+    {
+        std::cout << server.error() << std::endl;
+        return 1;
+    }
+
+    std::atomic<int> failures(0);
+
+    {
+        // More streams than threads, so the coroutines move between threads
+        CDC::coro::Executor exec(3);
+
+        if (!exec.error().empty())
+        {
+            std::cout << exec.error() << std::endl;
+            return 1;
+        }
+
+        for (size_t i = 0; i < STREAMS; i++)
+        {
+            if (i % 2)
+            {
+                exec.spawn(read_rows(exec, server.port(), config, failures));
+            }
+            else
+            {
+                exec.spawn(read_batches(exec, server.port(), config, failures));
+            }
+        }
+
+        exec.spawn(read_refused(exec, failures));
+        exec.wait();
+    }
+
+    std::cout << "coroutine streams: " << (failures ? "FAILED" : "OK") << std::endl;
+    return failures ? 1 : 0;
+}